@@ -0,0 +1,384 @@
+// Copyright (c) 2012-2014 The PHP Desktop authors. All rights reserved.
+// License: New BSD License.
+// Website: http://code.google.com/p/phpdesktop/
+
+// Measures json.c on settings.json and on generated documents: an array
+// of objects, a string-heavy and a number-heavy document. Reports parse
+// speed with the scalar and the SSE2 fast paths, parse+free with
+// json_enable_arena, json_serialize() speed and member lookups in a wide
+// object with and without json_enable_key_index. Also checks that both
+// fast paths and a serialize round trip give the same tree. Exits with 1
+// on a mismatch.
+//
+// Build from this directory with the Visual Studio command prompt:
+//   cl /O2 /W3 /I ..\phpdesktop-chrome57 json-bench.c
+// Usage:
+//   json-bench.exe [settings.json]
+
+#include "json.c"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Each measurement repeats its run for at least this long.
+#define MIN_SECONDS 0.5
+
+#define NUM_WIDE_MEMBERS 1000
+
+struct document {
+  const char *name;
+  char *json;
+  size_t len;
+};
+
+static double now_seconds(void) {
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double) counter.QuadPart / (double) frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static void use_fast_paths(int sse2) {
+  scan_string = scan_string_scalar;
+  skip_blanks = skip_blanks_scalar;
+#ifdef json_sse2
+  if (sse2 && json_cpu_has_sse2()) {
+    scan_string = scan_string_sse2;
+    skip_blanks = skip_blanks_sse2;
+  }
+#else
+  (void) sse2;
+#endif
+}
+
+static json_value *parse(const char *json, int flags) {
+  json_settings settings;
+  char error[128];
+  json_value *value;
+
+  memset(&settings, 0, sizeof(settings));
+  settings.settings = flags;
+  if ((value = json_parse_ex(&settings, json, error)) == NULL) {
+    printf("Parse error: %s\n", error);
+    exit(1);
+  }
+  return value;
+}
+
+static void free_value(json_value *value, int flags) {
+  if (flags & json_enable_arena) {
+    json_arena_free(value);
+  } else {
+    json_value_free(value);
+  }
+}
+
+// Returns the compact serialization, to be freed by the caller.
+static char *serialize(const json_value *value) {
+  json_buffer buffer;
+
+  json_buffer_init(&buffer, NULL, 0, json_serialize_compact);
+  if (!json_serialize(&buffer, value)) {
+    printf("Out of memory\n");
+    exit(1);
+  }
+  return buffer.buf;
+}
+
+static double parse_mb_per_second(const struct document *doc, int flags) {
+  double start = now_seconds(), elapsed;
+  long runs = 0;
+
+  do {
+    free_value(parse(doc->json, flags), flags);
+    runs++;
+  } while ((elapsed = now_seconds() - start) < MIN_SECONDS);
+
+  return doc->len * (double) runs / elapsed / 1e6;
+}
+
+static double serialize_mb_per_second(const struct document *doc) {
+  json_value *value = parse(doc->json, 0);
+  json_buffer buffer;
+  double start = now_seconds(), elapsed;
+  size_t bytes = 0;
+
+  do {
+    json_buffer_init(&buffer, NULL, 0, json_serialize_compact);
+    json_serialize(&buffer, value);
+    bytes += buffer.length;
+    json_buffer_free(&buffer);
+  } while ((elapsed = now_seconds() - start) < MIN_SECONDS);
+
+  json_value_free(value);
+  return bytes / elapsed / 1e6;
+}
+
+// Returns 1 if both trees hold the same values. Doubles may differ in
+// the last digits, as the parser does not round them exactly.
+static int same_value(const json_value *a, const json_value *b) {
+  unsigned int i;
+
+  if (a->type != b->type) {
+    return 0;
+  }
+  switch (a->type) {
+    case json_object:
+      if (a->u.object.length != b->u.object.length) {
+        return 0;
+      }
+      for (i = 0; i < a->u.object.length; i++) {
+        if (strcmp(a->u.object.values[i].name, b->u.object.values[i].name) ||
+            !same_value(a->u.object.values[i].value,
+                        b->u.object.values[i].value)) {
+          return 0;
+        }
+      }
+      return 1;
+    case json_array:
+      if (a->u.array.length != b->u.array.length) {
+        return 0;
+      }
+      for (i = 0; i < a->u.array.length; i++) {
+        if (!same_value(a->u.array.values[i], b->u.array.values[i])) {
+          return 0;
+        }
+      }
+      return 1;
+    case json_integer:
+      return a->u.integer == b->u.integer;
+    case json_double:
+      return fabs(a->u.dbl - b->u.dbl) <= fabs(a->u.dbl) * 1e-12;
+    case json_string:
+      return a->u.string.length == b->u.string.length &&
+        !memcmp(a->u.string.ptr, b->u.string.ptr, a->u.string.length);
+    case json_boolean:
+      return a->u.boolean == b->u.boolean;
+    default:
+      return 1;
+  }
+}
+
+// Checks that both fast paths give the same tree, and that the tree
+// parsed back from the serialized output matches. Returns 0 if not.
+static int check_round_trip(const struct document *doc) {
+  json_value *scalar, *sse2, *again;
+  char *json;
+  int ok;
+
+  use_fast_paths(0);
+  scalar = parse(doc->json, 0);
+  json = serialize(scalar);
+
+  use_fast_paths(1);
+  sse2 = parse(doc->json, json_enable_arena);
+  again = parse(json, 0);
+
+  ok = same_value(scalar, sse2) && same_value(scalar, again);
+  json_value_free(scalar);
+  json_arena_free(sse2);
+  json_value_free(again);
+  free(json);
+  return ok;
+}
+
+static char *read_file(const char *path, size_t *len) {
+  FILE *fp = fopen(path, "rb");
+  char *buf = NULL;
+  long size;
+
+  if (fp != NULL && fseek(fp, 0, SEEK_END) == 0 &&
+      (size = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+      (buf = (char *) malloc(size + 1)) != NULL) {
+    *len = fread(buf, 1, size, fp);
+    buf[*len] = '\0';
+  }
+  if (fp != NULL) {
+    fclose(fp);
+  }
+  return buf;
+}
+
+static void make_objects(json_buffer *buffer) {
+  char name[32];
+  int i, n;
+
+  json_write_array_begin(buffer);
+  for (i = 0; i < 20000; i++) {
+    json_write_object_begin(buffer);
+    json_write_key(buffer, "id", 2);
+    json_write_integer(buffer, i);
+    json_write_key(buffer, "name", 4);
+    n = sprintf(name, "Item number %d", i);
+    json_write_string(buffer, name, n);
+    json_write_key(buffer, "enabled", 7);
+    json_write_boolean(buffer, i % 3 != 0);
+    json_write_key(buffer, "price", 5);
+    json_write_double(buffer, i * 0.25);
+    json_write_key(buffer, "tags", 4);
+    json_write_array_begin(buffer);
+    json_write_string(buffer, "red", 3);
+    json_write_string(buffer, "large", 5);
+    json_write_array_end(buffer);
+    json_write_key(buffer, "parent", 6);
+    json_write_null(buffer);
+    json_write_object_end(buffer);
+  }
+  json_write_array_end(buffer);
+}
+
+static void make_strings(json_buffer *buffer) {
+  static const char *words[] = {
+    "lorem ", "ipsum ", "dolor ", "sit ", "amet, ", "consectetur ",
+    "\"quoted\" ", "C:\\path\\to\\file ", "line\n", "caf\xc3\xa9 ",
+  };
+  char text[512];
+  int i, j, n;
+
+  json_write_array_begin(buffer);
+  for (i = 0; i < 5000; i++) {
+    for (n = 0, j = 0; j < 40; j++) {
+      // Escapes are rare in real strings, most words are plain.
+      n += sprintf(text + n, "%s",
+                   words[(i * 3 + j) % 20 < 17 ? j % 6 : 6 + j % 4]);
+    }
+    json_write_string(buffer, text, n);
+  }
+  json_write_array_end(buffer);
+}
+
+static void make_numbers(json_buffer *buffer) {
+  int i;
+
+  json_write_array_begin(buffer);
+  for (i = 0; i < 200000; i++) {
+    switch (i % 4) {
+      case 0: json_write_integer(buffer, i); break;
+      case 1: json_write_integer(buffer, -1234567890123LL + i); break;
+      case 2: json_write_double(buffer, i / 7.0); break;
+      default: json_write_double(buffer, i * 1.5e-9); break;
+    }
+  }
+  json_write_array_end(buffer);
+}
+
+static void make_document(struct document *doc, const char *name,
+                          void (*make)(json_buffer *), int indent) {
+  json_buffer buffer;
+
+  json_buffer_init(&buffer, NULL, 0, indent);
+  make(&buffer);
+  if (buffer.failed) {
+    printf("Out of memory\n");
+    exit(1);
+  }
+  doc->name = name;
+  doc->json = buffer.buf;
+  doc->len = buffer.length;
+}
+
+static void make_wide_object(json_buffer *buffer) {
+  char key[32];
+  int i;
+
+  json_write_object_begin(buffer);
+  for (i = 0; i < NUM_WIDE_MEMBERS; i++) {
+    json_write_key(buffer, key, sprintf(key, "member_%d", i));
+    json_write_integer(buffer, i);
+  }
+  json_write_object_end(buffer);
+}
+
+// Looks up every member in turn, returns lookups per second, or -1 if a
+// lookup returned the wrong member.
+static double lookups_per_second(const struct document *doc, int flags) {
+  json_value *value = parse(doc->json, flags);
+  const json_value *member;
+  double start = now_seconds(), elapsed;
+  long lookups = 0;
+  char key[32];
+  int i;
+
+  do {
+    for (i = 0; i < NUM_WIDE_MEMBERS; i++) {
+      sprintf(key, "member_%d", i);
+      member = json_object_get(value, key);
+      if (member == NULL || member->u.integer != i) {
+        json_value_free(value);
+        return -1;
+      }
+    }
+    lookups += NUM_WIDE_MEMBERS;
+  } while ((elapsed = now_seconds() - start) < MIN_SECONDS);
+
+  json_value_free(value);
+  return lookups / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  const char *settings_path = argc > 1 ? argv[1] :
+      "../phpdesktop-chrome57/settings.json";
+  struct document docs[4], wide;
+  double linear, indexed;
+  int i, num_docs = 0, mismatches = 0;
+
+  if ((docs[0].json = read_file(settings_path, &docs[0].len)) != NULL) {
+    docs[0].name = "settings.json";
+    num_docs++;
+  } else {
+    printf("Cannot read %s, skipping it\n", settings_path);
+  }
+  make_document(&docs[num_docs++], "objects", make_objects,
+                json_serialize_pretty);
+  make_document(&docs[num_docs++], "strings", make_strings,
+                json_serialize_compact);
+  make_document(&docs[num_docs++], "numbers", make_numbers,
+                json_serialize_compact);
+
+#ifndef json_sse2
+  printf("Built without SSE2, both columns use the scalar path\n");
+#endif
+  printf("%-14s %10s %10s %10s %10s %10s\n", "MB/s", "size KB",
+         "scalar", "sse2", "arena", "serialize");
+  for (i = 0; i < num_docs; i++) {
+    printf("%-14s %10.1f", docs[i].name, docs[i].len / 1024.0);
+    use_fast_paths(0);
+    printf(" %10.1f", parse_mb_per_second(&docs[i], 0));
+    use_fast_paths(1);
+    printf(" %10.1f", parse_mb_per_second(&docs[i], 0));
+    printf(" %10.1f", parse_mb_per_second(&docs[i], json_enable_arena));
+    printf(" %10.1f\n", serialize_mb_per_second(&docs[i]));
+    if (!check_round_trip(&docs[i])) {
+      printf("Mismatch: %s differs between fast paths or after a "
+             "serialize round trip\n", docs[i].name);
+      mismatches++;
+    }
+  }
+
+  make_document(&wide, "wide", make_wide_object, json_serialize_compact);
+  linear = lookups_per_second(&wide, 0);
+  indexed = lookups_per_second(&wide, json_enable_key_index);
+  if (linear < 0 || indexed < 0) {
+    printf("Mismatch: json_object_get returned the wrong member\n");
+    mismatches++;
+  } else {
+    printf("Lookups in a %d member object: %.2f M/s linear, "
+           "%.2f M/s with json_enable_key_index\n",
+           NUM_WIDE_MEMBERS, linear / 1e6, indexed / 1e6);
+  }
+
+  for (i = 0; i < num_docs; i++) {
+    free(docs[i].json);
+  }
+  free(wide.json);
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+// Copyright (c) 2012-2014 The PHP Desktop authors. All rights reserved.
+// License: New BSD License.
+// Website: http://code.google.com/p/phpdesktop/
+
+// Checks that normalize_uri() in mongoose.c, which guards against path
+// traversal, gives the same result as the two passes it replaced:
+// mg_url_decode() followed by remove_double_dots_and_double_slashes().
+// Uris are built at random from fragments that matter to the guard:
+// encoded and plain dots, slashes, backslashes, nuls and bad escapes.
+// Run it after changing normalize_uri(). Exits with 1 on a mismatch.
+// Then compares the speed of both on typical uris, that the pre-check
+// in normalize_uri() returns early for, and on uris that need decoding.
+//
+// Build from this directory with the Visual Studio command prompt:
+//   cl /W3 /I ..\phpdesktop-chrome57 normalize-uri-test.c
+// Usage:
+//   normalize-uri-test.exe [count] [seed]
+
+#include "mongoose.c"
+
+// The clean up that handle_request() did before normalize_uri().
+static void remove_double_dots_and_double_slashes(char *s) {
+  char *p = s;
+
+  while (*s != '\0') {
+    *p++ = *s++;
+    if (s[-1] == '/' || s[-1] == '\\') {
+      // Skip all following slashes, backslashes and double-dots
+      while (s[0] != '\0') {
+        if (s[0] == '/' || s[0] == '\\') {
+          s++;
+        } else if (s[0] == '.' && s[1] == '.') {
+          s += 2;
+        } else {
+          break;
+        }
+      }
+    }
+  }
+  *p = '\0';
+}
+
+static const char *fragments[] = {
+  "/", "\\", "//", ".", "..", "...", "a", "b.c", "~",
+  "%2e", "%2E", "%2f", "%2F", "%5c", "%5C", "%00", "%25", "%41", "%20",
+  "%", "%4", "%zz", "%2", "%%2e", "?", "/../", "/./", "%2e%2e",
+};
+
+// Uris from a page load, they need no change.
+static const char *plain_uris[] = {
+  "/", "/index.php", "/css/style.css", "/js/jquery-1.11.1.min.js",
+  "/images/logo.png", "/api/users/42", "/fonts/OpenSans-Regular.woff",
+  "/pages/about/team.html", "/favicon.ico", "/app/views/main.js",
+};
+
+// Uris with escapes, double slashes or double dots.
+static const char *escaped_uris[] = {
+  "/files/My%20Document.pdf", "/search/caf%C3%A9.php", "/a%2Fb/c.txt",
+  "/docs//guide/index.html", "/images/../logo.png", "/x%5c..%5cy.php",
+  "/upload/file%20(1).jpg", "/%7Euser/page.html",
+};
+
+// Written to, so that the compiler keeps the loops.
+static volatile int timing_sink;
+
+// Returns the time in nanoseconds to normalize one uri.
+static double time_uris(const char **uris, int num_uris, int two_pass) {
+  double start = mg_clock(), elapsed;
+  long count = 0;
+  char buf[256];
+  int i, j, len;
+
+  do {
+    // Many rounds between reading the clock, it is slower than a uri.
+    for (j = 0; j < 1000; j++) {
+      for (i = 0; i < num_uris; i++) {
+        strcpy(buf, uris[i]);
+        if (two_pass) {
+          len = (int) strlen(buf);
+          mg_url_decode(buf, len, buf, len + 1, 0);
+          remove_double_dots_and_double_slashes(buf);
+        } else {
+          len = normalize_uri(buf);
+        }
+        timing_sink += len + buf[0];
+      }
+    }
+    count += 1000 * num_uris;
+  } while ((elapsed = mg_clock() - start) < 0.5);
+
+  return elapsed / count * 1e9;
+}
+
+static unsigned long random_state = 1;
+
+// xorshift, so that a seed reproduces the same uris everywhere.
+static unsigned long next_random(void) {
+  random_state ^= (random_state << 13) & 0xffffffffUL;
+  random_state ^= random_state >> 17;
+  random_state ^= (random_state << 5) & 0xffffffffUL;
+  return random_state;
+}
+
+int main(int argc, char *argv[]) {
+  long count = argc > 1 ? atol(argv[1]) : 3000000;
+  long i, mismatches = 0;
+  char uri[256], expected[256], actual[256];
+  int j, n, len;
+
+  random_state = argc > 2 ? (unsigned long) atol(argv[2]) : 1;
+  if (random_state == 0) {
+    random_state = 1;
+  }
+
+  for (i = 0; i < count && mismatches == 0; i++) {
+    strcpy(uri, "/");
+    n = (int) (next_random() % 16);
+    for (j = 0; j < n; j++) {
+      strcat(uri, fragments[next_random() %
+                            (sizeof(fragments) / sizeof(fragments[0]))]);
+    }
+
+    len = (int) strlen(uri);
+    strcpy(expected, uri);
+    mg_url_decode(expected, len, expected, len + 1, 0);
+    remove_double_dots_and_double_slashes(expected);
+
+    strcpy(actual, uri);
+    len = normalize_uri(actual);
+
+    if (strcmp(expected, actual) != 0 || len != (int) strlen(actual)) {
+      printf("Mismatch for \"%s\": expected \"%s\", got \"%s\" (%d)\n",
+             uri, expected, actual, len);
+      mismatches++;
+    }
+  }
+
+  printf("%ld uris checked, %ld mismatches\n", i, mismatches);
+
+  printf("Plain uris:   %6.1f ns normalize_uri(), %6.1f ns two passes\n",
+         time_uris(plain_uris, ARRAY_SIZE(plain_uris), 0),
+         time_uris(plain_uris, ARRAY_SIZE(plain_uris), 1));
+  printf("Escaped uris: %6.1f ns normalize_uri(), %6.1f ns two passes\n",
+         time_uris(escaped_uris, ARRAY_SIZE(escaped_uris), 0),
+         time_uris(escaped_uris, ARRAY_SIZE(escaped_uris), 1));
+
+  return mismatches == 0 ? 0 : 1;
+}
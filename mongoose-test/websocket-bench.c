@@ -0,0 +1,269 @@
+// Copyright (c) 2012-2014 The PHP Desktop authors. All rights reserved.
+// License: New BSD License.
+// Website: http://code.google.com/p/phpdesktop/
+
+// Measures websocket messages through mongoose over loopback. A server
+// with an echo websocket_data callback is started in this process, the
+// client sends masked messages like a browser does and waits for each
+// echo. Reports round trip latency and throughput for small and large
+// messages, and the rate of small messages with many in flight.
+// Permessage-deflate is not supported by mongoose and not measured.
+//
+// Build from this directory with the Visual Studio command prompt:
+//   cl /O2 /W3 /DUSE_WEBSOCKET /DNO_SSL /I ..\phpdesktop-chrome57
+//      websocket-bench.c
+// Usage:
+//   websocket-bench.exe [port]
+
+#include "mongoose.c"
+
+// Each message size is measured for at least this long.
+#define MIN_SECONDS 1.0
+
+// Most round trips that are kept for the latency percentiles.
+#define MAX_SAMPLES 200000
+
+// Messages sent at once when measuring with many in flight.
+#define WINDOW 64
+
+static const size_t message_sizes[] = {16, 1024, 65536, 1048576};
+
+static int echo_websocket_data(struct mg_connection *conn, int bits,
+                               char *data, size_t data_len) {
+  return mg_websocket_write(conn, bits & 0x0f, data, data_len) >= 0;
+}
+
+static int send_all(SOCKET sock, const char *buf, size_t len) {
+  int n;
+
+  while (len > 0) {
+    n = send(sock, buf, len > INT_MAX ? INT_MAX : (int) len, 0);
+    if (n <= 0) {
+      return 0;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static int recv_all(SOCKET sock, char *buf, size_t len) {
+  int n;
+
+  while (len > 0) {
+    n = recv(sock, buf, len > INT_MAX ? INT_MAX : (int) len, 0);
+    if (n <= 0) {
+      return 0;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// Builds a masked binary frame, as clients must send, and returns its
+// length. The frame is sent many times, so it is masked only once.
+static size_t make_frame(char *frame, const char *data, size_t len) {
+  static const char mask[4] = {0x12, 0x34, 0x56, 0x78};
+  size_t i, header_len;
+
+  frame[0] = (char) (0x80 | WEBSOCKET_OPCODE_BINARY);
+  if (len < 126) {
+    frame[1] = (char) (0x80 | len);
+    header_len = 2;
+  } else if (len <= 0xFFFF) {
+    frame[1] = (char) (0x80 | 126);
+    frame[2] = (char) (len >> 8);
+    frame[3] = (char) len;
+    header_len = 4;
+  } else {
+    frame[1] = (char) (0x80 | 127);
+    for (i = 0; i < 8; i++) {
+      frame[2 + i] = (char) ((uint64_t) len >> (56 - 8 * i));
+    }
+    header_len = 10;
+  }
+  memcpy(frame + header_len, mask, 4);
+  header_len += 4;
+  for (i = 0; i < len; i++) {
+    frame[header_len + i] = data[i] ^ mask[i % 4];
+  }
+  return header_len + len;
+}
+
+// Reads one unfragmented frame from the server into buf. Returns the
+// payload length, or -1 on error.
+static long recv_message(SOCKET sock, char *buf, size_t size) {
+  unsigned char header[10];
+  size_t i, len;
+
+  if (!recv_all(sock, (char *) header, 2) || (header[1] & 0x80)) {
+    return -1;
+  }
+  len = header[1] & 127;
+  if (len == 126) {
+    if (!recv_all(sock, (char *) header + 2, 2)) {
+      return -1;
+    }
+    len = (header[2] << 8) + header[3];
+  } else if (len == 127) {
+    if (!recv_all(sock, (char *) header + 2, 8)) {
+      return -1;
+    }
+    for (len = 0, i = 2; i < 10; i++) {
+      len = (len << 8) + header[i];
+    }
+  }
+  if (len > size || !recv_all(sock, buf, len)) {
+    return -1;
+  }
+  return (long) len;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = * (const double *) a, y = * (const double *) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Sends messages of the given size one at a time and waits for each
+// echo. Returns 0 on error.
+static int measure_round_trips(SOCKET sock, size_t size, char *frame,
+                               char *buf, double *samples) {
+  size_t frame_len;
+  double start, t, elapsed, total = 0;
+  long count = 0, num_samples = 0, i;
+
+  for (i = 0; i < (long) size; i++) {
+    buf[i] = (char) i;
+  }
+  frame_len = make_frame(frame, buf, size);
+
+  start = mg_clock();
+  do {
+    t = mg_clock();
+    if (!send_all(sock, frame, frame_len) ||
+        recv_message(sock, buf, size) != (long) size) {
+      return 0;
+    }
+    t = mg_clock() - t;
+    total += t;
+    if (num_samples < MAX_SAMPLES) {
+      samples[num_samples++] = t;
+    }
+    count++;
+  } while ((elapsed = mg_clock() - start) < MIN_SECONDS || count < 10);
+
+  // The echo of the last message is checked, the others only by length.
+  for (i = 0; i < (long) size; i++) {
+    if (buf[i] != (char) i) {
+      printf("Echo of %lu bytes differs at byte %ld\n",
+             (unsigned long) size, i);
+      return 0;
+    }
+  }
+
+  qsort(samples, num_samples, sizeof(samples[0]), compare_doubles);
+  printf("%10lu %10.0f %10.1f %10.1f %10.1f %10.1f\n",
+         (unsigned long) size, count / elapsed,
+         2.0 * size * count / elapsed / 1e6, total / count * 1e6,
+         samples[num_samples / 2] * 1e6,
+         samples[num_samples * 99 / 100] * 1e6);
+  return 1;
+}
+
+// Sends WINDOW small messages at once, then reads their echoes.
+// Returns 0 on error.
+static int measure_window(SOCKET sock, size_t size, char *frame,
+                          char *buf) {
+  size_t frame_len;
+  double start, elapsed;
+  long count = 0;
+  int i;
+
+  memset(buf, 'x', size);
+  frame_len = make_frame(frame, buf, size);
+  for (i = 1; i < WINDOW; i++) {
+    memcpy(frame + i * frame_len, frame, frame_len);
+  }
+
+  start = mg_clock();
+  do {
+    if (!send_all(sock, frame, WINDOW * frame_len)) {
+      return 0;
+    }
+    for (i = 0; i < WINDOW; i++) {
+      if (recv_message(sock, buf, size) != (long) size) {
+        return 0;
+      }
+    }
+    count += WINDOW;
+  } while ((elapsed = mg_clock() - start) < MIN_SECONDS);
+
+  printf("%lu byte messages, %d in flight: %.0f messages/s\n",
+         (unsigned long) size, WINDOW, count / elapsed);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  const char *port = argc > 1 ? argv[1] : "8089";
+  const char *options[] = {
+    "listening_ports", NULL,
+    "document_root", ".",
+    NULL
+  };
+  struct mg_callbacks callbacks;
+  struct mg_context *ctx;
+  struct mg_connection *conn;
+  size_t i, max_size = message_sizes[ARRAY_SIZE(message_sizes) - 1];
+  char address[32], ebuf[100], *frame, *buf;
+  double *samples;
+  int ok = 1;
+
+  snprintf(address, sizeof(address), "127.0.0.1:%s", port);
+  options[1] = address;
+  memset(&callbacks, 0, sizeof(callbacks));
+  callbacks.websocket_data = echo_websocket_data;
+  if ((ctx = mg_start(&callbacks, NULL, options)) == NULL) {
+    printf("Cannot start the server on %s\n", address);
+    return 1;
+  }
+
+  conn = mg_download("127.0.0.1", atoi(port), 0, ebuf, sizeof(ebuf),
+                     "GET /bench HTTP/1.1\r\n"
+                     "Host: 127.0.0.1:%s\r\n"
+                     "Upgrade: websocket\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                     "Sec-WebSocket-Version: 13\r\n\r\n", port);
+  if (conn == NULL || conn->request_info.uri == NULL ||
+      strcmp(conn->request_info.uri, "101") != 0) {
+    printf("Websocket handshake failed: %s\n", ebuf);
+    mg_stop(ctx);
+    return 1;
+  }
+
+  frame = (char *) malloc(max_size + 14 > WINDOW * 64 ?
+                          max_size + 14 : WINDOW * 64);
+  buf = (char *) malloc(max_size);
+  samples = (double *) malloc(MAX_SAMPLES * sizeof(samples[0]));
+
+  printf("%10s %10s %10s %10s %10s %10s\n", "bytes", "msgs/s", "MB/s",
+         "avg us", "p50 us", "p99 us");
+  for (i = 0; ok && i < ARRAY_SIZE(message_sizes); i++) {
+    ok = measure_round_trips(conn->client.sock, message_sizes[i],
+                             frame, buf, samples);
+  }
+  if (ok) {
+    ok = measure_window(conn->client.sock, message_sizes[0], frame, buf);
+  }
+  if (!ok) {
+    printf("Websocket connection failed\n");
+  }
+
+  free(frame);
+  free(buf);
+  free(samples);
+  mg_close_connection(conn);
+  mg_stop(ctx);
+  return ok ? 0 : 1;
+}
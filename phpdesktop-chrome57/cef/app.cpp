@@ -15,6 +15,7 @@
 #include "../log.h"
 #include "client_handler.h"
 #include "../settings.h"
+#include "../settings_snapshot.h"
 #include "javascript_api.h"
 
 // ----------------------------------------------------------------------------
@@ -125,13 +126,13 @@ void App::OnBeforeCommandLineProcessing(
     // May be called on any thread?
     if (process_type.empty()) {
         // Browser process.
-        json_value* appSettings = GetApplicationSettings();
-        json_value switches = (*appSettings)["chrome"]["command_line_switches"];
-        if (switches.type == json_object) {
-            int length = switches.u.object.length;
+        const std::vector<std::pair<std::string, std::string> >& switches =
+                GetSettings().chrome.command_line_switches;
+        if (!switches.empty()) {
+            int length = switches.size();
             for (int i = 0; i < length; i++) {
-                std::string name = switches.u.object.values[i].name;
-                std::string value = static_cast<const char*>(*switches.u.object.values[i].value);
+                const std::string& name = switches[i].first;
+                const std::string& value = switches[i].second;
                 if (name.find("-") == 0) {
                     LOG_WARNING << "Invalid command line switch: " << name;
                     continue;
@@ -177,3 +178,19 @@ void App::OnContextInitialized() {
   LOG_DEBUG << "App::OnContextInitialized()";
 }
 
+///
+// Called before a child process is launched. Will be called on the browser
+// process UI thread when launching a render process and on the browser
+// process IO thread when launching a GPU or plugin process.
+///
+void App::OnBeforeChildProcessLaunch(
+        CefRefPtr<CefCommandLine> command_line) {
+    // Let the child read compiled settings from shared memory
+    // instead of parsing settings.json again.
+    std::string snapshot = GetSettingsSnapshotName();
+    if (!snapshot.empty()) {
+        command_line->AppendSwitchWithValue(SETTINGS_SNAPSHOT_SWITCH,
+                                            snapshot);
+    }
+}
+
@@ -29,6 +29,8 @@ public:
 
     // CefBrowserProcessHandler methods:
     virtual void OnContextInitialized() OVERRIDE;
+    virtual void OnBeforeChildProcessLaunch(
+            CefRefPtr<CefCommandLine> command_line) OVERRIDE;
 
     // CefRenderProcessHandler methods:
     virtual bool OnProcessMessageReceived(CefRefPtr<CefBrowser> browser,
@@ -130,9 +130,8 @@ void BrowserWindow::SetCefBrowser(CefRefPtr<CefBrowser> cefBrowser) {
     }
     cefBrowser_ = cefBrowser;
     fullscreen_.reset(new Fullscreen(cefBrowser));
-    json_value* appSettings = GetApplicationSettings();
     if (!IsPopup()) {
-        bool start_fullscreen = (*appSettings)["main_window"]["start_fullscreen"];
+        bool start_fullscreen = GetSettings().main_window.start_fullscreen;
         if (start_fullscreen) {
             fullscreen_->ToggleFullscreen();
             CefRefPtr<CefProcessMessage> message = \
@@ -185,23 +184,17 @@ bool BrowserWindow::IsPopup() {
 }
 bool BrowserWindow::IsUsingMetaTitle() {
     if (IsPopup()) {
-        json_value* settings = GetApplicationSettings();
-        std::string fixed_title = (*settings)["popup_window"]["fixed_title"];
-        return fixed_title.empty();
+        return GetSettings().popup_window.fixed_title.empty();
     }
     return false;
 }
 void BrowserWindow::OnGetMinMaxInfo(UINT uMsg, WPARAM wParam, LPARAM lParam) {
     if (!IsPopup()) {
-        json_value* settings = GetApplicationSettings();
-        static long minimum_width =
-                (*settings)["main_window"]["minimum_size"][0];
-        static long minimum_height =
-                (*settings)["main_window"]["minimum_size"][1];
-        static long maximum_width =
-                (*settings)["main_window"]["maximum_size"][0];
-        static long maximum_height =
-                (*settings)["main_window"]["maximum_size"][1];
+        const ApplicationSettings& settings = GetSettings();
+        long minimum_width = settings.main_window.minimum_size[0];
+        long minimum_height = settings.main_window.minimum_size[1];
+        long maximum_width = settings.main_window.maximum_size[0];
+        long maximum_height = settings.main_window.maximum_size[1];
         MINMAXINFO* pMMI = (MINMAXINFO*)lParam;
         if (minimum_width)
             pMMI->ptMinTrackSize.x = minimum_width;
@@ -233,10 +226,11 @@ void BrowserWindow::OnSize() {
 }
 void BrowserWindow::SetTitleFromSettings() {
     if (IsPopup()) {
-        json_value* settings = GetApplicationSettings();
-        std::wstring popup_title = (*settings)["popup_window"]["fixed_title"];
+        const ApplicationSettings& settings = GetSettings();
+        std::wstring popup_title =
+                Utf8ToWide(settings.popup_window.fixed_title);
         if (popup_title.empty())
-            popup_title = (*settings)["main_window"]["title"];
+            popup_title = Utf8ToWide(settings.main_window.title);
         if (popup_title.empty())
             popup_title = Utf8ToWide(GetExecutableName());
         SetTitle(popup_title.c_str());
@@ -244,12 +238,12 @@ void BrowserWindow::SetTitleFromSettings() {
     // Main window title is set in CreateMainWindow().
 }
 void BrowserWindow::SetIconFromSettings() {
-    json_value* settings = GetApplicationSettings();
+    const ApplicationSettings& settings = GetSettings();
     const char* iconPath;
     if (IsPopup())
-        iconPath = (*settings)["popup_window"]["icon"];
+        iconPath = settings.popup_window.icon.c_str();
     else
-        iconPath = (*settings)["main_window"]["icon"];
+        iconPath = settings.main_window.icon.c_str();
     if (iconPath && iconPath[0] != 0) {
         wchar_t iconPathW[MAX_PATH];
         Utf8ToWide(iconPath, iconPathW, _countof(iconPathW));
@@ -21,11 +21,13 @@
 #include "../web_server.h"
 #include "../fatal_error.h"
 #include "../file_utils.h"
+#include "../trace.h"
 
 extern HINSTANCE g_hInstance;
 extern wchar_t g_windowClassName[256];
 extern std::map<HWND, BrowserWindow*> g_browserWindows; // browser_window.cpp
 std::map<HWND, bool> g_isBrowserLoading;
+extern double g_firstNavigationStart; // main.cpp
 
 // This will be set to false when application completes loading
 // of the initial webpage in main browser window. If the OnLoadError
@@ -68,6 +70,7 @@ ClientHandler* ClientHandler::GetInstance() {
 bool ClientHandler::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser,
                                     CefProcessId source_process,
                                     CefRefPtr<CefProcessMessage> message) {
+    TRACE_SCOPE("cef", "OnProcessMessageReceived");
     LOG_DEBUG << "browser[" << browser->GetIdentifier() << "] "
               << "OnProcessMessageReceived: " << message->GetName().ToString();
     if (message->GetName() == "ToggleFullscreen") {
@@ -91,8 +94,8 @@ bool ClientHandler::OnProcessMessageReceived(CefRefPtr<CefBrowser> browser,
 ///
 void ClientHandler::OnTitleChange(CefRefPtr<CefBrowser> cefBrowser,
                                   const CefString& cefTitle) {
+    TRACE_SCOPE("cef", "OnTitleChange");
     REQUIRE_UI_THREAD();
-    json_value* appSettings = GetApplicationSettings();
     HWND cefHandle = cefBrowser->GetHost()->GetWindowHandle();
     BrowserWindow* browser = GetBrowserWindow(cefHandle);
     if (browser && browser->IsPopup()) {
@@ -101,7 +104,7 @@ void ClientHandler::OnTitleChange(CefRefPtr<CefBrowser> cefBrowser,
                     || cefTitle.ToString().find(GetWebServerIpAddress()) == 0) {
                 // Use main window title if no title provided in popup.
                 // If there is not meta title, then CEF sets url as a title.
-                std::string main_window_title = (*appSettings)["main_window"]["title"];
+                std::string main_window_title = GetSettings().main_window.title;
                 if (main_window_title.empty())
                     main_window_title = GetExecutableName();
                 browser->SetTitle(Utf8ToWide(main_window_title).c_str());
@@ -122,11 +125,11 @@ void ClientHandler::OnTitleChange(CefRefPtr<CefBrowser> cefBrowser,
 // Called after a new browser is created.
 ///
 void ClientHandler::OnAfterCreated(CefRefPtr<CefBrowser> cefBrowser) {
+    TRACE_SCOPE("cef", "OnAfterCreated");
     REQUIRE_UI_THREAD();
     LOG_DEBUG << "ClientHandler::OnAfterCreated()";
-    json_value* appSettings = GetApplicationSettings();
-    bool center_relative_to_parent = \
-            (*appSettings)["popup_window"]["center_relative_to_parent"];
+    bool center_relative_to_parent =
+            GetSettings().popup_window.center_relative_to_parent;
     HWND cefHandle = cefBrowser->GetHost()->GetWindowHandle();
     BrowserWindow* phpBrowser = GetBrowserWindow(cefHandle);
     if (phpBrowser) {
@@ -171,6 +174,7 @@ void ClientHandler::OnAfterCreated(CefRefPtr<CefBrowser> cefBrowser) {
 // additional usage information.
 ///
 void ClientHandler::OnBeforeClose(CefRefPtr<CefBrowser> browser) {
+    TRACE_SCOPE("cef", "OnBeforeClose");
     REQUIRE_UI_THREAD();
     LOG_DEBUG << "OnBeforeClose() hwnd=" 
               << (int)browser->GetHost()->GetWindowHandle();
@@ -210,6 +214,7 @@ bool ClientHandler::OnBeforePopup(CefRefPtr<CefBrowser> browser,
                             CefRefPtr<CefClient>& client,
                             CefBrowserSettings& settings,
                             bool* no_javascript_access) {
+    TRACE_SCOPE("cef", "OnBeforePopup");
     LOG_DEBUG << "ClientHandler::OnBeforePopup()";
     // OnBeforePopup does not get called for the DevTools popup window.
     // The devtools window is created using CreatePopupWindow
@@ -218,9 +223,9 @@ bool ClientHandler::OnBeforePopup(CefRefPtr<CefBrowser> browser,
     // Its parent hwnd won't be the current browser. To get
     // the browser that opened the popup call CefBrowserHost
     // GetOpenerWindowHandle().
-    json_value* appSettings = GetApplicationSettings();
-    bool external_navigation = (*appSettings)["chrome"]["external_navigation"];
-    bool dpi_aware = (*appSettings)["application"]["dpi_aware"];
+    const ApplicationSettings& settings = GetSettings();
+    bool external_navigation = settings.chrome.external_navigation;
+    bool dpi_aware = settings.application.dpi_aware;
     // windowInfo.width and windowInfo.height will be set when there
     // was specified width/height for a popup. If it wasn't then these
     // values will be like 1073741824 (some garbage as memory wasn't set).
@@ -231,10 +236,8 @@ bool ClientHandler::OnBeforePopup(CefRefPtr<CefBrowser> browser,
     if (windowInfo.width > max_width || windowInfo.height > max_height
             || windowInfo.width <= 0 || windowInfo.height <= 0) {
         // Use default size for a popup only when no size was provided.
-        int default_width = static_cast<long>(\
-                (*appSettings)["popup_window"]["default_size"][0]);
-        int default_height = static_cast<long>(\
-                (*appSettings)["popup_window"]["default_size"][1]);
+        int default_width = settings.popup_window.default_size[0];
+        int default_height = settings.popup_window.default_size[1];
         if (default_width && default_height) {
             LOG_INFO << "Setting default size for a popup window "
                      << default_width << "/" << default_height;
@@ -322,6 +325,7 @@ void ClientHandler::OnLoadingStateChange(CefRefPtr<CefBrowser> cefBrowser,
                                 bool isLoading,
                                 bool canGoBack,
                                 bool canGoForward) {
+    TRACE_SCOPE("cef", "OnLoadingStateChange");
     LOG_DEBUG << "OnLoadingStateChange: loading=" << isLoading << ", url=" 
             << cefBrowser->GetMainFrame()->GetURL().ToString().c_str();
 
@@ -338,6 +342,8 @@ void ClientHandler::OnLoadingStateChange(CefRefPtr<CefBrowser> cefBrowser,
     calls++;
     if (calls > 1) {
         if (g_isApplicationStartPageLoading) {
+            TraceEvent("startup", "first navigation",
+                       g_firstNavigationStart, TraceClock());
             // Must use GetText and not GetSource, because Chromium adds
             // <html> and <body> tags if the content is a plain text.
             cefBrowser->GetMainFrame()->GetText(
@@ -358,6 +364,7 @@ void ClientHandler::OnLoadError(CefRefPtr<CefBrowser> browser,
                                 ErrorCode errorCode,
                                 const CefString& errorText,
                                 const CefString& failedUrl) {
+    TRACE_SCOPE("cef", "OnLoadError");
     REQUIRE_UI_THREAD();
     LOG_DEBUG << "OnLoadError, errorCode=" << errorCode
             << ", failedUrl=" << failedUrl.ToString().c_str();
@@ -424,18 +431,19 @@ void ClientHandler::OnBeforeContextMenu(CefRefPtr<CefBrowser> browser,
                                 CefRefPtr<CefFrame> frame,
                                 CefRefPtr<CefContextMenuParams> params,
                                 CefRefPtr<CefMenuModel> model) {
-    json_value* appSettings = GetApplicationSettings();
-    bool enable_menu = (*appSettings)["chrome"]["context_menu"]["enable_menu"];
+    TRACE_SCOPE("cef", "OnBeforeContextMenu");
+    const ApplicationSettings& settings = GetSettings();
+    bool enable_menu = settings.chrome.context_menu.enable_menu;
     // MENU_ID_BACK, MENU_ID_FORWARD
-    bool navigation = (*appSettings)["chrome"]["context_menu"]["navigation"];
+    bool navigation = settings.chrome.context_menu.navigation;
     // MENU_ID_PRINT
-    bool print = (*appSettings)["chrome"]["context_menu"]["print"];
+    bool print = settings.chrome.context_menu.print;
     // MENU_ID_VIEW_SOURCE
-    bool view_source = (*appSettings)["chrome"]["context_menu"]["view_source"];
-    bool reload_page = (*appSettings)["chrome"]["context_menu"]["reload_page"];
-    bool open_in_external_browser = (*appSettings)["chrome"]["context_menu"]\
-            ["open_in_external_browser"];
-    bool devtools = (*appSettings)["chrome"]["context_menu"]["devtools"];
+    bool view_source = settings.chrome.context_menu.view_source;
+    bool reload_page = settings.chrome.context_menu.reload_page;
+    bool open_in_external_browser =
+            settings.chrome.context_menu.open_in_external_browser;
+    bool devtools = settings.chrome.context_menu.devtools;
 
     if (!enable_menu) {
         model->Clear();
@@ -492,6 +500,7 @@ bool ClientHandler::OnContextMenuCommand(CefRefPtr<CefBrowser> browser,
                                 CefRefPtr<CefContextMenuParams> params,
                                 int command_id,
                                 EventFlags event_flags) {
+    TRACE_SCOPE("cef", "OnContextMenuCommand");
     if (command_id == _MENU_ID_OPEN_PAGE_IN_EXTERNAL_BROWSER) {
         ShellExecute(0, L"open",
                 params->GetPageUrl().ToWString().c_str(),
@@ -519,6 +528,7 @@ bool ClientHandler::OnContextMenuCommand(CefRefPtr<CefBrowser> browser,
 /*--cef()--*/
 void ClientHandler::OnContextMenuDismissed(CefRefPtr<CefBrowser> browser,
                                     CefRefPtr<CefFrame> frame) {
+    TRACE_SCOPE("cef", "OnContextMenuDismissed");
 }
 
 // ----------------------------------------------------------------------------
@@ -534,8 +544,8 @@ void ClientHandler::OnContextMenuDismissed(CefRefPtr<CefBrowser> browser,
 bool ClientHandler::OnDragEnter(CefRefPtr<CefBrowser> browser,
                        CefRefPtr<CefDragData> dragData,
                        DragOperationsMask mask) {
-    json_value* appSettings = GetApplicationSettings();
-    bool external_drag = (*appSettings)["chrome"]["external_drag"];
+    TRACE_SCOPE("cef", "OnDragEnter");
+    bool external_drag = GetSettings().chrome.external_drag;
     if (external_drag) {
         return false;
     } else {
@@ -562,10 +572,10 @@ bool ClientHandler::OnBeforeBrowse(CefRefPtr<CefBrowser> browser,
                             CefRefPtr<CefFrame> frame,
                             CefRefPtr<CefRequest> request,
                             bool is_redirect) {
+    TRACE_SCOPE("cef", "OnBeforeBrowse");
     REQUIRE_UI_THREAD();
     // See also OnBeforePopup.
-    json_value* appSettings = GetApplicationSettings();
-    bool external_navigation = (*appSettings)["chrome"]["external_navigation"];
+    bool external_navigation = GetSettings().chrome.external_navigation;
     CefString newUrl = request->GetURL();
     if (newUrl.ToString().find(GetWebServerUrl()) == 0) {
         // Allow to open in phpdesktop browser.
@@ -596,11 +606,12 @@ bool ClientHandler::OnBeforeBrowse(CefRefPtr<CefBrowser> browser,
 bool ClientHandler::OnKeyEvent(CefRefPtr<CefBrowser> cefBrowser,
                         const CefKeyEvent& event,
                         CefEventHandle os_event) {
+    TRACE_SCOPE("cef", "OnKeyEvent");
     REQUIRE_UI_THREAD();
 
-    json_value* appSettings = GetApplicationSettings();
-    bool reload_page_F5 = (*appSettings)["chrome"]["reload_page_F5"];
-    bool devtools_F12 = (*appSettings)["chrome"]["devtools_F12"];
+    const ApplicationSettings& settings = GetSettings();
+    bool reload_page_F5 = settings.chrome.reload_page_F5;
+    bool devtools_F12 = settings.chrome.devtools_F12;
 
     if (reload_page_F5 && event.windows_key_code == VK_F5
             && event.type == KEYEVENT_RAWKEYDOWN) {
@@ -634,8 +645,8 @@ void ClientHandler::OnBeforeDownload(CefRefPtr<CefBrowser> browser,
                         CefRefPtr<CefDownloadItem> download_item,
                         const CefString& suggested_name,
                         CefRefPtr<CefBeforeDownloadCallback> callback) {
-    json_value* appSettings = GetApplicationSettings();
-    bool enable_downloads = (*appSettings)["chrome"]["enable_downloads"];
+    TRACE_SCOPE("cef", "OnBeforeDownload");
+    bool enable_downloads = GetSettings().chrome.enable_downloads;
     if (enable_downloads) {
         LOG_INFO << "About to download a file: " << suggested_name.ToString();
         callback->Continue(suggested_name, true);
@@ -656,6 +667,7 @@ void ClientHandler::OnDownloadUpdated(
         CefRefPtr<CefBrowser> browser,
         CefRefPtr<CefDownloadItem> download_item,
         CefRefPtr<CefDownloadItemCallback> callback) {
+    TRACE_SCOPE("cef", "OnDownloadUpdated");
     if (download_item->IsComplete()) {
         LOG_INFO << "Download completed, saved to: " << download_item->GetFullPath().ToString();
     } else if (download_item->IsCanceled()) {
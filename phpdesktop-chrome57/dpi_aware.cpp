@@ -23,8 +23,7 @@ void SetBrowserDpiSettings(CefRefPtr<CefBrowser> cefBrowser) {
     // won't work. We need to wait a moment before we can set it.
     REQUIRE_UI_THREAD();
 
-    json_value* appSettings = GetApplicationSettings();
-    if (!(*appSettings)["application"]["dpi_aware"]) {
+    if (!GetSettings().application.dpi_aware) {
         return;
     }
 
@@ -11,8 +11,7 @@
 #include "string_utils.h"
 
 void FatalError(HWND hwnd, std::string message) {
-    json_value* settings = GetApplicationSettings();
-    std::string title = (*settings)["main_window"]["title"];
+    std::string title = GetSettings().main_window.title;
     if (title.empty())
         title = GetExecutableName();
     MessageBox(hwnd, Utf8ToWide(message).c_str(), Utf8ToWide(title).c_str(),
@@ -50,6 +50,14 @@
 
 typedef unsigned short json_uchar;
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+   #define json_sse2
+   #include <emmintrin.h>
+   #ifdef _MSC_VER
+      #include <intrin.h>
+   #endif
+#endif
+
 static unsigned char hex_value (json_char c)
 {
    if (c >= 'A' && c <= 'F')
@@ -64,6 +72,22 @@ static unsigned char hex_value (json_char c)
    return 0xFF;
 }
 
+/* Arena mode: every block starts with this header. The root value is
+ * always the first allocation of the first block, so the block list can
+ * be found from the root alone when releasing the document.
+ */
+typedef struct _json_arena_block
+{
+   struct _json_arena_block * next;
+   unsigned long size, used;
+   int owned; /* 0 if the block was supplied by the caller */
+
+} json_arena_block;
+
+#define json_arena_align(n)  (((n) + 7) & ~ (unsigned long) 7)
+#define json_arena_header    json_arena_align (sizeof (json_arena_block))
+#define json_arena_min_block 4096
+
 typedef struct
 {
    json_settings settings;
@@ -74,8 +98,86 @@ typedef struct
    unsigned int uint_max;
    unsigned long ulong_max;
 
+   json_arena_block * arena_first, * arena_cur;
+
 } json_state;
 
+static json_arena_block * json_arena_new_block
+   (json_state * state, unsigned long size)
+{
+   json_arena_block * block;
+   unsigned long block_size = json_arena_min_block;
+
+   if (state->arena_cur && state->arena_cur->size < state->ulong_max / 4)
+      block_size = state->arena_cur->size * 2;
+
+   if (block_size < size + json_arena_header)
+      block_size = size + json_arena_header;
+
+   if (!state->arena_first && state->settings.arena_block
+         && state->settings.arena_block_size >= size + json_arena_header)
+   {
+      block = (json_arena_block *) state->settings.arena_block;
+      block->owned = 0;
+      block_size = state->settings.arena_block_size;
+   }
+   else
+   {
+      if (! (block = (json_arena_block *) malloc (block_size)))
+         return 0;
+
+      block->owned = 1;
+   }
+
+   block->next = 0;
+   block->size = block_size;
+   block->used = json_arena_header;
+
+   if (state->arena_cur)
+      state->arena_cur->next = block;
+   else
+      state->arena_first = block;
+
+   return state->arena_cur = block;
+}
+
+static void * json_arena_alloc (json_state * state, unsigned long size, int zero)
+{
+   json_arena_block * block = state->arena_cur;
+   void * mem;
+
+   size = json_arena_align (size);
+
+   if (!block || block->size - block->used < size)
+   {
+      if (! (block = json_arena_new_block (state, size)))
+         return 0;
+   }
+
+   mem = ((char *) block) + block->used;
+   block->used += size;
+
+   if (zero)
+      memset (mem, 0, size);
+
+   return mem;
+}
+
+static void json_arena_release (json_arena_block * block)
+{
+   json_arena_block * next;
+
+   while (block)
+   {
+      next = block->next;
+
+      if (block->owned)
+         free (block);
+
+      block = next;
+   }
+}
+
 static void * json_alloc (json_state * state, unsigned long size, int zero)
 {
    void * mem;
@@ -89,17 +191,65 @@ static void * json_alloc (json_state * state, unsigned long size, int zero)
       return 0;
    }
 
+   if (state->settings.settings & json_enable_arena)
+      return json_arena_alloc (state, size, zero);
+
    if (! (mem = zero ? calloc (size, 1) : malloc (size)))
       return 0;
 
    return mem;
 }
 
+/* Objects with json_enable_key_index get an open addressing hash table of
+ * member positions (+1, 0 marks an empty slot), stored after the names.
+ */
+#define json_index_min_length 8
+
+static unsigned int json_index_capacity (unsigned int length)
+{
+   unsigned int capacity = 16;
+
+   while (capacity < length * 2)
+      capacity *= 2;
+
+   return capacity;
+}
+
+static unsigned int json_hash (const json_char * name)
+{
+   unsigned int hash = 2166136261u;
+
+   while (*name)
+   {
+      hash ^= (unsigned char) *name ++;
+      hash *= 16777619u;
+   }
+
+   return hash;
+}
+
+static void build_index (json_value * value)
+{
+   unsigned int i, slot, mask = json_index_capacity (value->u.object.length) - 1;
+   unsigned int * index = value->u.object.index;
+
+   for (i = 0; i < value->u.object.length; ++ i)
+   {
+      slot = json_hash (value->u.object.values [i].name) & mask;
+
+      while (index [slot])
+         slot = (slot + 1) & mask;
+
+      index [slot] = i + 1;
+   }
+}
+
 static int new_value
    (json_state * state, json_value ** top, json_value ** root, json_value ** alloc, json_type type)
 {
    json_value * value;
    int values_size;
+   unsigned long names_size, index_size;
 
    if (!state->first_pass)
    {
@@ -126,14 +276,36 @@ static int new_value
 
             values_size = sizeof (*value->u.object.values) * value->u.object.length;
 
+            /* Pass 1 accumulated the size of all names in values */
+            names_size = (unsigned long) value->u.object.values;
+            index_size = 0;
+
+            if ((state->settings.settings & json_enable_key_index)
+                  && value->u.object.length >= json_index_min_length)
+            {
+               names_size = (names_size + sizeof (unsigned int) - 1)
+                              & ~ (unsigned long) (sizeof (unsigned int) - 1);
+
+               index_size = sizeof (unsigned int)
+                              * json_index_capacity (value->u.object.length);
+            }
+
             if (! ((*(void **) &value->u.object.values) = json_alloc
-                  (state, values_size + ((unsigned long) value->u.object.values), 0)) )
+                  (state, values_size + names_size + index_size, 0)) )
             {
                return 0;
             }
 
             value->_reserved.object_mem = (*(char **) &value->u.object.values) + values_size;
 
+            if (index_size)
+            {
+               value->u.object.index = (unsigned int *)
+                  ((*(char **) &value->u.object.values) + values_size + names_size);
+
+               memset (value->u.object.index, 0, index_size);
+            }
+
             value->u.object.length = 0;
             break;
 
@@ -174,6 +346,160 @@ static int new_value
    return 1;
 }
 
+/* Fast paths for the main loop. The scanners return the first character
+ * that the loop has to look at, the SSE2 versions are picked at runtime.
+ * Their loads are 16-byte aligned, so they never cross into a page past
+ * the terminating null.
+ */
+static const json_char * scan_string_scalar (const json_char * p)
+{
+   while (*p && *p != '"' && *p != '\\')
+      ++ p;
+
+   return p;
+}
+
+static const json_char * skip_blanks_scalar (const json_char * p)
+{
+   while (*p == ' ' || *p == '\t' || *p == '\r')
+      ++ p;
+
+   return p;
+}
+
+#ifdef json_sse2
+
+static unsigned int json_ctz (unsigned int mask)
+{
+   #ifdef _MSC_VER
+      unsigned long index;
+      _BitScanForward (&index, mask);
+      return index;
+   #else
+      return __builtin_ctz (mask);
+   #endif
+}
+
+static const json_char * scan_string_sse2 (const json_char * p)
+{
+   const __m128i quote = _mm_set1_epi8 ('"');
+   const __m128i backslash = _mm_set1_epi8 ('\\');
+   const __m128i zero = _mm_setzero_si128 ();
+
+   const json_char * block = (const json_char *) ((size_t) p & ~ (size_t) 15);
+   unsigned int mask = 0xFFFF << (p - block), hits;
+   __m128i chunk;
+
+   for (;; block += 16, mask = 0xFFFF)
+   {
+      chunk = _mm_load_si128 ((const __m128i *) block);
+
+      hits = _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (
+                  _mm_cmpeq_epi8 (chunk, quote), _mm_cmpeq_epi8 (chunk, backslash)),
+                     _mm_cmpeq_epi8 (chunk, zero))) & mask;
+
+      if (hits)
+         return block + json_ctz (hits);
+   }
+}
+
+static const json_char * skip_blanks_sse2 (const json_char * p)
+{
+   const __m128i space = _mm_set1_epi8 (' ');
+   const __m128i tab = _mm_set1_epi8 ('\t');
+   const __m128i cr = _mm_set1_epi8 ('\r');
+
+   const json_char * block = (const json_char *) ((size_t) p & ~ (size_t) 15);
+   unsigned int mask = 0xFFFF << (p - block), hits;
+   __m128i chunk;
+
+   /* Indentation runs are short, most end in the first block */
+
+   if (*p != ' ' && *p != '\t' && *p != '\r')
+      return p;
+
+   for (;; block += 16, mask = 0xFFFF)
+   {
+      chunk = _mm_load_si128 ((const __m128i *) block);
+
+      hits = ~ _mm_movemask_epi8 (_mm_or_si128 (_mm_or_si128 (
+                  _mm_cmpeq_epi8 (chunk, space), _mm_cmpeq_epi8 (chunk, tab)),
+                     _mm_cmpeq_epi8 (chunk, cr))) & mask;
+
+      if (hits)
+         return block + json_ctz (hits);
+   }
+}
+
+static int json_cpu_has_sse2 (void)
+{
+   #if defined(_M_X64) || defined(__SSE2__)
+      return 1;
+   #else
+      int info [4];
+      __cpuid (info, 1);
+      return (info [3] >> 26) & 1;
+   #endif
+}
+
+#endif
+
+static const json_char * (* scan_string) (const json_char *);
+static const json_char * (* skip_blanks) (const json_char *);
+
+static void select_fast_paths (void)
+{
+   /* Racing threads store the same values */
+
+   #ifdef json_sse2
+      if (json_cpu_has_sse2 ())
+      {
+         skip_blanks = skip_blanks_sse2;
+         scan_string = scan_string_sse2;
+         return;
+      }
+   #endif
+
+   skip_blanks = skip_blanks_scalar;
+   scan_string = scan_string_scalar;
+}
+
+/* Converts eight digits at once (little endian) */
+static unsigned long eight_digits (const json_char * p)
+{
+   unsigned long long v;
+
+   memcpy (&v, p, 8);
+   v -= 0x3030303030303030ULL;
+
+   v = (v * 10) + (v >> 8);
+   v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)))
+         + (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+
+   return (unsigned long) v;
+}
+
+/* Appends the run of digits at *p to value, advancing *p and *num_digits */
+static unsigned long add_digits (unsigned long value, const json_char ** p, long * num_digits)
+{
+   const json_char * begin = *p, * end = begin;
+
+   while (*end >= '0' && *end <= '9')
+      ++ end;
+
+   *num_digits += (long) (end - begin);
+
+   for (; end - begin >= 8; begin += 8)
+      value = value * 100000000UL + eight_digits (begin);
+
+   for (; begin < end; ++ begin)
+      value = value * 10 + (*begin - '0');
+
+   *p = end;
+
+   return value;
+}
+
 #define e_off \
    ((int) (i - cur_line_begin))
 
@@ -205,6 +531,9 @@ json_value * json_parse_ex (json_settings * settings, const json_char * json, ch
    memset (&state, 0, sizeof (json_state));
    memcpy (&state.settings, settings, sizeof (json_settings));
 
+   if (!scan_string)
+      select_fast_paths ();
+
    memset (&state.uint_max, 0xFF, sizeof (state.uint_max));
    memset (&state.ulong_max, 0xFF, sizeof (state.ulong_max));
 
@@ -236,6 +565,7 @@ json_value * json_parse_ex (json_settings * settings, const json_char * json, ch
             switch (b)
             {
                whitespace:
+                  i = skip_blanks (i + 1) - 1;
                   continue;
 
                default:
@@ -358,7 +688,20 @@ json_value * json_parse_ex (json_settings * settings, const json_char * json, ch
             }
             else
             {
-               string_add (b);
+               /* Copy the whole run of plain characters */
+
+               const json_char * run_end = scan_string (i + 1);
+               unsigned int run_length = (unsigned int) (run_end - i);
+
+               if (run_length > state.uint_max - string_length)
+                  goto e_overflow;
+
+               if (!state.first_pass)
+                  memcpy (string + string_length, i, run_length);
+
+               string_length += run_length;
+               i = run_end - 1;
+
                continue;
             }
          }
@@ -368,13 +711,14 @@ json_value * json_parse_ex (json_settings * settings, const json_char * json, ch
             switch (b)
             {
                whitespace:
+                  i = skip_blanks (i + 1) - 1;
                   continue;
 
                case ']':
 
                   if (top->type == json_array)
                      flags = (flags & ~ (flag_need_comma | flag_seek_value)) | flag_next;
-                  else if (!state.settings.settings & json_relaxed_commas)
+                  else if (! (state.settings.settings & json_relaxed_commas))
                   {  sprintf (error, "%d:%d: Unexpected ]", cur_line, e_off);
                      goto e_failed;
                   }
@@ -525,11 +869,12 @@ json_value * json_parse_ex (json_settings * settings, const json_char * json, ch
                switch (b)
                {
                   whitespace:
+                     i = skip_blanks (i + 1) - 1;
                      continue;
 
                   case '"':
 
-                     if (flags & flag_need_comma && (!state.settings.settings & json_relaxed_commas))
+                     if (flags & flag_need_comma && ! (state.settings.settings & json_relaxed_commas))
                      {
                         sprintf (error, "%d:%d: Expected , before \"", cur_line, e_off);
                         goto e_failed;
@@ -544,6 +889,9 @@ json_value * json_parse_ex (json_settings * settings, const json_char * json, ch
                   
                   case '}':
 
+                     if (!state.first_pass && top->u.object.index)
+                        build_index (top);
+
                      flags = (flags & ~ flag_need_comma) | flag_next;
                      break;
 
@@ -590,10 +938,21 @@ json_value * json_parse_ex (json_settings * settings, const json_char * json, ch
                      }
 
                      top->u.integer = (top->u.integer * 10) + (b - '0');
+
+                     if (! (flags & flag_num_zero))
+                     {
+                        ++ i;
+                        top->u.integer = (long) add_digits (top->u.integer, &i, &num_digits);
+                        -- i;
+                     }
+
                      continue;
                   }
 
-                  num_fraction = (num_fraction * 10) + (b - '0');
+                  ++ i;
+                  num_fraction = (long) add_digits (num_fraction * 10 + (b - '0'), &i, &num_digits);
+                  -- i;
+
                   continue;
                }
 
@@ -762,6 +1121,12 @@ e_failed:
          strcpy (error_buf, "Unknown error");
    }
 
+   if (state.settings.settings & json_enable_arena)
+   {
+      json_arena_release (state.arena_first);
+      return 0;
+   }
+
    if (state.first_pass)
       alloc = root;
 
@@ -786,6 +1151,41 @@ json_value * json_parse (const json_char * json)
    return json_parse_ex (&settings, json, 0);
 }
 
+const json_value * json_object_get (const json_value * object, const json_char * name)
+{
+   unsigned int i, slot, mask;
+
+   if (object->type != json_object)
+      return 0;
+
+   if (object->u.object.index)
+   {
+      mask = json_index_capacity (object->u.object.length) - 1;
+
+      for (slot = json_hash (name) & mask; (i = object->u.object.index [slot]); slot = (slot + 1) & mask)
+      {
+         if (!strcmp (object->u.object.values [i - 1].name, name))
+            return object->u.object.values [i - 1].value;
+      }
+
+      return 0;
+   }
+
+   for (i = 0; i < object->u.object.length; ++ i)
+      if (!strcmp (object->u.object.values [i].name, name))
+         return object->u.object.values [i].value;
+
+   return 0;
+}
+
+void json_arena_free (json_value * root)
+{
+   if (!root)
+      return;
+
+   json_arena_release ((json_arena_block *) (((char *) root) - json_arena_header));
+}
+
 void json_value_free (json_value * value)
 {
    json_value * cur_value;
@@ -836,3 +1236,990 @@ void json_value_free (json_value * value)
    }
 }
 
+
+void json_buffer_init (json_buffer * buffer, json_char * initial, size_t size, int indent)
+{
+   memset (buffer, 0, sizeof (json_buffer));
+
+   buffer->buf = initial;
+   buffer->capacity = initial ? size : 0;
+   buffer->indent = indent;
+
+   if (buffer->capacity)
+      *buffer->buf = 0;
+}
+
+void json_buffer_free (json_buffer * buffer)
+{
+   if (buffer->owned)
+      free (buffer->buf);
+
+   buffer->buf = 0;
+   buffer->length = buffer->capacity = 0;
+   buffer->owned = 0;
+}
+
+/* Makes room for size more characters plus the terminator */
+static int json_buffer_reserve (json_buffer * buffer, size_t size)
+{
+   size_t capacity;
+   json_char * buf;
+
+   if (buffer->failed)
+      return 0;
+
+   if (buffer->length + size + 1 <= buffer->capacity)
+      return 1;
+
+   capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+
+   while (capacity < buffer->length + size + 1)
+      capacity *= 2;
+
+   if (buffer->owned)
+      buf = (json_char *) realloc (buffer->buf, capacity);
+   else if ( (buf = (json_char *) malloc (capacity)) && buffer->length)
+      memcpy (buf, buffer->buf, buffer->length);
+
+   if (!buf)
+   {
+      buffer->failed = 1;
+      return 0;
+   }
+
+   buffer->buf = buf;
+   buffer->capacity = capacity;
+   buffer->owned = 1;
+
+   return 1;
+}
+
+static void json_buffer_append (json_buffer * buffer, const json_char * str, size_t length)
+{
+   if (!json_buffer_reserve (buffer, length))
+      return;
+
+   memcpy (buffer->buf + buffer->length, str, length);
+   buffer->buf [buffer->length += length] = 0;
+}
+
+static void json_buffer_newline (json_buffer * buffer, int depth)
+{
+   size_t length = 1 + (size_t) depth * buffer->indent;
+
+   if (!json_buffer_reserve (buffer, length))
+      return;
+
+   buffer->buf [buffer->length] = '\n';
+   memset (buffer->buf + buffer->length + 1, ' ', length - 1);
+   buffer->buf [buffer->length += length] = 0;
+}
+
+/* Separator and indentation before a value, unless it follows its key */
+static void json_write_separator (json_buffer * buffer)
+{
+   if (buffer->after_key)
+   {
+      buffer->after_key = 0;
+      return;
+   }
+
+   if (buffer->need_comma)
+      json_buffer_append (buffer, ",", 1);
+
+   if (buffer->indent && buffer->depth)
+      json_buffer_newline (buffer, buffer->depth);
+
+   buffer->need_comma = 1;
+}
+
+static void json_write_begin (json_buffer * buffer, json_char c)
+{
+   json_write_separator (buffer);
+   json_buffer_append (buffer, &c, 1);
+
+   ++ buffer->depth;
+   buffer->need_comma = 0;
+}
+
+static void json_write_end (json_buffer * buffer, json_char c)
+{
+   -- buffer->depth;
+
+   if (buffer->indent && buffer->need_comma)
+      json_buffer_newline (buffer, buffer->depth);
+
+   json_buffer_append (buffer, &c, 1);
+   buffer->need_comma = 1;
+}
+
+void json_write_object_begin (json_buffer * buffer)
+{
+   json_write_begin (buffer, '{');
+}
+
+void json_write_object_end (json_buffer * buffer)
+{
+   json_write_end (buffer, '}');
+}
+
+void json_write_array_begin (json_buffer * buffer)
+{
+   json_write_begin (buffer, '[');
+}
+
+void json_write_array_end (json_buffer * buffer)
+{
+   json_write_end (buffer, ']');
+}
+
+/* Eight bytes at a time: any byte below 0x20, '"' or '\\' */
+#define json_word_ones 0x0101010101010101ULL
+#define json_word_highs 0x8080808080808080ULL
+#define json_word_has_zero(w) (((w) - json_word_ones) & ~(w) & json_word_highs)
+
+static int json_needs_escape (unsigned long long w)
+{
+   return (json_word_has_zero (w & 0xE0E0E0E0E0E0E0E0ULL)
+            | json_word_has_zero (w ^ (json_word_ones * '"'))
+            | json_word_has_zero (w ^ (json_word_ones * '\\'))) != 0;
+}
+
+static void json_write_escaped (json_buffer * buffer, const json_char * str, size_t length)
+{
+   static const char hex [] = "0123456789abcdef";
+
+   const unsigned char * p = (const unsigned char *) str;
+   const unsigned char * end = p + length, * run;
+   unsigned long long w;
+   json_char esc [6];
+   size_t esc_length;
+
+   json_buffer_append (buffer, "\"", 1);
+
+   while (p < end)
+   {
+      /* Copy the run without special characters in one go */
+
+      run = p;
+
+      while (end - p >= 8)
+      {
+         memcpy (&w, p, 8);
+
+         if (json_needs_escape (w))
+            break;
+
+         p += 8;
+      }
+
+      while (p < end && *p >= 0x20 && *p != '"' && *p != '\\')
+         ++ p;
+
+      json_buffer_append (buffer, (const json_char *) run, p - run);
+
+      if (p == end)
+         break;
+
+      esc [0] = '\\';
+      esc_length = 2;
+
+      switch (*p)
+      {
+         case '"':  esc [1] = '"';  break;
+         case '\\': esc [1] = '\\'; break;
+         case '\b': esc [1] = 'b';  break;
+         case '\f': esc [1] = 'f';  break;
+         case '\n': esc [1] = 'n';  break;
+         case '\r': esc [1] = 'r';  break;
+         case '\t': esc [1] = 't';  break;
+
+         default:
+
+            esc [1] = 'u';
+            esc [2] = '0';
+            esc [3] = '0';
+            esc [4] = hex [*p >> 4];
+            esc [5] = hex [*p & 15];
+            esc_length = 6;
+      };
+
+      json_buffer_append (buffer, esc, esc_length);
+      ++ p;
+   }
+
+   json_buffer_append (buffer, "\"", 1);
+}
+
+void json_write_key (json_buffer * buffer, const json_char * name, size_t length)
+{
+   json_write_separator (buffer);
+   json_write_escaped (buffer, name, length);
+
+   if (buffer->indent)
+      json_buffer_append (buffer, ": ", 2);
+   else
+      json_buffer_append (buffer, ":", 1);
+
+   buffer->after_key = 1;
+}
+
+void json_write_string (json_buffer * buffer, const json_char * str, size_t length)
+{
+   json_write_separator (buffer);
+   json_write_escaped (buffer, str, length);
+}
+
+static const char json_digit_pairs [] =
+   "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+   "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+   "8081828384858687888990919293949596979899";
+
+/* Formats two digits per step from the end, returns the length */
+static int json_format_integer (json_char * out, long long value)
+{
+   json_char digits [24];
+   json_char * p = digits + sizeof (digits);
+   unsigned long long u = value < 0 ? 0 - (unsigned long long) value : (unsigned long long) value;
+   int length;
+
+   while (u >= 100)
+   {
+      p -= 2;
+      memcpy (p, json_digit_pairs + (u % 100) * 2, 2);
+      u /= 100;
+   }
+
+   if (u >= 10)
+   {
+      p -= 2;
+      memcpy (p, json_digit_pairs + u * 2, 2);
+   }
+   else
+      *-- p = (json_char) ('0' + u);
+
+   if (value < 0)
+      *-- p = '-';
+
+   length = (int) (digits + sizeof (digits) - p);
+   memcpy (out, p, length);
+
+   return length;
+}
+
+void json_write_integer (json_buffer * buffer, long long value)
+{
+   json_char str [24];
+
+   json_write_separator (buffer);
+   json_buffer_append (buffer, str, json_format_integer (str, value));
+}
+
+void json_write_double (json_buffer * buffer, double value)
+{
+   json_char str [32];
+   int length, i;
+
+   json_write_separator (buffer);
+
+   if (value != value || value - value != 0)
+   {
+      /* NaN and infinity have no JSON representation */
+      json_buffer_append (buffer, "null", 4);
+      return;
+   }
+
+   if (fabs (value) < 9007199254740992.0 && value == (double) (long long) value
+         && (value != 0 || 1 / value > 0))
+   {
+      /* Integral values skip printf, ".0" keeps them doubles when parsed */
+      length = json_format_integer (str, (long long) value);
+      memcpy (str + length, ".0", 2);
+      json_buffer_append (buffer, str, length + 2);
+      return;
+   }
+
+   /* Shortest of 15 or 17 significant digits that reads back exactly */
+   length = sprintf (str, "%.15g", value);
+
+   if (strtod (str, 0) != value)
+      length = sprintf (str, "%.17g", value);
+
+   for (i = 0; i < length; ++ i)
+   {
+      if (str [i] == ',')
+         str [i] = '.'; /* decimal comma locales */
+
+      if (str [i] == '.' || str [i] == 'e')
+         break;
+   }
+
+   if (i == length)
+   {
+      memcpy (str + length, ".0", 2);
+      length += 2;
+   }
+
+   json_buffer_append (buffer, str, length);
+}
+
+void json_write_boolean (json_buffer * buffer, int value)
+{
+   json_write_separator (buffer);
+
+   if (value)
+      json_buffer_append (buffer, "true", 4);
+   else
+      json_buffer_append (buffer, "false", 5);
+}
+
+void json_write_null (json_buffer * buffer)
+{
+   json_write_separator (buffer);
+   json_buffer_append (buffer, "null", 4);
+}
+
+int json_serialize (json_buffer * buffer, const json_value * value)
+{
+   unsigned int i;
+
+   switch (value->type)
+   {
+      case json_object:
+
+         json_write_object_begin (buffer);
+
+         for (i = 0; i < value->u.object.length; ++ i)
+         {
+            json_write_key (buffer, value->u.object.values [i].name,
+                            strlen (value->u.object.values [i].name));
+
+            json_serialize (buffer, value->u.object.values [i].value);
+         }
+
+         json_write_object_end (buffer);
+         break;
+
+      case json_array:
+
+         json_write_array_begin (buffer);
+
+         for (i = 0; i < value->u.array.length; ++ i)
+            json_serialize (buffer, value->u.array.values [i]);
+
+         json_write_array_end (buffer);
+         break;
+
+      case json_integer:
+
+         json_write_integer (buffer, value->u.integer);
+         break;
+
+      case json_double:
+
+         json_write_double (buffer, value->u.dbl);
+         break;
+
+      case json_string:
+
+         json_write_string (buffer, value->u.string.ptr, value->u.string.length);
+         break;
+
+      case json_boolean:
+
+         json_write_boolean (buffer, value->u.boolean);
+         break;
+
+      default:
+
+         json_write_null (buffer);
+         break;
+   };
+
+   return !buffer->failed;
+}
+
+typedef enum
+{
+   stream_value,
+   stream_key,
+   stream_colon,
+   stream_after_value,
+   stream_string,
+   stream_escape,
+   stream_unicode,
+   stream_number,
+   stream_literal,
+   stream_done,
+   stream_failed
+
+} json_stream_state;
+
+struct _json_stream
+{
+   json_settings settings;
+   json_stream_callbacks callbacks;
+   void * user;
+
+   json_stream_state state;
+
+   int in_key; /* the string being read is a member name */
+   int can_close; /* `]` or `}` may follow: empty container or relaxed comma */
+
+   /* One byte per open container, 1 for objects and 0 for arrays */
+   unsigned char * stack;
+   unsigned long depth, stack_size;
+
+   json_char * token;
+   unsigned long token_length, token_size;
+
+   const char * literal;
+   unsigned int literal_pos;
+
+   json_uchar uchar;
+   int uchar_digits;
+
+   unsigned int cur_line, cur_col;
+
+   json_char error [128];
+};
+
+json_stream * json_stream_new (json_settings * settings, const json_stream_callbacks * callbacks, void * user)
+{
+   json_stream * stream = (json_stream *) calloc (1, sizeof (json_stream));
+
+   if (!stream)
+      return 0;
+
+   if (settings)
+      memcpy (&stream->settings, settings, sizeof (json_settings));
+
+   memcpy (&stream->callbacks, callbacks, sizeof (json_stream_callbacks));
+   stream->user = user;
+
+   stream->state = stream_value;
+   stream->cur_line = 1;
+
+   return stream;
+}
+
+void json_stream_free (json_stream * stream)
+{
+   if (!stream)
+      return;
+
+   free (stream->stack);
+   free (stream->token);
+   free (stream);
+}
+
+const char * json_stream_error (json_stream * stream)
+{
+   return stream->error;
+}
+
+static int json_stream_fail (json_stream * stream, const char * what, json_char b)
+{
+   if (stream->state == stream_failed)
+      return 0;
+
+   if (b)
+      sprintf (stream->error, "%u:%u: %s `%c`", stream->cur_line, stream->cur_col, what, b);
+   else
+      sprintf (stream->error, "%u:%u: %s", stream->cur_line, stream->cur_col, what);
+
+   stream->state = stream_failed;
+   return 0;
+}
+
+/* Grows a buffer in place, keeping stack + token within max_memory */
+static int json_stream_grow (json_stream * stream, void ** buf, unsigned long * size, unsigned long need)
+{
+   unsigned long new_size = *size ? *size : 64;
+   void * new_buf;
+
+   while (new_size < need)
+      new_size *= 2;
+
+   if (stream->settings.max_memory
+         && stream->stack_size + stream->token_size - *size + new_size > stream->settings.max_memory)
+   {
+      return json_stream_fail (stream, "Too long (max_memory exceeded)", 0);
+   }
+
+   if (! (new_buf = realloc (*buf, new_size)))
+      return json_stream_fail (stream, "Memory allocation failure", 0);
+
+   *buf = new_buf;
+   *size = new_size;
+
+   return 1;
+}
+
+static int json_stream_token_add (json_stream * stream, json_char b)
+{
+   if (stream->token_length + 1 >= stream->token_size
+         && !json_stream_grow (stream, (void **) &stream->token, &stream->token_size, stream->token_length + 2))
+   {
+      return 0;
+   }
+
+   stream->token [stream->token_length ++] = b;
+   return 1;
+}
+
+#define stream_callback(name, args) \
+   (!stream->callbacks.name || stream->callbacks.name args \
+      || json_stream_fail (stream, "Stopped by callback", 0))
+
+static int json_stream_after_value (json_stream * stream)
+{
+   stream->state = stream->depth ? stream_after_value : stream_done;
+   return 1;
+}
+
+static int json_stream_open (json_stream * stream, int is_object)
+{
+   if (stream->depth >= stream->stack_size
+         && !json_stream_grow (stream, (void **) &stream->stack, &stream->stack_size, stream->depth + 1))
+   {
+      return 0;
+   }
+
+   stream->stack [stream->depth ++] = (unsigned char) is_object;
+
+   stream->state = is_object ? stream_key : stream_value;
+   stream->can_close = 1;
+
+   return is_object ? stream_callback (object_begin, (stream->user))
+                    : stream_callback (array_begin, (stream->user));
+}
+
+static int json_stream_close (json_stream * stream, json_char b)
+{
+   int is_object = stream->stack [stream->depth - 1];
+
+   if (b != (is_object ? '}' : ']'))
+      return json_stream_fail (stream, "Unexpected", b);
+
+   -- stream->depth;
+
+   if (! (is_object ? stream_callback (object_end, (stream->user))
+                    : stream_callback (array_end, (stream->user))))
+   {
+      return 0;
+   }
+
+   return json_stream_after_value (stream);
+}
+
+/* Same grammar and conversion as json_parse_ex */
+static int json_stream_number (json_stream * stream)
+{
+   const json_char * p = stream->token, * end = p + stream->token_length;
+   unsigned long long integer = 0;
+   double dbl, fraction = 0, scale = 1;
+   long e = 0;
+   int negative = 0, e_negative = 0, is_double = 0;
+
+   if (*p == '-')
+   {
+      negative = 1;
+      ++ p;
+   }
+
+   if (p == end || !isdigit ((unsigned char) *p) || (*p == '0' && p + 1 < end && isdigit ((unsigned char) p [1])))
+      return json_stream_fail (stream, "Invalid number", 0);
+
+   for (; p < end && isdigit ((unsigned char) *p); ++ p)
+   {
+      if (integer > (0x7FFFFFFFFFFFFFFFULL - 9) / 10)
+         break;
+
+      integer = integer * 10 + (*p - '0');
+   }
+
+   dbl = (double) integer;
+
+   for (; p < end && isdigit ((unsigned char) *p); ++ p)
+   {
+      /* Too big for an integer, the rest goes into the double */
+
+      dbl = dbl * 10 + (*p - '0');
+      is_double = 1;
+   }
+
+   if (p < end && *p == '.')
+   {
+      if (++ p == end || !isdigit ((unsigned char) *p))
+         return json_stream_fail (stream, "Expected digit after `.`", 0);
+
+      for (; p < end && isdigit ((unsigned char) *p); ++ p)
+      {
+         fraction = fraction * 10 + (*p - '0');
+         scale *= 10;
+      }
+
+      dbl += fraction / scale;
+      is_double = 1;
+   }
+
+   if (p < end && (*p == 'e' || *p == 'E'))
+   {
+      if (++ p < end && (*p == '+' || *p == '-'))
+         e_negative = *p ++ == '-';
+
+      if (p == end || !isdigit ((unsigned char) *p))
+         return json_stream_fail (stream, "Expected digit after `e`", 0);
+
+      for (; p < end && isdigit ((unsigned char) *p); ++ p)
+      {
+         if (e < 100000)
+            e = e * 10 + (*p - '0');
+      }
+
+      dbl *= pow (10, e_negative ? - e : e);
+      is_double = 1;
+   }
+
+   if (p != end)
+      return json_stream_fail (stream, "Invalid number", 0);
+
+   stream->token_length = 0;
+
+   if (is_double)
+      return stream_callback (dbl, (stream->user, negative ? - dbl : dbl));
+
+   return stream_callback (integer, (stream->user, negative ? - (long long) integer : (long long) integer));
+}
+
+int json_stream_feed (json_stream * stream, const json_char * chunk, size_t length)
+{
+   const json_char * i = chunk, * end = chunk + length, * run;
+   json_char b;
+   unsigned char hex;
+
+   while (i < end)
+   {
+      b = *i;
+
+      switch (stream->state)
+      {
+         case stream_failed:
+            return 0;
+
+         case stream_string:
+
+            /* Plain characters are appended in bulk */
+
+            for (run = i; i < end && *i != '"' && *i != '\\'; ++ i)
+               ;
+
+            if (i > run)
+            {
+               if (stream->token_length + (i - run) + 1 > stream->token_size
+                     && !json_stream_grow (stream, (void **) &stream->token, &stream->token_size,
+                                           stream->token_length + (i - run) + 1))
+               {
+                  return 0;
+               }
+
+               memcpy (stream->token + stream->token_length, run, i - run);
+               stream->token_length += i - run;
+               stream->cur_col += (unsigned int) (i - run);
+               continue;
+            }
+
+            ++ stream->cur_col;
+            ++ i;
+
+            if (b == '\\')
+            {
+               stream->state = stream_escape;
+               continue;
+            }
+
+            if (!json_stream_token_add (stream, 0))
+               return 0;
+
+            -- stream->token_length;
+
+            if (stream->in_key)
+            {
+               stream->state = stream_colon;
+
+               if (!stream_callback (key, (stream->user, stream->token, stream->token_length)))
+                  return 0;
+            }
+            else
+            {
+               json_stream_after_value (stream);
+
+               if (!stream_callback (string, (stream->user, stream->token, stream->token_length)))
+                  return 0;
+            }
+
+            stream->token_length = 0;
+            continue;
+
+         case stream_escape:
+
+            switch (b)
+            {
+               case 'b':  b = '\b';  break;
+               case 'f':  b = '\f';  break;
+               case 'n':  b = '\n';  break;
+               case 'r':  b = '\r';  break;
+               case 't':  b = '\t';  break;
+
+               case 'u':
+
+                  stream->state = stream_unicode;
+                  stream->uchar = 0;
+                  stream->uchar_digits = 0;
+                  break;
+            };
+
+            if (stream->state == stream_escape)
+            {
+               if (!json_stream_token_add (stream, b))
+                  return 0;
+
+               stream->state = stream_string;
+            }
+
+            ++ stream->cur_col;
+            ++ i;
+            continue;
+
+         case stream_unicode:
+
+            if ((hex = hex_value (b)) == 0xFF)
+               return json_stream_fail (stream, "Invalid character value", b);
+
+            stream->uchar = stream->uchar * 16 + hex;
+
+            ++ stream->cur_col;
+            ++ i;
+
+            if (++ stream->uchar_digits < 4)
+               continue;
+
+            if (stream->uchar <= 0x7F)
+            {
+               if (!json_stream_token_add (stream, (json_char) stream->uchar))
+                  return 0;
+            }
+            else if (stream->uchar <= 0x7FF)
+            {
+               if (!json_stream_token_add (stream, (json_char) (0xC0 | (stream->uchar >> 6)))
+                     || !json_stream_token_add (stream, (json_char) (0x80 | (stream->uchar & 0x3F))))
+                  return 0;
+            }
+            else
+            {
+               if (!json_stream_token_add (stream, (json_char) (0xE0 | (stream->uchar >> 12)))
+                     || !json_stream_token_add (stream, (json_char) (0x80 | ((stream->uchar >> 6) & 0x3F)))
+                     || !json_stream_token_add (stream, (json_char) (0x80 | (stream->uchar & 0x3F))))
+                  return 0;
+            }
+
+            stream->state = stream_string;
+            continue;
+
+         case stream_number:
+
+            if (isdigit ((unsigned char) b) || b == '.' || b == 'e' || b == 'E' || b == '+' || b == '-')
+            {
+               if (!json_stream_token_add (stream, b))
+                  return 0;
+
+               ++ stream->cur_col;
+               ++ i;
+               continue;
+            }
+
+            /* The number ends here, b is processed again after it */
+
+            json_stream_after_value (stream);
+
+            if (!json_stream_number (stream))
+               return 0;
+
+            continue;
+
+         case stream_literal:
+
+            if (b != stream->literal [stream->literal_pos])
+               return json_stream_fail (stream, "Unknown value", 0);
+
+            ++ stream->cur_col;
+            ++ i;
+
+            if (stream->literal [++ stream->literal_pos])
+               continue;
+
+            json_stream_after_value (stream);
+
+            if (! (*stream->literal == 'n' ? stream_callback (null, (stream->user))
+                     : stream_callback (boolean, (stream->user, *stream->literal == 't'))))
+            {
+               return 0;
+            }
+
+            continue;
+
+         default:
+            break;
+      };
+
+      ++ stream->cur_col;
+      ++ i;
+
+      switch (b)
+      {
+         case '\n':
+
+            ++ stream->cur_line;
+            stream->cur_col = 0;
+
+         case ' ': case '\t': case '\r':
+            continue;
+      };
+
+      switch (stream->state)
+      {
+         case stream_value:
+
+            switch (b)
+            {
+               case '{':
+
+                  if (!json_stream_open (stream, 1))
+                     return 0;
+
+                  continue;
+
+               case '[':
+
+                  if (!json_stream_open (stream, 0))
+                     return 0;
+
+                  continue;
+
+               case ']':
+
+                  if (!stream->depth || !stream->can_close)
+                     return json_stream_fail (stream, "Unexpected", b);
+
+                  if (!json_stream_close (stream, b))
+                     return 0;
+
+                  continue;
+
+               case '"':
+
+                  stream->state = stream_string;
+                  stream->in_key = 0;
+                  continue;
+
+               case 't':  stream->literal = "true";  break;
+               case 'f':  stream->literal = "false";  break;
+               case 'n':  stream->literal = "null";  break;
+
+               default:
+
+                  if (isdigit ((unsigned char) b) || b == '-')
+                  {
+                     stream->state = stream_number;
+
+                     if (!json_stream_token_add (stream, b))
+                        return 0;
+
+                     continue;
+                  }
+
+                  return json_stream_fail (stream, "Unexpected", b);
+            };
+
+            stream->state = stream_literal;
+            stream->literal_pos = 1;
+            continue;
+
+         case stream_key:
+
+            if (b == '"')
+            {
+               stream->state = stream_string;
+               stream->in_key = 1;
+               continue;
+            }
+
+            if (b == '}' && stream->can_close)
+            {
+               if (!json_stream_close (stream, b))
+                  return 0;
+
+               continue;
+            }
+
+            return json_stream_fail (stream, "Expected \" in object instead of", b);
+
+         case stream_colon:
+
+            if (b != ':')
+               return json_stream_fail (stream, "Expected : before", b);
+
+            stream->state = stream_value;
+            stream->can_close = 0;
+            continue;
+
+         case stream_after_value:
+
+            if (b == ',')
+            {
+               stream->state = stream->stack [stream->depth - 1] ? stream_key : stream_value;
+               stream->can_close = (stream->settings.settings & json_relaxed_commas) != 0;
+               continue;
+            }
+
+            if (b == '}' || b == ']')
+            {
+               if (!json_stream_close (stream, b))
+                  return 0;
+
+               continue;
+            }
+
+            return json_stream_fail (stream, "Expected , before", b);
+
+         case stream_done:
+
+            return json_stream_fail (stream, "Trailing garbage:", b);
+
+         default:
+            return json_stream_fail (stream, "Unexpected", b);
+      };
+   }
+
+   return stream->state != stream_failed;
+}
+
+int json_stream_finish (json_stream * stream)
+{
+   if (stream->state == stream_number)
+   {
+      json_stream_after_value (stream);
+
+      if (!json_stream_number (stream))
+         return 0;
+   }
+
+   if (stream->state == stream_failed)
+      return 0;
+
+   if (stream->state != stream_done)
+      return json_stream_fail (stream, "Unexpected EOF", 0);
+
+   return 1;
+}
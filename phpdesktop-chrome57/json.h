@@ -38,6 +38,8 @@
    #define json_char char
 #endif
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 
    #include "defines.h"
@@ -55,10 +57,26 @@ typedef struct
    unsigned long max_memory;
    int settings;
 
+   /* Optional first block of memory for json_enable_arena. It must be
+    * aligned for a pointer and stay valid until json_arena_free is called.
+    */
+   void * arena_block;
+   unsigned long arena_block_size;
+
 } json_settings;
 
 #define json_relaxed_commas 1
 
+/* Allocate the whole document from one growable region, released at once
+ * by json_arena_free instead of json_value_free.
+ */
+#define json_enable_arena 2
+
+/* Build a hash index of member names for objects with many members, used
+ * by json_object_get and the C++ operator [].
+ */
+#define json_enable_key_index 4
+
 typedef enum
 {
    json_none,
@@ -74,6 +92,14 @@ typedef enum
 
 extern const struct _json_value json_value_none;
 
+struct _json_value;
+
+/* Returns the member of object with the given name, or 0. Uses the hash
+ * index if the object has one, otherwise a linear scan.
+ */
+const struct _json_value * json_object_get
+   (const struct _json_value * object, const json_char * name);
+
 typedef struct _json_value
 {
    struct _json_value * parent;
@@ -104,6 +130,8 @@ typedef struct _json_value
 
          } * values;
 
+         unsigned int * index; /* json_enable_key_index, or 0 */
+
       } object;
 
       struct
@@ -146,14 +174,12 @@ typedef struct _json_value
 
          inline const struct _json_value &operator [] (const char * index) const
          { 
-            if (type != json_object)
-               return json_value_none;
+            const struct _json_value * value = json_object_get (this, index);
 
-            for (unsigned int i = 0; i < u.object.length; ++ i)
-               if (!strcmp (u.object.values [i].name, index))
-                  return *u.object.values [i].value;
+            if (!value)
+               return json_value_none;
 
-            return json_value_none;
+            return *value;
          }
 
          inline operator const char * () const
@@ -242,6 +268,93 @@ json_value * json_parse_ex
 
 void json_value_free (json_value *);
 
+/* Releases a document parsed with json_enable_arena */
+void json_arena_free (json_value *);
+
+
+/* Output buffer for json_serialize and the json_write_* builder calls.
+ * Starts in caller-provided memory (may be 0) and moves to the heap when
+ * it needs to grow. The output is always null terminated.
+ */
+typedef struct
+{
+   json_char * buf;
+   size_t length;
+   size_t capacity;
+
+   int owned; /* buf was allocated by json_buffer_* */
+   int failed; /* out of memory, further writes are ignored */
+
+   int indent; /* spaces per level, 0 for compact output */
+   int depth;
+   int need_comma;
+   int after_key;
+
+} json_buffer;
+
+#define json_serialize_compact 0
+#define json_serialize_pretty  3
+
+void json_buffer_init
+   (json_buffer *, json_char * initial, size_t size, int indent);
+
+void json_buffer_free (json_buffer *);
+
+/* Appends the whole tree. Returns 0 if out of memory. */
+int json_serialize (json_buffer *, const json_value *);
+
+/* Builder events, for output that does not come from a json_value tree.
+ * Keys and values are written in document order, json_write_key must
+ * precede each member value of an object.
+ */
+void json_write_object_begin (json_buffer *);
+void json_write_object_end (json_buffer *);
+void json_write_array_begin (json_buffer *);
+void json_write_array_end (json_buffer *);
+void json_write_key (json_buffer *, const json_char *, size_t length);
+void json_write_string (json_buffer *, const json_char *, size_t length);
+void json_write_integer (json_buffer *, long long);
+void json_write_double (json_buffer *, double);
+void json_write_boolean (json_buffer *, int);
+void json_write_null (json_buffer *);
+
+
+/* Push parser: input is fed in chunks of any size and reported through
+ * callbacks instead of building a tree. Memory use depends only on the
+ * nesting depth and the longest string or number, limited by max_memory
+ * in the settings when it is not 0. A callback returning 0 stops the
+ * parse with an error. Callbacks may be 0. Strings are null terminated,
+ * the pointers are only valid during the callback.
+ */
+typedef struct
+{
+   int (* object_begin) (void * user);
+   int (* object_end) (void * user);
+   int (* array_begin) (void * user);
+   int (* array_end) (void * user);
+
+   int (* key) (void * user, const json_char * name, size_t length);
+   int (* string) (void * user, const json_char * str, size_t length);
+   int (* integer) (void * user, long long value);
+   int (* dbl) (void * user, double value);
+   int (* boolean) (void * user, int value);
+   int (* null) (void * user);
+
+} json_stream_callbacks;
+
+typedef struct _json_stream json_stream;
+
+json_stream * json_stream_new
+   (json_settings * settings, const json_stream_callbacks *, void * user);
+
+/* Both return 0 on error, see json_stream_error */
+int json_stream_feed (json_stream *, const json_char * chunk, size_t length);
+int json_stream_finish (json_stream *);
+
+const char * json_stream_error (json_stream *);
+
+void json_stream_free (json_stream *);
+
 
 #ifdef __cplusplus
    } /* extern "C" */
@@ -15,19 +15,71 @@ inline std::string NowTime();
 enum TLogLevel {logERROR, logWARNING, logINFO, logDEBUG, 
                 logDEBUG1, logDEBUG2, logDEBUG3, logDEBUG4};
 
+// Growable buffer that keeps its capacity between messages.
+class LogStreamBuf : public std::streambuf
+{
+public:
+    LogStreamBuf() { buffer_.reserve(256); }
+    const char* data() const { return buffer_.data(); }
+    size_t size() const { return buffer_.size(); }
+    void clear() { buffer_.clear(); }
+protected:
+    virtual int_type overflow(int_type c)
+    {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            buffer_.push_back(traits_type::to_char_type(c));
+        return traits_type::not_eof(c);
+    }
+    virtual std::streamsize xsputn(const char* s, std::streamsize n)
+    {
+        buffer_.append(s, static_cast<size_t>(n));
+        return n;
+    }
+private:
+    std::string buffer_;
+};
+
+// Stream a single log statement is formatted into. Every thread reuses
+// its own instance, see Output2FILE::AcquireStream().
+class LogStream : public std::ostream
+{
+public:
+    LogStream() : std::ostream(NULL), in_use(false), owned(false)
+    {
+        rdbuf(&buf_);
+    }
+    const char* data() const { return buf_.data(); }
+    size_t size() const { return buf_.size(); }
+    // Forget the text and any formatting flags of the previous message.
+    void Reset()
+    {
+        buf_.clear();
+        clear();
+        flags(std::ios_base::dec | std::ios_base::skipws);
+        precision(6);
+        width(0);
+        fill(' ');
+    }
+    bool in_use;
+    bool owned;
+private:
+    LogStreamBuf buf_;
+};
+
 template <typename T>
 class Log
 {
 public:
     Log();
     virtual ~Log();
-    std::ostringstream& Get(TLogLevel level = logINFO);
+    std::ostream& Get(TLogLevel level = logINFO);
 public:
     static TLogLevel& ReportingLevel();
     static std::string ToString(TLogLevel level);
     static TLogLevel FromString(const std::string& level);
 protected:
-    std::ostringstream os;
+    LogStream& os;
+    TLogLevel level_;
 private:
     Log(const Log&);
     Log& operator =(const Log&);
@@ -35,12 +87,14 @@ private:
 
 template <typename T>
 Log<T>::Log()
+    : os(*T::AcquireStream()), level_(logINFO)
 {
 }
 
 template <typename T>
-std::ostringstream& Log<T>::Get(TLogLevel level)
+std::ostream& Log<T>::Get(TLogLevel level)
 {
+    level_ = level;
     os << "- " << NowTime();
     os << " " << ToString(level) << ": ";
     os << std::string(level > logDEBUG ? level - logDEBUG : 0, '\t');
@@ -50,12 +104,9 @@ std::ostringstream& Log<T>::Get(TLogLevel level)
 template <typename T>
 Log<T>::~Log()
 {
-    os << std::endl;
-    if (T::Stream() != stderr) {
-        fprintf(stderr, "%s", os.str().c_str());
-        fflush(stderr);
-    }
-    T::Output(os.str());
+    os << '\n';
+    T::Output(os.data(), os.size(), level_);
+    T::ReleaseStream(&os);
 }
 
 template <typename T>
@@ -97,11 +148,16 @@ TLogLevel Log<T>::FromString(const std::string& level)
     return logINFO;
 }
 
+// Messages are queued and written to stderr and Stream() by a background
+// thread, ERROR messages are written before Output() returns.
+// Implemented in logging.cpp.
 class Output2FILE
 {
 public:
     static FILE*& Stream();
-    static void Output(const std::string& msg);
+    static LogStream* AcquireStream();
+    static void ReleaseStream(LogStream* stream);
+    static void Output(const char* msg, size_t length, TLogLevel level);
 };
 
 inline FILE*& Output2FILE::Stream()
@@ -110,15 +166,6 @@ inline FILE*& Output2FILE::Stream()
     return pStream;
 }
 
-inline void Output2FILE::Output(const std::string& msg)
-{
-    FILE* pStream = Stream();
-    if (!pStream)
-        return;
-    fprintf(pStream, "%s", msg.c_str());
-    fflush(pStream);
-}
-
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
 #   if defined (BUILDING_FILELOG_DLL)
 #       define FILELOG_DECLSPEC   __declspec (dllexport)
@@ -134,13 +181,31 @@ inline void Output2FILE::Output(const std::string& msg)
 class FILELOG_DECLSPEC FILELog : public Log<Output2FILE> {};
 //typedef Log<Output2FILE> FILELog;
 
+// Statements above this level are removed at compile time, whatever
+// log_level is set in settings.json. Release builds keep DEBUG so that
+// users can still send a debug log, DEBUG1-DEBUG4 exist only in debug
+// builds. Define FILELOG_MAX_LEVEL in the project to change it.
 #ifndef FILELOG_MAX_LEVEL
-#define FILELOG_MAX_LEVEL logDEBUG4
+#   ifdef NDEBUG
+#       define FILELOG_MAX_LEVEL logDEBUG
+#   else
+#       define FILELOG_MAX_LEVEL logDEBUG4
+#   endif
 #endif
 
+template <TLogLevel level>
+struct LogLevelCompiledIn
+{
+    enum { value = level <= FILELOG_MAX_LEVEL };
+};
+
+// The level must be a constant. A statement that is compiled in costs
+// one comparison when filtered out at run time, its operands are not
+// evaluated. Whether Stream() is set is checked later by Output(), its
+// function-local static needs an initialization guard.
 #define LOG(level) \
-    if (level > FILELOG_MAX_LEVEL) ;\
-    else if (level > FILELog::ReportingLevel() || !Output2FILE::Stream()) ; \
+    if (!LogLevelCompiledIn<level>::value) ; \
+    else if (level > FILELog::ReportingLevel()) ; \
     else FILELog().Get(level)
 
 #define LOG_ERROR LOG(logERROR)
@@ -154,16 +219,13 @@ class FILELOG_DECLSPEC FILELog : public Log<Output2FILE> {};
 
 inline std::string NowTime()
 {
-    const int MAX_LEN = 200;
-    char buffer[MAX_LEN];
-    if (GetTimeFormatA(LOCALE_USER_DEFAULT, 0, 0, 
-            "HH':'mm':'ss", buffer, MAX_LEN) == 0)
-        return "Error in NowTime()";
-
-    char result[100] = {0};
-    static DWORD first = GetTickCount();
-    #pragma warning(suppress: 4996)
-    sprintf(result, "%s.%03ld", buffer, (long)(GetTickCount() - first) % 1000); 
+    // GetTimeFormatA() looks up locale data on every call, the format
+    // is fixed anyway.
+    SYSTEMTIME time;
+    GetLocalTime(&time);
+    char result[16] = {0};
+    sprintf_s(result, sizeof(result), "%02d:%02d:%02d.%03d",
+              time.wHour, time.wMinute, time.wSecond, time.wMilliseconds);
     return result;
 }
 
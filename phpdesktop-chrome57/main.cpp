@@ -21,9 +21,12 @@
 #include "log.h"
 #include "cef/browser_window.h"
 #include "settings.h"
+#include "settings_snapshot.h"
 #include "single_instance_application.h"
 #include "string_utils.h"
+#include "trace.h"
 #include "web_server.h"
+#include "www_archive.h"
 // #include "php_server.h"
 #include "cef/app.h"
 #include "random.h"
@@ -41,6 +44,8 @@ HCURSOR g_appStartingCursor = 0;
 
 extern std::map<HWND, BrowserWindow*> g_browserWindows; // browser_window.cpp
 std::string g_cgiEnvironmentFromArgv = "";
+// TraceClock() when the main window started loading the start page.
+double g_firstNavigationStart = 0;
 
 NOTIFYICONDATA GetTrayData(HWND hwnd)
 {
@@ -49,9 +54,10 @@ NOTIFYICONDATA GetTrayData(HWND hwnd)
     if (tray.cbSize) {
         return tray;
     }
-    json_value* appSettings = GetApplicationSettings();
-    std::string main_window_title = (*appSettings)["main_window"]["title"];
-    std::string minimize_to_tray_message = (*appSettings)["main_window"]["minimize_to_tray_message"];
+    const ApplicationSettings& settings = GetSettings();
+    const std::string& main_window_title = settings.main_window.title;
+    const std::string& minimize_to_tray_message =
+            settings.main_window.minimize_to_tray_message;
     tray.cbSize = sizeof(tray);
     tray.uID = 1;
     tray.uCallbackMessage = WM_TRAY_MESSAGE;
@@ -73,11 +79,8 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam,
     HWND childHandle = 0;
     HWND shellBrowserHandle = 0;
 
-    json_value* appSettings = GetApplicationSettings();
-    std::string main_window_title = (*appSettings)["main_window"]["title"];
-
     // Settings
-    bool minimize_to_tray = (*appSettings)["main_window"]["minimize_to_tray"];
+    bool minimize_to_tray = GetSettings().main_window.minimize_to_tray;
     if (CountBrowserWindows() > 1) {
         minimize_to_tray = false;
     }
@@ -113,6 +116,7 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam,
             LOG_DEBUG << "WM_DESTROY";
             RemoveBrowserWindow(hwnd);
             if (g_browserWindows.empty()) {
+                StopSettingsWatcher();
                 StopWebServer();
                 Shell_NotifyIcon(NIM_DELETE, &GetTrayData(hwnd));
 
@@ -215,6 +219,13 @@ void CALLBACK CheckMousePointerTimer(HWND hwnd, UINT uMsg, UINT timerId, DWORD d
     }
 }
 
+// Child processes launched after a reload get the new settings.
+static void RepublishSettingsSnapshot(const ApplicationSettings& old_settings,
+                                      const ApplicationSettings& new_settings,
+                                      int changed_sections) {
+    PublishSettingsSnapshot();
+}
+
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
                     LPTSTR lpstrCmdLine, int nCmdShow) {
     g_hInstance = hInstance;
@@ -228,7 +239,18 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
             LR_DEFAULTCOLOR | LR_DEFAULTSIZE | LR_SHARED);
     SetTimer(NULL, 0, 100, (TIMERPROC)&CheckMousePointerTimer);
 
-    json_value* appSettings = GetApplicationSettings();
+    // CEF subprocesses get settings from a snapshot published by
+    // the browser process, settings.json is parsed only when missing.
+    bool is_subprocess =
+            std::wstring(lpstrCmdLine).find(L"--type=") != std::string::npos;
+    bool settings_from_snapshot = false;
+    if (is_subprocess) {
+        settings_from_snapshot = LoadSettingsSnapshot(lpstrCmdLine);
+    }
+
+    double settings_start = TraceClock();
+    const ApplicationSettings& settings = GetSettings();
+    double settings_end = TraceClock();
     if (GetApplicationSettingsError().length()) {
         std::string error = GetApplicationSettingsError();
         error.append("\nApplication will terminate immediately. ");
@@ -236,22 +258,25 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
     }
 
     // Debugging options.
-    bool show_console = (*appSettings)["debugging"]["show_console"];
-    bool subprocess_show_console = (*appSettings)["debugging"]["subprocess_show_console"];
-    std::string log_level = (*appSettings)["debugging"]["log_level"];
-    std::string log_file = (*appSettings)["debugging"]["log_file"];
-    log_file = GetAbsolutePath(log_file);
-    
+    bool show_console = settings.debugging.show_console;
+    bool subprocess_show_console = settings.debugging.subprocess_show_console;
+    std::string log_level = settings.debugging.log_level;
+    std::string log_file = GetAbsolutePath(settings.debugging.log_file);
+
     // Initialize logging.
-    if (std::wstring(lpstrCmdLine).find(L"--type=") != std::string::npos) {
-        // This is a subprocess.
+    if (is_subprocess) {
         InitializeLogging(subprocess_show_console, log_level, log_file);
+        if (!settings_from_snapshot) {
+            LOG_DEBUG << "Settings snapshot not available in subprocess, "
+                         "parsed settings.json";
+        }
     } else {
         // Main browser process.
         InitializeLogging(show_console, log_level, log_file);
     }
 
     // Command line arguments
+    std::string pack_www_archive;
     LPWSTR *argv;
     int argc;
     argv = CommandLineToArgvW(GetCommandLineW(), &argc);
@@ -264,6 +289,8 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
                 std::string value = argument.substr(pos+1, std::string::npos);
                 if (name == "--cgi-environment" && value.length()) {
                     g_cgiEnvironmentFromArgv.assign(value);
+                } else if (name == "--pack-www" && value.length()) {
+                    pack_www_archive.assign(value);
                 }
             }
         }
@@ -280,6 +307,29 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
         return exit_code;
     }
 
+    // Pack www_directory into an archive for "web_server.www_archive"
+    // and exit.
+    if (pack_www_archive.length()) {
+        std::string www_directory = settings.web_server.www_directory;
+        if (www_directory.empty())
+            www_directory = "www";
+        std::string error;
+        bool packed = PackWwwArchive(GetAbsolutePath(www_directory),
+                                     GetAbsolutePath(pack_www_archive),
+                                     &error);
+        if (!packed)
+            LOG_ERROR << "Packing www failed: " << error;
+        ShutdownLogging();
+        return packed ? 0 : 1;
+    }
+
+    // Tracing the browser process only.
+    StartTracing(GetAbsolutePath(settings.debugging.trace_file),
+                 settings.debugging.trace_ring_buffer,
+                 settings.debugging.trace_buffer_size);
+    TraceEvent("startup", "settings", settings_start, settings_end,
+               settings_from_snapshot ? "snapshot" : "settings.json");
+
     LOG_INFO << "--------------------------------------------------------";
     LOG_INFO << "Started application";
 
@@ -289,15 +339,17 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
         LOG_INFO << "No logging file set";
     LOG_INFO << "Log level = "
              << FILELog::ToString(FILELog::ReportingLevel());
+    LogSettingsProblems();
+    PublishSettingsSnapshot();
 
     // Main window title option.
-    std::string main_window_title = (*appSettings)["main_window"]["title"];
+    std::string main_window_title = settings.main_window.title;
     if (main_window_title.empty())
         main_window_title = GetExecutableName();
 
     // Single instance guid option.
     const char* single_instance_guid =
-            (*appSettings)["application"]["single_instance_guid"];
+            settings.application.single_instance_guid.c_str();
     if (single_instance_guid && single_instance_guid[0] != 0) {
         int guidSize = strlen(single_instance_guid) + 1;
         g_singleInstanceApplicationGuid = new wchar_t[guidSize];
@@ -328,20 +380,23 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
                    Utf8ToWide(GetExecutableName()).c_str());
     }
 
+    double web_server_start = TraceClock();
     if (!StartWebServer()) {
         FatalError(NULL, "Error while starting an internal local server.\n"
                    "Application will terminate immediately.");
     }
+    TraceEvent("startup", "StartWebServer", web_server_start, TraceClock());
+    AddSettingsListener(&RepublishSettingsSnapshot);
+    StartSettingsWatcher();
 
     CefSettings cef_settings;
 
     // log_file
-    std::string chrome_log_file = (*appSettings)["chrome"]["log_file"];
-    chrome_log_file = GetAbsolutePath(chrome_log_file);
+    std::string chrome_log_file = GetAbsolutePath(settings.chrome.log_file);
     CefString(&cef_settings.log_file) = chrome_log_file;
 
     // log_severity
-    std::string chrome_log_severity = (*appSettings)["chrome"]["log_severity"];
+    const std::string& chrome_log_severity = settings.chrome.log_severity;
     cef_log_severity_t log_severity = LOGSEVERITY_DEFAULT;
     if (chrome_log_severity == "verbose") {
         log_severity = LOGSEVERITY_VERBOSE;
@@ -357,14 +412,12 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
     cef_settings.log_severity = log_severity;
 
     // cache_path
-    std::string cache_path = (*appSettings)["chrome"]["cache_path"];
-    cache_path = GetAbsolutePath(cache_path);
+    std::string cache_path = GetAbsolutePath(settings.chrome.cache_path);
     CefString(&cef_settings.cache_path) = cache_path;
 
     // remote_debugging_port
     // A value of -1 will disable remote debugging.
-    int remote_debugging_port = static_cast<long>(
-            (*appSettings)["chrome"]["remote_debugging_port"]);
+    int remote_debugging_port = settings.chrome.remote_debugging_port;
     if (remote_debugging_port == 0) {
         remote_debugging_port = random(49152, 65535+1);
         int i = 100;
@@ -380,7 +433,11 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
     // Sandbox support
     cef_settings.no_sandbox = true;
 
+    double cef_start = TraceClock();
     CefInitialize(main_args, cef_settings, app.get(), NULL);
+    TraceEvent("startup", "CefInitialize", cef_start, TraceClock());
+    // Reported by ClientHandler when the start page finished loading.
+    g_firstNavigationStart = TraceClock();
     CreateMainWindow(hInstance, nCmdShow, main_window_title);
     CefRunMessageLoop();
     CefShutdown();
@@ -388,6 +445,8 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
     LOG_INFO << "Ended application";
     LOG_INFO << "--------------------------------------------------------";
 
+    StopTracing();
+
     ShutdownLogging();
 
     return 0;
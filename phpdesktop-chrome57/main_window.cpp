@@ -12,15 +12,15 @@
 extern wchar_t g_windowClassName[256]; // main.cpp
 
 HWND CreateMainWindow(HINSTANCE hInstance, int nCmdShow, std::string title) {
-    json_value* appSettings = GetApplicationSettings();
-    int default_width = static_cast<long>((*appSettings)["main_window"]["default_size"][0]);
-    int default_height = static_cast<long>((*appSettings)["main_window"]["default_size"][1]);
+    const ApplicationSettings& settings = GetSettings();
+    int default_width = settings.main_window.default_size[0];
+    int default_height = settings.main_window.default_size[1];
     bool disable_maximize_button =
-            (*appSettings)["main_window"]["disable_maximize_button"];
-    bool center_on_screen = (*appSettings)["main_window"]["center_on_screen"];
-    bool dpi_aware = (*appSettings)["application"]["dpi_aware"];
-    bool start_maximized = (*appSettings)["main_window"]["start_maximized"];
-    bool always_on_top = (*appSettings)["main_window"]["always_on_top"];
+            settings.main_window.disable_maximize_button;
+    bool center_on_screen = settings.main_window.center_on_screen;
+    bool dpi_aware = settings.application.dpi_aware;
+    bool start_maximized = settings.main_window.start_maximized;
+    bool always_on_top = settings.main_window.always_on_top;
 
     if (default_width && default_height) {
         if (dpi_aware) {
@@ -28,6 +28,7 @@
 #else
 #ifdef __linux__
 #define _XOPEN_SOURCE 600     // For flockfile() on Linux
+#define _GNU_SOURCE           // For wait4() and POLLRDHUP on Linux
 #endif
 #define _LARGEFILE_SOURCE     // Enable 64-bit file offsets
 #define __STDC_FORMAT_MACROS  // <inttypes.h> wants this for C++
@@ -132,7 +133,7 @@ typedef long off_t;
 #define vsnprintf _vsnprintf
 #define mg_sleep(x) Sleep(x)
 
-#define pipe(x) _pipe(x, MG_BUF_LEN, _O_BINARY)
+#define pipe(x) _pipe(x, CGI_PIPE_SIZE, _O_BINARY | _O_NOINHERIT)
 #ifndef popen
 #define popen(x, y) _popen(x, y)
 #endif
@@ -201,16 +202,25 @@ struct pollfd {
 #endif
 
 
+#ifndef NO_CGI
+#include <psapi.h>
+#endif
+
 // Mark required libraries
 #ifdef _MSC_VER
 #pragma comment(lib, "Ws2_32.lib")
+#ifndef NO_CGI
+#pragma comment(lib, "Psapi.lib")
+#endif
 #endif
 
 #else    // UNIX  specific
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <stdint.h>
@@ -258,6 +268,10 @@ typedef int SOCKET;
 #define MAX_CGI_ENVIR_VARS 512
 #define MG_BUF_LEN 8192
 #define MAX_REQUEST_SIZE 16384
+#define MAX_CGI_HEADERS_SIZE 262144
+#define CGI_PIPE_SIZE 65536
+#define CGI_EXIT_TIMEOUT 100        // Milliseconds CGI may take to exit
+#define MAX_CGI_SCRIPT_STATS 1024   // Max number of entries in CGI stats
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
 #ifdef _WIN32
@@ -446,6 +460,7 @@ struct socket {
   union usa rsa;        // Remote socket address
   unsigned is_ssl:1;    // Is port SSL-ed
   unsigned ssl_redir:1; // Is port supposed to redirect everything to SSL port
+  double queued_time;   // mg_clock() when queued, if tracing is enabled
 };
 
 // NOTE(lsm): this enum shoulds be in sync with the config_options below.
@@ -456,6 +471,9 @@ enum {
   GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
   EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
   NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES, REQUEST_TIMEOUT, _404_HANDLER,
+  CONTENT_HASH_MANIFEST, CACHE_RULES, CACHE_FINGERPRINTED_URIS, CGI_CACHE_SIZE,
+  COALESCE_PATTERN, COALESCE_MAX_SIZE, COALESCE_TIMEOUT_MS,
+  ROUTE_CACHE_SIZE, WEBSOCKET_MAX_MESSAGE_SIZE, PUSH_URI, PUSH_QUEUE_SIZE,
   NUM_OPTIONS
 };
 
@@ -486,6 +504,25 @@ static const char *config_options[] = {
   "hide_files_patterns", NULL,
   "request_timeout_ms", "30000",
   "404_handler", NULL,
+  "content_hash_manifest", NULL,
+  "cache_rules", NULL,
+  "cache_fingerprinted_uris", "no",
+  "cgi_cache_size", "0",
+  "coalesce_pattern", NULL,
+  "coalesce_max_size", "1048576",
+  "coalesce_timeout_ms", "10000",
+  "route_cache_size", "0",
+  "websocket_max_message_size", "16777216",
+  "push_uri", "",
+  "push_queue_size", "1048576",
+  NULL
+};
+
+// Options that mg_set_option() may change while the server is running.
+// Code reading them must load ctx->config[i] only once per use.
+static const char *reloadable_options[] = {
+  "cgi_pattern", "index_files", "extra_mime_types", "hide_files_patterns",
+  "404_handler", "cache_rules", "cache_fingerprinted_uris", "coalesce_pattern",
   NULL
 };
 
@@ -502,6 +539,34 @@ struct mg_context {
   volatile int num_threads;  // Number of threads
   pthread_mutex_t mutex;     // Protects (max|num)_threads
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
+  long num_cgi_cancelled;    // CGI scripts killed because client hung up
+  double cgi_cancelled_wall_time;  // Seconds they ran before being killed
+  double cgi_cancelled_cpu_time;   // User and kernel CPU seconds they used
+  struct mg_cgi_script_stats *cgi_stats;  // CGI usage per SCRIPT_NAME
+  int num_cgi_stats;         // Number of entries in cgi_stats
+  char **retired_config;     // Values replaced by mg_set_option()
+  int num_retired_config;    // Number of entries in retired_config
+  struct content_hash **content_hashes;  // See get_content_hash()
+  int num_content_hash_buckets;  // Power of two, or 0
+  int num_content_hashes;    // Number of entries in content_hashes
+  pthread_mutex_t manifest_mutex;  // Serializes content_hash_manifest appends
+  struct cache_rule *cache_rules;  // Compiled CACHE_RULES option, or NULL
+  struct cgi_cache_entry **cgi_cache;  // Hash table, see cgi_cache_bucket()
+  struct cgi_cache_entry *cgi_cache_head;  // Most recently used entry
+  struct cgi_cache_entry *cgi_cache_tail;  // Least recently used entry
+  struct mg_cgi_cache_stats cgi_cache_stats;
+  struct cgi_flight *cgi_flights;  // CGI requests being coalesced
+  struct dir_listing *dir_listings;  // See get_dir_listing()
+  size_t dir_listings_size;
+  struct ssi_template *ssi_templates;  // See get_ssi_template()
+  size_t ssi_templates_size;
+  pthread_cond_t cgi_flight_done;  // Signaled when a flight finished
+  struct route_cache_entry **route_cache;  // See is_routed_uri()
+  int num_route_cache_entries;
+  volatile int route_cache_watched;  // Cleared on changes in document_root
+  unsigned route_cache_generation;  // Bumped by clear_route_cache()
+  struct push_subscriber *push_subscribers;  // See mg_publish()
+  int num_push_subscribers;
 
   struct socket queue[MGSQLEN];   // Accepted sockets
   volatile int sq_head;      // Head of the socket queue
@@ -517,6 +582,10 @@ struct mg_connection {
   SSL_CTX *client_ssl_ctx;    // SSL context for client connections
   struct socket client;       // Connected client
   time_t birth_time;          // Time when request was received
+  double start_time;          // mg_clock() when request processing started
+  double first_byte_time;     // trace_clock() when the reply started, or 0
+  struct cgi_capture *cgi_capture;  // CGI response being cached, or NULL
+  struct mg_request_stats stats; // Passed to end_request() callback
   int64_t num_bytes_sent;     // Total bytes sent to client
   int64_t content_len;        // Content-Length header value
   int64_t consumed_content;   // How many bytes of content have been read
@@ -546,7 +615,14 @@ const char **mg_get_valid_option_names(void) {
 static int is_file_in_memory(struct mg_connection *conn, const char *path,
                              struct file *filep) {
   size_t size = 0;
-  if ((filep->membuf = conn->ctx->callbacks.open_file == NULL ? NULL :
+  time_t modification_time = 0;
+  if (conn->ctx->callbacks.open_file_with_time != NULL) {
+    if ((filep->membuf = conn->ctx->callbacks.open_file_with_time(
+        conn, path, &size, &modification_time)) != NULL) {
+      filep->size = size;
+      filep->modification_time = modification_time;
+    }
+  } else if ((filep->membuf = conn->ctx->callbacks.open_file == NULL ? NULL :
        conn->ctx->callbacks.open_file(conn, path, &size)) != NULL) {
     // NOTE: override filep->size only on success. Otherwise, it might break
     // constructs like if (!mg_stat() || !mg_fopen()) ...
@@ -723,6 +799,106 @@ static char * mg_strdup(const char *str) {
   return mg_strndup(str, strlen(str));
 }
 
+// A rule of the "cache_rules" option, "pattern=directive;...". The
+// pattern is matched against the URI, the directive is sent as the
+// Cache-Control header. Both point into the option value.
+struct cache_rule {
+  struct vec pattern;
+  struct vec directive;
+  long max_age;   // max-age of the directive, or -1
+};
+
+// Returns an array of rules ending with a NULL pattern, in one
+// allocation so that mg_set_option() can retire it like a value.
+static struct cache_rule *compile_cache_rules(const char *list) {
+  struct cache_rule *rules;
+  const char *p, *end, *eq, *s;
+  int n = 1;
+
+  for (p = list; (p = strchr(p, ';')) != NULL; p++) {
+    n++;
+  }
+  if ((rules = (struct cache_rule *) calloc(n + 1, sizeof(*rules))) == NULL) {
+    return NULL;
+  }
+  for (n = 0, p = list; *p != '\0'; p = *end == '\0' ? end : end + 1) {
+    end = p + strcspn(p, ";");
+    if ((eq = (const char *) memchr(p, '=', end - p)) == NULL ||
+        eq == p || eq + 1 == end) {
+      continue;
+    }
+    rules[n].pattern.ptr = p;
+    rules[n].pattern.len = eq - p;
+    rules[n].directive.ptr = eq + 1;
+    rules[n].directive.len = end - (eq + 1);
+    rules[n].max_age = -1;
+    for (s = eq + 1; s + 8 <= end; s++) {
+      if (!mg_strncasecmp(s, "max-age=", 8) &&
+          (s == eq + 1 || s[-1] == ' ' || s[-1] == ',')) {
+        rules[n].max_age = strtol(s + 8, NULL, 10);
+        break;
+      }
+    }
+    n++;
+  }
+  return rules;
+}
+
+int mg_set_option(struct mg_context *ctx, const char *name,
+                  const char *value) {
+  struct cache_rule *rules = NULL;
+  char **retired;
+  char *new_value;
+  int i, j;
+
+  if ((i = get_option_index(name)) == -1 || value == NULL) {
+    return 0;
+  }
+  for (j = 0; reloadable_options[j] != NULL; j++) {
+    if (strcmp(reloadable_options[j], name) == 0) {
+      break;
+    }
+  }
+  if (reloadable_options[j] == NULL) {
+    cry(fc(ctx), "%s: option cannot be changed at run time", name);
+    return 0;
+  }
+  if ((new_value = mg_strdup(value)) == NULL) {
+    return 0;
+  }
+  if (i == CACHE_RULES && (rules = compile_cache_rules(new_value)) == NULL) {
+    free(new_value);
+    return 0;
+  }
+
+  // Requests in flight may still use the old value, so it is kept
+  // until the context is freed.
+  (void) pthread_mutex_lock(&ctx->mutex);
+  retired = (char **) realloc(ctx->retired_config,
+      (ctx->num_retired_config + 2) * sizeof(ctx->retired_config[0]));
+  if (retired == NULL) {
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    free(new_value);
+    free(rules);
+    return 0;
+  }
+  ctx->retired_config = retired;
+  if (ctx->config[i] != NULL) {
+    ctx->retired_config[ctx->num_retired_config++] = ctx->config[i];
+  }
+  ctx->config[i] = new_value;
+  if (i == CACHE_RULES) {
+    if (ctx->cache_rules != NULL) {
+      ctx->retired_config[ctx->num_retired_config++] =
+        (char *) ctx->cache_rules;
+    }
+    ctx->cache_rules = rules;
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  return 1;
+}
+
 static const char *mg_strcasestr(const char *big_str, const char *small_str) {
   int i, big_len = strlen(big_str), small_len = strlen(small_str);
 
@@ -1395,6 +1571,24 @@ static int set_non_blocking_mode(SOCKET sock) {
   return ioctlsocket(sock, FIONBIO, &on);
 }
 
+// Return monotonic time in seconds, for measuring intervals.
+static double mg_clock(void) {
+  LARGE_INTEGER freq, counter;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&counter);
+  return (double) counter.QuadPart / (double) freq.QuadPart;
+}
+
+// Like pthread_cond_wait(), but returns after at most ms milliseconds.
+// May wake up early, callers check their condition in a loop.
+static void cond_wait_ms(pthread_cond_t *cv, pthread_mutex_t *mutex,
+                         int ms) {
+  HANDLE handles[] = {cv->signal, cv->broadcast};
+  ReleaseMutex(*mutex);
+  WaitForMultipleObjects(2, handles, FALSE, (DWORD) ms);
+  WaitForSingleObject(*mutex, INFINITE);
+}
+
 #else
 static int mg_stat(struct mg_connection *conn, const char *path,
                    struct file *filep) {
@@ -1491,8 +1685,43 @@ static int set_non_blocking_mode(SOCKET sock) {
 
   return 0;
 }
+
+// Return monotonic time in seconds, for measuring intervals.
+static double mg_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Like pthread_cond_wait(), but returns after at most ms milliseconds.
+// May wake up early, callers check their condition in a loop.
+static void cond_wait_ms(pthread_cond_t *cv, pthread_mutex_t *mutex,
+                         int ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += (long) (ms % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  (void) pthread_cond_timedwait(cv, mutex, &ts);
+}
 #endif // _WIN32
 
+// Timestamp for trace_event(), 0 if tracing is disabled.
+static double trace_clock(const struct mg_context *ctx) {
+  return ctx->callbacks.trace_event != NULL ? mg_clock() : 0;
+}
+
+// Report a request phase that began at trace_clock() time start.
+static void trace_event(const struct mg_connection *conn, const char *name,
+                        double start) {
+  if (conn->ctx->callbacks.trace_event != NULL) {
+    conn->ctx->callbacks.trace_event(conn, name, start, mg_clock());
+  }
+}
+
 // Write data to the IO channel - opened file descriptor, socket or SSL
 // descriptor. Return number of bytes written.
 static int64_t push(FILE *fp, SOCKET sock, SSL *ssl, const char *buf,
@@ -1613,6 +1842,10 @@ int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
   time_t now;
   int64_t n, total, allowed;
 
+  if (conn->first_byte_time == 0) {
+    conn->first_byte_time = trace_clock(conn->ctx);
+  }
+
   if (conn->throttle > 0) {
     if ((now = time(NULL)) != conn->last_throttle_time) {
       conn->last_throttle_time = now;
@@ -1828,6 +2061,14 @@ int mg_get_cookie(const char *cookie_header, const char *var_name,
   return len;
 }
 
+// Match str against a pattern option. The option is loaded only once,
+// because mg_set_option() may replace it during the request.
+static int match_option(const struct mg_context *ctx, int option,
+                        const char *str) {
+  const char *pattern = ctx->config[option];
+  return match_prefix(pattern, strlen(pattern), str);
+}
+
 static void support_path_info_for_cgi_scripts(
                 struct mg_connection *conn, char *buf,
                 size_t buf_len, struct file *filep) {
@@ -1836,8 +2077,7 @@ static void support_path_info_for_cgi_scripts(
   for (p = buf + strlen(buf); p > buf + 1; p--) {
     if (*p == '/') {
       *p = '\0';
-      if (match_prefix(conn->ctx->config[CGI_EXTENSIONS],
-                       strlen(conn->ctx->config[CGI_EXTENSIONS]), buf) > 0 &&
+      if (match_option(conn->ctx, CGI_EXTENSIONS, buf) > 0 &&
           mg_stat(conn, buf, filep)) {
         // Shift PATH_INFO block one character right, e.g.
         //  "/x.cgi/foo/bar\x00" => "/x.cgi\x00/foo/bar\x00"
@@ -1855,13 +2095,198 @@ static void support_path_info_for_cgi_scripts(
   }
 }
 
+// Negative route cache, enabled with route_cache_size. Remembers URIs
+// that have no file in document_root, so requests routed to 404_handler
+// skip the stat calls. An entry ending with '/' is a missing directory
+// and matches every URI below it, other entries match one URI. On Windows
+// the cache is cleared when files are created or renamed in document_root,
+// elsewhere entries expire after ROUTE_CACHE_TTL seconds.
+#define ROUTE_CACHE_BUCKETS 1024
+#define ROUTE_CACHE_TTL 2
+
+struct route_cache_entry {
+  struct route_cache_entry *next;
+  double stored_time;   // mg_clock()
+  size_t len;
+  char uri[1];          // Not nul-terminated
+};
+
+static unsigned route_cache_bucket(const char *uri, size_t len) {
+  unsigned long hash = 5381;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash = hash * 33 + (unsigned char) uri[i];
+  }
+  return (unsigned) (hash % ROUTE_CACHE_BUCKETS);
+}
+
+// Must be called with ctx->mutex held.
+static int find_route_entry(const struct mg_context *ctx, const char *uri,
+                            size_t len, double now) {
+  const struct route_cache_entry *entry;
+
+  for (entry = ctx->route_cache[route_cache_bucket(uri, len)];
+       entry != NULL; entry = entry->next) {
+    if (entry->len == len && !memcmp(entry->uri, uri, len)) {
+      return ctx->route_cache_watched ||
+        now - entry->stored_time < ROUTE_CACHE_TTL;
+    }
+  }
+  return 0;
+}
+
+// Must be called with ctx->mutex held.
+static void free_route_entries(struct mg_context *ctx) {
+  struct route_cache_entry *entry, *next;
+  int i;
+
+  for (i = 0; i < ROUTE_CACHE_BUCKETS; i++) {
+    for (entry = ctx->route_cache[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      free(entry);
+    }
+    ctx->route_cache[i] = NULL;
+  }
+  ctx->num_route_cache_entries = 0;
+}
+
+// Called when files may have been created. Bumping the generation makes
+// remember_routed_uri() drop entries for lookups that started before.
+static void clear_route_cache(struct mg_context *ctx) {
+  if (ctx->route_cache == NULL) {
+    return;
+  }
+  (void) pthread_mutex_lock(&ctx->mutex);
+  free_route_entries(ctx);
+  ctx->route_cache_generation++;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Returns 1 if the uri, or a directory it is in, is known to not exist.
+// Stores the cache generation, to be passed to remember_routed_uri().
+static int is_routed_uri(struct mg_context *ctx, const char *uri,
+                         unsigned *generation) {
+  size_t i, len = strlen(uri);
+  double now = mg_clock();
+  int found = 0;
+
+  if (ctx->route_cache == NULL) {
+    return 0;
+  }
+  (void) pthread_mutex_lock(&ctx->mutex);
+  *generation = ctx->route_cache_generation;
+  for (i = 1; i < len && !found; i++) {
+    if (uri[i] == '/') {
+      found = find_route_entry(ctx, uri, i + 1, now);
+    }
+  }
+  if (!found && len > 0 && uri[len - 1] != '/') {
+    found = find_route_entry(ctx, uri, len, now);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  return found;
+}
+
+// Adds a uri that has no file to the cache. Remembers the topmost missing
+// directory if there is one, so that other uris below it hit the cache.
+// The uri itself is remembered only if the .gz lookup was also done.
+// Nothing is stored if the cache was cleared since is_routed_uri(), as
+// the file may have been created after it was looked up.
+static void remember_routed_uri(struct mg_connection *conn, const char *uri,
+                                int gz_checked, unsigned generation) {
+  struct mg_context *ctx = conn->ctx;
+  struct route_cache_entry *entry;
+  struct file file = STRUCT_FILE_INITIALIZER;
+  char path[PATH_MAX];
+  size_t i, len = strlen(uri);
+  unsigned bucket;
+
+  if (ctx->route_cache == NULL || len == 0) {
+    return;
+  }
+  for (i = 1; i < len; i++) {
+    if (uri[i] == '/') {
+      mg_snprintf(conn, path, sizeof(path), "%s%.*s",
+                  ctx->config[DOCUMENT_ROOT], (int) i, uri);
+      if (!mg_stat(conn, path, &file)) {
+        len = i + 1;
+        break;
+      }
+    }
+  }
+  if (uri[len - 1] != '/' && !gz_checked) {
+    return;
+  }
+  if ((entry = (struct route_cache_entry *)
+       malloc(sizeof(*entry) + len)) == NULL) {
+    return;
+  }
+  entry->stored_time = mg_clock();
+  entry->len = len;
+  memcpy(entry->uri, uri, len);
+  bucket = route_cache_bucket(uri, len);
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (generation != ctx->route_cache_generation) {
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    free(entry);
+    return;
+  }
+  if (ctx->num_route_cache_entries >= atoi(ctx->config[ROUTE_CACHE_SIZE])) {
+    free_route_entries(ctx);
+  }
+  entry->next = ctx->route_cache[bucket];
+  ctx->route_cache[bucket] = entry;
+  ctx->num_route_cache_entries++;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+#if defined(_WIN32)
+// Clears the route cache when files or directories are created, renamed
+// or removed anywhere in document_root.
+static void *route_cache_watcher(void *param) {
+  struct mg_context *ctx = (struct mg_context *) param;
+  wchar_t wbuf[PATH_MAX];
+  HANDLE change;
+
+  to_unicode(ctx->config[DOCUMENT_ROOT], wbuf, ARRAY_SIZE(wbuf));
+  change = FindFirstChangeNotificationW(wbuf, TRUE,
+      FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME);
+  if (change == INVALID_HANDLE_VALUE) {
+    cry(fc(ctx), "Cannot watch %s, route cache entries will expire",
+        ctx->config[DOCUMENT_ROOT]);
+  } else {
+    clear_route_cache(ctx);
+    ctx->route_cache_watched = 1;
+    while (ctx->stop_flag == 0) {
+      if (WaitForSingleObject(change, 200) == WAIT_OBJECT_0) {
+        clear_route_cache(ctx);
+        if (!FindNextChangeNotification(change)) {
+          ctx->route_cache_watched = 0;
+          break;
+        }
+      }
+    }
+    FindCloseChangeNotification(change);
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  ctx->num_threads--;
+  (void) pthread_cond_signal(&ctx->cond);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  return NULL;
+}
+#endif // _WIN32
+
 static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
                                      size_t buf_len, struct file *filep) {
   struct vec a, b;
   const char *rewrite, *uri = conn->request_info.uri,
         *root = conn->ctx->config[DOCUMENT_ROOT],
         *_404_handler = conn->ctx->config[_404_HANDLER];
-  int match_len;
+  int match_len, rewritten = 0, routed, gz_checked = 0;
+  unsigned generation = 0;
   char gz_path[PATH_MAX];
   char const* accept_encoding;
 
@@ -1877,10 +2302,15 @@ static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
     if ((match_len = match_prefix(a.ptr, a.len, uri)) > 0) {
       mg_snprintf(conn, buf, buf_len - 1, "%.*s%s", (int) b.len, b.ptr,
                   uri + match_len);
+      rewritten = 1;
       break;
     }
   }
-  
+
+  // Known to have no file, skip straight to the 404_handler.
+  routed = !rewritten && is_routed_uri(conn->ctx, uri, &generation);
+  if (routed) goto handler_404;
+
   if (mg_stat(conn, buf, filep)) return;
 
   // if we can't find the actual file, look for the file
@@ -1891,6 +2321,7 @@ static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
   // we can only do this if the browser declares support
   if ((accept_encoding = mg_get_header(conn, "Accept-Encoding")) != NULL) {
     if (strstr(accept_encoding,"gzip") != NULL) {
+      gz_checked = 1;
       snprintf(gz_path, sizeof(gz_path), "%s.gz", buf);
       if (mg_stat(conn, gz_path, filep)) {
         filep->gzipped = 1;
@@ -1900,7 +2331,8 @@ static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
   }
 
   support_path_info_for_cgi_scripts(conn, buf, buf_len, filep);
-  
+
+handler_404:
   // --------------------------------------------------------------------------
   // PHP Desktop 404_handler.
   // Condition that checks if file exists (filep->membuf == NULL),
@@ -1916,6 +2348,9 @@ static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
         && (root != NULL)
         && (_404_handler != NULL && strlen(_404_handler) > 0)
       ) {
+    if (!routed && !rewritten) {
+      remember_routed_uri(conn, uri, gz_checked, generation);
+    }
     mg_snprintf(conn, buf, buf_len - 1, 
         "%s%s%s", 
         root, _404_handler, uri
@@ -1996,20 +2431,74 @@ static time_t parse_date_string(const char *datetime) {
   return result;
 }
 
-// Protect against directory disclosure attack by removing '..',
-// excessive '/' and '\' characters
-static void remove_double_dots_and_double_slashes(char *s) {
-  char *p = s;
+// Return the next percent-decoded character of a URI and advance *s
+// past it. Stays at the terminating nul.
+static char next_uri_char(const char **s) {
+  const unsigned char *p = (const unsigned char *) *s;
+  int a, b;
+
+  if (p[0] == '%' && isxdigit(p[1]) && isxdigit(p[2])) {
+    a = tolower(p[1]);
+    b = tolower(p[2]);
+    *s += 3;
+    return (char) ((HEXTOI(a) << 4) | HEXTOI(b));
+  } else if (p[0] != '\0') {
+    (*s)++;
+  }
+  return (char) p[0];
+}
+
+// Percent-decode a URI in place and, to protect against directory
+// disclosure attack, remove '..' and excessive '/' and '\' characters
+// after a slash. One pass, same result as mg_url_decode() followed by
+// the separate clean up. Returns the new length.
+static int normalize_uri(char *uri) {
+  const char *s, *t, *u, *end;
+  char *p, c;
+
+  // Most URIs need no change, or only after a prefix. strcspn() and
+  // strchr() are vectorized by the C runtime, so find where the first
+  // change may happen before copying byte by byte.
+  end = uri + strcspn(uri, "%\\");
+  for (t = strchr(uri, '/'); t != NULL && t < end; t = strchr(t + 1, '/')) {
+    if (t[1] == '/' || (t[1] == '.' && t[2] == '.')) {
+      end = t;
+      break;
+    }
+  }
+  if (*end == '\0') {
+    return (int) (end - uri);
+  }
+  // An escape may complete a double-dot or a run of slashes after a slash
+  if (end > uri && end[-1] == '/') {
+    end--;
+  } else if (end > uri + 1 && end[-1] == '.' && end[-2] == '/') {
+    end -= 2;
+  }
+  s = p = uri + (end - uri);
 
-  while (*s != '\0') {
-    *p++ = *s++;
-    if (s[-1] == '/' || s[-1] == '\\') {
+  for (;;) {
+    // Characters other than these are copied as they are
+    while (*s != '\0' && *s != '%' && *s != '/' && *s != '\\') {
+      *p++ = *s++;
+    }
+    if ((c = next_uri_char(&s)) == '\0') {
+      break;
+    }
+    *p++ = c;
+    if (c == '/' || c == '\\') {
       // Skip all following slashes, backslashes and double-dots
-      while (s[0] != '\0') {
-        if (s[0] == '/' || s[0] == '\\') {
-          s++;
-        } else if (s[0] == '.' && s[1] == '.') {
-          s += 2;
+      for (;;) {
+        t = s;
+        c = next_uri_char(&t);
+        if (c == '/' || c == '\\') {
+          s = t;
+        } else if (c == '.') {
+          u = t;
+          if (next_uri_char(&u) != '.') {
+            break;
+          }
+          s = u;
         } else {
           break;
         }
@@ -2017,6 +2506,7 @@ static void remove_double_dots_and_double_slashes(char *s) {
     }
   }
   *p = '\0';
+  return (int) (p - uri);
 }
 
 static const struct {
@@ -2692,65 +3182,67 @@ void mg_url_encode(const char *src, char *dst, size_t dst_len) {
   *dst = '\0';
 }
 
-static void print_dir_entry(struct de *de) {
-  char size[64], mod[64], href[PATH_MAX];
+// Output that is sent in MG_BUF_LEN blocks instead of one mg_printf()
+// per line, for listings with many entries.
+struct out_batch {
+  struct mg_connection *conn;
+  int len;
+  char buf[MG_BUF_LEN];
+};
+
+static void flush_out_batch(struct out_batch *out) {
+  if (out->len > 0) {
+    out->conn->num_bytes_sent += mg_write(out->conn, out->buf, out->len);
+    out->len = 0;
+  }
+}
+
+static void write_out_batch(struct out_batch *out, const char *data,
+                            int len) {
+  if (out->len + len > (int) sizeof(out->buf)) {
+    flush_out_batch(out);
+  }
+  if (len > (int) sizeof(out->buf)) {
+    out->conn->num_bytes_sent += mg_write(out->conn, data, len);
+  } else {
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+  }
+}
+
+static void print_dir_entry(struct out_batch *out, const char *file_name,
+                            const struct file *filep) {
+  struct mg_connection *conn = out->conn;
+  char size[64], mod[64], href[PATH_MAX], row[MG_BUF_LEN];
+  int len;
 
-  if (de->file.is_directory) {
-    mg_snprintf(de->conn, size, sizeof(size), "%s", "[DIRECTORY]");
+  if (filep->is_directory) {
+    mg_snprintf(conn, size, sizeof(size), "%s", "[DIRECTORY]");
   } else {
      // We use (signed) cast below because MSVC 6 compiler cannot
      // convert unsigned __int64 to double. Sigh.
-    if (de->file.size < 1024) {
-      mg_snprintf(de->conn, size, sizeof(size), "%d", (int) de->file.size);
-    } else if (de->file.size < 0x100000) {
-      mg_snprintf(de->conn, size, sizeof(size),
-                  "%.1fk", (double) de->file.size / 1024.0);
-    } else if (de->file.size < 0x40000000) {
-      mg_snprintf(de->conn, size, sizeof(size),
-                  "%.1fM", (double) de->file.size / 1048576);
+    if (filep->size < 1024) {
+      mg_snprintf(conn, size, sizeof(size), "%d", (int) filep->size);
+    } else if (filep->size < 0x100000) {
+      mg_snprintf(conn, size, sizeof(size),
+                  "%.1fk", (double) filep->size / 1024.0);
+    } else if (filep->size < 0x40000000) {
+      mg_snprintf(conn, size, sizeof(size),
+                  "%.1fM", (double) filep->size / 1048576);
     } else {
-      mg_snprintf(de->conn, size, sizeof(size),
-                  "%.1fG", (double) de->file.size / 1073741824);
+      mg_snprintf(conn, size, sizeof(size),
+                  "%.1fG", (double) filep->size / 1073741824);
     }
   }
   strftime(mod, sizeof(mod), "%d-%b-%Y %H:%M",
-           localtime(&de->file.modification_time));
-  mg_url_encode(de->file_name, href, sizeof(href));
-  de->conn->num_bytes_sent += mg_printf(de->conn,
+           localtime(&filep->modification_time));
+  mg_url_encode(file_name, href, sizeof(href));
+  len = mg_snprintf(conn, row, sizeof(row),
       "<tr><td><a href=\"%s%s%s\">%s%s</a></td>"
       "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
-      de->conn->request_info.uri, href, de->file.is_directory ? "/" : "",
-      de->file_name, de->file.is_directory ? "/" : "", mod, size);
-}
-
-// This function is called from send_directory() and used for
-// sorting directory entries by size, or name, or modification time.
-// On windows, __cdecl specification is needed in case if project is built
-// with __stdcall convention. qsort always requires __cdels callback.
-static int WINCDECL compare_dir_entries(const void *p1, const void *p2) {
-  const struct de *a = (const struct de *) p1, *b = (const struct de *) p2;
-  const char *query_string = a->conn->request_info.query_string;
-  int cmp_result = 0;
-
-  if (query_string == NULL) {
-    query_string = "na";
-  }
-
-  if (a->file.is_directory && !b->file.is_directory) {
-    return -1;  // Always put directories on top
-  } else if (!a->file.is_directory && b->file.is_directory) {
-    return 1;   // Always put directories on top
-  } else if (*query_string == 'n') {
-    cmp_result = strcmp(a->file_name, b->file_name);
-  } else if (*query_string == 's') {
-    cmp_result = a->file.size == b->file.size ? 0 :
-      a->file.size > b->file.size ? 1 : -1;
-  } else if (*query_string == 'd') {
-    cmp_result = a->file.modification_time == b->file.modification_time ? 0 :
-      a->file.modification_time > b->file.modification_time ? 1 : -1;
-  }
-
-  return query_string[1] == 'd' ? -cmp_result : cmp_result;
+      conn->request_info.uri, href, filep->is_directory ? "/" : "",
+      file_name, filep->is_directory ? "/" : "", mod, size);
+  write_out_batch(out, row, len);
 }
 
 static int must_hide_file(struct mg_connection *conn, const char *path) {
@@ -2847,53 +3339,242 @@ static int remove_directory(struct mg_connection *conn, const char *dir) {
   return 1;
 }
 
-struct dir_scan_data {
-  struct de *entries;
-  int num_entries;
-  int arr_size;
+// Directory listings for the HTML index and PROPFIND. Entries are kept
+// in one array and their names in one buffer, two allocations however
+// many files a folder has. Listings are cached per directory while its
+// modification time is unchanged, for up to DIR_LISTING_TTL seconds so
+// that sizes of files changed in place are refreshed too.
+#define DIR_LISTING_TTL 10
+#define DIR_LISTING_CACHE_SIZE (16 * 1024 * 1024)
+#define DAV_MAX_LEVELS 32     // Below the directory for Depth: infinity
+
+struct dir_entry {
+  size_t name;                // Offset in dir_listing.names
+  int64_t size;
+  time_t modification_time;
+  int is_directory;
+};
+
+struct dir_listing {
+  struct dir_listing *next;   // In ctx->dir_listings, newest first
+  char *path;
+  time_t modification_time;   // Of the directory
+  double scan_time;           // mg_clock()
+  int num_refs;               // The cache and requests using it
+  struct dir_entry *entries;
+  int num_entries, max_entries;
+  char *names;
+  size_t names_len, names_size;
+  size_t size;                // Counted against DIR_LISTING_CACHE_SIZE
+  int failed;                 // Out of memory while scanning
 };
 
-// Behaves like realloc(), but frees original pointer on failure
-static void *realloc2(void *ptr, size_t size) {
-  void *new_ptr = realloc(ptr, size);
-  if (new_ptr == NULL) {
-    free(ptr);
+static void dir_listing_callback(struct de *de, void *data) {
+  struct dir_listing *listing = (struct dir_listing *) data;
+  size_t len = strlen(de->file_name) + 1;
+  struct dir_entry *entry;
+  void *p;
+
+  if (listing->failed) {
+    return;
+  }
+  if (listing->num_entries >= listing->max_entries) {
+    if ((p = realloc(listing->entries, 2 * listing->max_entries *
+                     sizeof(listing->entries[0]))) == NULL) {
+      listing->failed = 1;
+      return;
+    }
+    listing->entries = (struct dir_entry *) p;
+    listing->max_entries *= 2;
+  }
+  if (listing->names_len + len > listing->names_size) {
+    if ((p = realloc(listing->names, 2 * listing->names_size + len)) == NULL) {
+      listing->failed = 1;
+      return;
+    }
+    listing->names = (char *) p;
+    listing->names_size = 2 * listing->names_size + len;
   }
-  return new_ptr;
+  entry = &listing->entries[listing->num_entries++];
+  entry->name = listing->names_len;
+  entry->size = de->file.size;
+  entry->modification_time = de->file.modification_time;
+  entry->is_directory = de->file.is_directory;
+  memcpy(listing->names + listing->names_len, de->file_name, len);
+  listing->names_len += len;
 }
 
-static void dir_scan_callback(struct de *de, void *data) {
-  struct dir_scan_data *dsd = (struct dir_scan_data *) data;
+static void free_dir_listing(struct dir_listing *listing) {
+  free(listing->path);
+  free(listing->entries);
+  free(listing->names);
+  free(listing);
+}
 
-  if (dsd->entries == NULL || dsd->num_entries >= dsd->arr_size) {
-    dsd->arr_size *= 2;
-    dsd->entries = (struct de *) realloc2(dsd->entries, dsd->arr_size *
-                                          sizeof(dsd->entries[0]));
+static void release_dir_listing(struct mg_context *ctx,
+                                struct dir_listing *listing) {
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (--listing->num_refs == 0) {
+    free_dir_listing(listing);
   }
-  if (dsd->entries == NULL) {
-    // TODO(lsm): propagate an error to the caller
-    dsd->num_entries = 0;
-  } else {
-    dsd->entries[dsd->num_entries].file_name = mg_strdup(de->file_name);
-    dsd->entries[dsd->num_entries].file = de->file;
-    dsd->entries[dsd->num_entries].conn = de->conn;
-    dsd->num_entries++;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Must be called with ctx->mutex held.
+static void uncache_dir_listing(struct mg_context *ctx,
+                                struct dir_listing **p) {
+  struct dir_listing *listing = *p;
+
+  *p = listing->next;
+  ctx->dir_listings_size -= listing->size;
+  if (--listing->num_refs == 0) {
+    free_dir_listing(listing);
+  }
+}
+
+// Returns the listing of a directory with the given modification time,
+// from the cache or by scanning it. Release it with release_dir_listing().
+// Returns NULL if the directory cannot be read.
+static struct dir_listing *get_dir_listing(struct mg_connection *conn,
+                                           const char *dir,
+                                           time_t modification_time) {
+  struct mg_context *ctx = conn->ctx;
+  struct dir_listing *listing, **p, **last;
+  double now = mg_clock();
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (p = &ctx->dir_listings; (listing = *p) != NULL; p = &listing->next) {
+    if (!strcmp(listing->path, dir)) {
+      if (listing->modification_time == modification_time &&
+          now - listing->scan_time < DIR_LISTING_TTL) {
+        listing->num_refs++;
+        (void) pthread_mutex_unlock(&ctx->mutex);
+        return listing;
+      }
+      uncache_dir_listing(ctx, p);
+      break;
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  if ((listing = (struct dir_listing *) calloc(1, sizeof(*listing))) == NULL) {
+    return NULL;
+  }
+  listing->path = mg_strdup(dir);
+  listing->modification_time = modification_time;
+  listing->scan_time = now;
+  listing->num_refs = 1;
+  listing->max_entries = 64;
+  listing->entries = (struct dir_entry *)
+    malloc(listing->max_entries * sizeof(listing->entries[0]));
+  if (listing->path == NULL || listing->entries == NULL ||
+      !scan_directory(conn, dir, listing, dir_listing_callback) ||
+      listing->failed) {
+    free_dir_listing(listing);
+    return NULL;
+  }
+  listing->size = sizeof(*listing) + strlen(dir) + listing->names_size +
+    listing->max_entries * sizeof(listing->entries[0]);
+
+  if (listing->size <= DIR_LISTING_CACHE_SIZE) {
+    (void) pthread_mutex_lock(&ctx->mutex);
+    // Another request may have scanned it meanwhile.
+    for (p = &ctx->dir_listings; *p != NULL; p = &(*p)->next) {
+      if (!strcmp((*p)->path, dir)) {
+        uncache_dir_listing(ctx, p);
+        break;
+      }
+    }
+    while (ctx->dir_listings_size + listing->size > DIR_LISTING_CACHE_SIZE) {
+      for (last = &ctx->dir_listings; (*last)->next != NULL;
+           last = &(*last)->next) {
+      }
+      uncache_dir_listing(ctx, last);
+    }
+    listing->next = ctx->dir_listings;
+    ctx->dir_listings = listing;
+    ctx->dir_listings_size += listing->size;
+    listing->num_refs++;
+    (void) pthread_mutex_unlock(&ctx->mutex);
+  }
+  return listing;
+}
+
+static void dir_entry_file(const struct dir_entry *entry, struct file *filep) {
+  memset(filep, 0, sizeof(*filep));
+  filep->is_directory = entry->is_directory;
+  filep->modification_time = entry->modification_time;
+  filep->size = entry->size;
+}
+
+// Listing entry and the sort order of the request, for qsort().
+struct dir_sort_item {
+  const struct dir_entry *entry;
+  const char *name;
+  char order[2];              // From the query string, e.g. "na" or "sd"
+};
+
+// This function is called from handle_directory_request() and used for
+// sorting directory entries by size, or name, or modification time.
+// On windows, __cdecl specification is needed in case if project is built
+// with __stdcall convention. qsort always requires __cdels callback.
+static int WINCDECL compare_dir_entries(const void *p1, const void *p2) {
+  const struct dir_sort_item *x = (const struct dir_sort_item *) p1,
+        *y = (const struct dir_sort_item *) p2;
+  const struct dir_entry *a = x->entry, *b = y->entry;
+  int cmp_result = 0;
+
+  if (a->is_directory && !b->is_directory) {
+    return -1;  // Always put directories on top
+  } else if (!a->is_directory && b->is_directory) {
+    return 1;   // Always put directories on top
+  } else if (x->order[0] == 'n') {
+    cmp_result = strcmp(x->name, y->name);
+  } else if (x->order[0] == 's') {
+    cmp_result = a->size == b->size ? 0 : a->size > b->size ? 1 : -1;
+  } else if (x->order[0] == 'd') {
+    cmp_result = a->modification_time == b->modification_time ? 0 :
+      a->modification_time > b->modification_time ? 1 : -1;
   }
+
+  return x->order[1] == 'd' ? -cmp_result : cmp_result;
 }
 
 static void handle_directory_request(struct mg_connection *conn,
-                                     const char *dir) {
+                                     const char *dir, struct file *filep) {
+  const char *query_string = conn->request_info.query_string;
+  const struct dir_entry *entry;
+  struct dir_listing *listing;
+  struct dir_sort_item *items = NULL;
+  struct out_batch out;
+  struct file file;
   int i, sort_direction;
-  struct dir_scan_data data = { NULL, 0, 128 };
 
-  if (!scan_directory(conn, dir, &data, dir_scan_callback)) {
+  if ((listing = get_dir_listing(conn, dir,
+                                 filep->modification_time)) == NULL) {
     send_http_error(conn, 500, "Cannot open directory",
                     "Error: opendir(%s): %s", dir, strerror(ERRNO));
     return;
   }
 
-  sort_direction = conn->request_info.query_string != NULL &&
-    conn->request_info.query_string[1] == 'd' ? 'a' : 'd';
+  // "?u" lists in directory order, for folders too big to sort quickly.
+  if (query_string == NULL || query_string[0] == '\0') {
+    query_string = "na";
+  }
+  if (query_string[0] != 'u' &&
+      (items = (struct dir_sort_item *)
+       malloc((listing->num_entries + 1) * sizeof(items[0]))) != NULL) {
+    for (i = 0; i < listing->num_entries; i++) {
+      items[i].entry = &listing->entries[i];
+      items[i].name = listing->names + listing->entries[i].name;
+      items[i].order[0] = query_string[0];
+      items[i].order[1] = query_string[1];
+    }
+    qsort(items, (size_t) listing->num_entries, sizeof(items[0]),
+          compare_dir_entries);
+  }
+
+  sort_direction = query_string[1] == 'd' ? 'a' : 'd';
 
   conn->must_close = 1;
   mg_printf(conn, "%s",
@@ -2918,14 +3599,17 @@ static void handle_directory_request(struct mg_connection *conn,
       "<td>&nbsp;%s</td><td>&nbsp;&nbsp;%s</td></tr>\n",
       conn->request_info.uri, "..", "Parent directory", "-", "-");
 
-  // Sort and print directory entries
-  qsort(data.entries, (size_t) data.num_entries, sizeof(data.entries[0]),
-        compare_dir_entries);
-  for (i = 0; i < data.num_entries; i++) {
-    print_dir_entry(&data.entries[i]);
-    free(data.entries[i].file_name);
+  // Print directory entries, sorted unless that was not asked or possible
+  out.conn = conn;
+  out.len = 0;
+  for (i = 0; i < listing->num_entries; i++) {
+    entry = items != NULL ? items[i].entry : &listing->entries[i];
+    dir_entry_file(entry, &file);
+    print_dir_entry(&out, listing->names + entry->name, &file);
   }
-  free(data.entries);
+  flush_out_batch(&out);
+  free(items);
+  release_dir_listing(conn->ctx, listing);
 
   conn->num_bytes_sent += mg_printf(conn, "%s", "</table></body></html>");
   conn->status_code = 200;
@@ -2979,11 +3663,313 @@ static void gmt_time_string(char *buf, size_t buf_len, time_t *t) {
   strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", gmtime(t));
 }
 
-static void construct_etag(char *buf, size_t buf_len,
-                           const struct file *filep) {
-  snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"",
-           (unsigned long) filep->modification_time, filep->size);
-}
+// Content hashes of static files, for Etag headers that do not change
+// when a file is touched without changing, e.g. by an installer. An
+// entry is valid while the size and modification time of the file match.
+// New hashes are appended to the content_hash_manifest file, which is
+// loaded by mg_start(), so files are hashed once and not on every start.
+// Other caches may use get_content_hash() to tell whether content changed.
+#define CONTENT_HASH_MAX_SIZE (16 * 1024 * 1024)
+#define CONTENT_HASH_MIN_BUCKETS 256
+#define FNV1A_64_OFFSET 14695981039346656037ULL
+
+struct content_hash {
+  struct content_hash *next;
+  uint64_t hash;
+  int64_t size;
+  time_t modification_time;
+  char path[1];   // Full path, allocated with the struct
+};
+
+static uint64_t fnv1a_64(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *) data;
+  while (len-- > 0) {
+    hash ^= *p++;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Must be called with ctx->mutex held.
+static struct content_hash *find_content_hash(struct mg_context *ctx,
+                                              const char *path) {
+  struct content_hash *entry = NULL;
+  uint64_t bucket;
+
+  if (ctx->num_content_hash_buckets > 0) {
+    bucket = fnv1a_64(FNV1A_64_OFFSET, path, strlen(path)) &
+      (ctx->num_content_hash_buckets - 1);
+    for (entry = ctx->content_hashes[bucket]; entry != NULL;
+         entry = entry->next) {
+      if (!strcmp(entry->path, path)) {
+        break;
+      }
+    }
+  }
+  return entry;
+}
+
+// Must be called with ctx->mutex held. Returns NULL if out of memory.
+static struct content_hash *set_content_hash(struct mg_context *ctx,
+                                             const char *path, uint64_t hash,
+                                             int64_t size,
+                                             time_t modification_time) {
+  struct content_hash *entry, *next, **buckets;
+  uint64_t bucket;
+  int i, num_buckets;
+
+  if ((entry = find_content_hash(ctx, path)) == NULL) {
+    if (ctx->num_content_hashes >= ctx->num_content_hash_buckets) {
+      num_buckets = ctx->num_content_hash_buckets > 0 ?
+        ctx->num_content_hash_buckets * 2 : CONTENT_HASH_MIN_BUCKETS;
+      if ((buckets = (struct content_hash **)
+           calloc(num_buckets, sizeof(*buckets))) != NULL) {
+        for (i = 0; i < ctx->num_content_hash_buckets; i++) {
+          for (entry = ctx->content_hashes[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            bucket = fnv1a_64(FNV1A_64_OFFSET, entry->path,
+                              strlen(entry->path)) & (num_buckets - 1);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+          }
+        }
+        free(ctx->content_hashes);
+        ctx->content_hashes = buckets;
+        ctx->num_content_hash_buckets = num_buckets;
+      } else if (ctx->num_content_hash_buckets == 0) {
+        return NULL;
+      }
+    }
+    if ((entry = (struct content_hash *)
+         malloc(sizeof(*entry) + strlen(path))) == NULL) {
+      return NULL;
+    }
+    strcpy(entry->path, path);
+    bucket = fnv1a_64(FNV1A_64_OFFSET, path, strlen(path)) &
+      (ctx->num_content_hash_buckets - 1);
+    entry->next = ctx->content_hashes[bucket];
+    ctx->content_hashes[bucket] = entry;
+    ctx->num_content_hashes++;
+  }
+  entry->hash = hash;
+  entry->size = size;
+  entry->modification_time = modification_time;
+  return entry;
+}
+
+// Manifest lines are "<hash> <size> <mtime> <path>", with the path
+// relative to document_root. Later lines override earlier ones.
+// Returns the line length, or 0 for files outside document_root, which
+// are not written.
+static int format_content_hash(const struct mg_context *ctx,
+                               const struct content_hash *entry,
+                               char *buf, size_t buf_len) {
+  size_t root_len = strlen(ctx->config[DOCUMENT_ROOT]);
+  int n;
+
+  if (strncmp(entry->path, ctx->config[DOCUMENT_ROOT], root_len)) {
+    return 0;
+  }
+  n = snprintf(buf, buf_len, "%08lx%08lx %" INT64_FMT " %" INT64_FMT " %s\n",
+               (unsigned long) (entry->hash >> 32),
+               (unsigned long) (entry->hash & 0xffffffff),
+               entry->size, (int64_t) entry->modification_time,
+               entry->path + root_len);
+  return n > 0 && (size_t) n < buf_len ? n : 0;
+}
+
+static void load_content_manifest(struct mg_context *ctx) {
+  const char *manifest = ctx->config[CONTENT_HASH_MANIFEST];
+  char line[PATH_MAX + 64], path[PATH_MAX];
+  unsigned long hi, lo;
+  int64_t size, modification_time;
+  struct content_hash *entry;
+  int n, num_lines = 0, i;
+  FILE *fp;
+
+  if (manifest == NULL || ctx->config[DOCUMENT_ROOT] == NULL ||
+      (fp = fopen(manifest, "r")) == NULL) {
+    return;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (sscanf(line, "%8lx%8lx %" INT64_FMT " %" INT64_FMT " %n",
+               &hi, &lo, &size, &modification_time, &n) == 4) {
+      mg_snprintf(fc(ctx), path, sizeof(path), "%s%s",
+                  ctx->config[DOCUMENT_ROOT], line + n);
+      set_content_hash(ctx, path, ((uint64_t) hi << 32) | lo, size,
+                       (time_t) modification_time);
+      num_lines++;
+    }
+  }
+  fclose(fp);
+
+  // Compact the manifest when most lines were overridden.
+  if (num_lines > 2 * ctx->num_content_hashes + 64 &&
+      (fp = fopen(manifest, "w")) != NULL) {
+    for (i = 0; i < ctx->num_content_hash_buckets; i++) {
+      for (entry = ctx->content_hashes[i]; entry != NULL;
+           entry = entry->next) {
+        if (format_content_hash(ctx, entry, line, sizeof(line)) > 0) {
+          fputs(line, fp);
+        }
+      }
+    }
+    fclose(fp);
+  }
+}
+
+// Sets hash to the content hash of a file, hashing it if the file is
+// new or changed. Returns 0 if content hashes are disabled, or for
+// directories and large files.
+static int get_content_hash(struct mg_connection *conn, const char *path,
+                            const struct file *filep, uint64_t *hash) {
+  struct mg_context *ctx = conn->ctx;
+  struct file file = STRUCT_FILE_INITIALIZER;
+  struct content_hash *entry;
+  char buf[MG_BUF_LEN], line[PATH_MAX + 64];
+  uint64_t h = FNV1A_64_OFFSET;
+  int64_t len = 0;
+  size_t n;
+  int found = 0, line_len = 0;
+  FILE *fp;
+
+  if (ctx->config[CONTENT_HASH_MANIFEST] == NULL || filep->is_directory ||
+      filep->size > CONTENT_HASH_MAX_SIZE) {
+    return 0;
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if ((entry = find_content_hash(ctx, path)) != NULL &&
+      entry->size == filep->size &&
+      entry->modification_time == filep->modification_time) {
+    *hash = entry->hash;
+    found = 1;
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  if (found) {
+    return 1;
+  }
+
+  if (!mg_fopen(conn, path, "rb", &file)) {
+    return 0;
+  }
+  if (file.membuf != NULL) {
+    h = fnv1a_64(h, file.membuf, file.size);
+    len = file.size;
+  } else {
+    while ((n = fread(buf, 1, sizeof(buf), file.fp)) > 0) {
+      h = fnv1a_64(h, buf, n);
+      len += n;
+    }
+  }
+  mg_fclose(&file);
+  if (len != filep->size) {
+    // Changed while hashing, try again next time.
+    return 0;
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if ((entry = set_content_hash(ctx, path, h, filep->size,
+                                filep->modification_time)) != NULL) {
+    line_len = format_content_hash(ctx, entry, line, sizeof(line));
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  // The file is appended outside ctx->mutex, which all workers take. If
+  // lines for a path get out of order, the stale one does not match the
+  // size and time of the file after a restart, and it is hashed again.
+  if (line_len > 0) {
+    (void) pthread_mutex_lock(&ctx->manifest_mutex);
+    if ((fp = fopen(ctx->config[CONTENT_HASH_MANIFEST], "a")) != NULL) {
+      fputs(line, fp);
+      fclose(fp);
+    }
+    (void) pthread_mutex_unlock(&ctx->manifest_mutex);
+  }
+  *hash = h;
+  return 1;
+}
+
+// Strong Etag from the content hash when available, otherwise from the
+// modification time and size. path is the file actually sent, i.e.
+// with the .gz suffix for pre-gzipped files.
+static void construct_etag(struct mg_connection *conn, const char *path,
+                           const struct file *filep,
+                           char *buf, size_t buf_len) {
+  uint64_t hash;
+
+  if (get_content_hash(conn, path, filep, &hash)) {
+    snprintf(buf, buf_len, "\"%08lx%08lx\"", (unsigned long) (hash >> 32),
+             (unsigned long) (hash & 0xffffffff));
+  } else {
+    snprintf(buf, buf_len, "\"%lx.%" INT64_FMT "\"",
+             (unsigned long) filep->modification_time, filep->size);
+  }
+}
+
+// Returns the first cache rule whose pattern matches the URI, or NULL.
+static const struct cache_rule *find_cache_rule(struct mg_context *ctx,
+                                                const char *uri) {
+  const struct cache_rule *rule = ctx->cache_rules;
+
+  for (; rule != NULL && rule->pattern.ptr != NULL; rule++) {
+    if (match_prefix(rule->pattern.ptr, rule->pattern.len, uri) > 0) {
+      return rule;
+    }
+  }
+  return NULL;
+}
+
+// Formats the Cache-Control header of a rule, and Expires for a
+// max-age, for HTTP/1.0 caches.
+static void cache_rule_headers(const struct cache_rule *rule,
+                               char *buf, size_t buf_len) {
+  char expires[64];
+  time_t t;
+  int len = rule->directive.len > 200 ? 200 : (int) rule->directive.len;
+
+  if (rule->max_age >= 0) {
+    t = time(NULL) + rule->max_age;
+    gmt_time_string(expires, sizeof(expires), &t);
+    snprintf(buf, buf_len, "Cache-Control: %.*s\r\nExpires: %s\r\n",
+             len, rule->directive.ptr, expires);
+  } else {
+    snprintf(buf, buf_len, "Cache-Control: %.*s\r\n",
+             len, rule->directive.ptr);
+  }
+}
+
+// Return 1 if the last URI segment carries a content hash, as produced
+// by bundlers, e.g. "app.3f2a9c1b.js" or "app-3f2a9c1b.css": eight or
+// more hex digits after a '.' or '-', with both digits and letters so
+// that dates do not match, followed by an extension. The start of the
+// name never counts, "facade12.js" is an ordinary file. Such a URL
+// changes whenever the content changes, so it may be cached forever.
+static int is_fingerprinted_uri(const char *uri) {
+  const char *name = strrchr(uri, '/'), *p, *token;
+  int digits, letters, other;
+
+  p = name == NULL ? uri : name + 1;
+  for (p += strcspn(p, ".-"); *p != '\0'; ) {
+    token = ++p;  // Past the '.' or '-'
+    digits = letters = other = 0;
+    for (; *p != '\0' && *p != '.' && *p != '-'; p++) {
+      if (isdigit(* (const unsigned char *) p)) {
+        digits++;
+      } else if (isxdigit(* (const unsigned char *) p)) {
+        letters++;
+      } else {
+        other++;
+      }
+    }
+    if (*p == '.' && p - token >= 8 && digits > 0 && letters > 0 &&
+        other == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
 
 static void fclose_on_exec(struct file *filep) {
   if (filep != NULL && filep->fp != NULL) {
@@ -3003,6 +3989,9 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
   int n;
   char gz_path[PATH_MAX];
   char const* encoding = "";
+  const char *cache_control = "";
+  char cache_headers[300];
+  const struct cache_rule *rule;
 
   get_mime_type(conn->ctx, path, &mime_vec);
   cl = filep->size;
@@ -3051,7 +4040,15 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
   // http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3
   gmt_time_string(date, sizeof(date), &curtime);
   gmt_time_string(lm, sizeof(lm), &filep->modification_time);
-  construct_etag(etag, sizeof(etag), filep);
+  construct_etag(conn, path, filep, etag, sizeof(etag));
+  if ((rule = find_cache_rule(conn->ctx, conn->request_info.uri)) != NULL) {
+    cache_rule_headers(rule, cache_headers, sizeof(cache_headers));
+    cache_control = cache_headers;
+  } else if (!mg_strcasecmp(conn->ctx->config[CACHE_FINGERPRINTED_URIS],
+                            "yes") &&
+             is_fingerprinted_uri(conn->request_info.uri)) {
+    cache_control = "Cache-Control: public, max-age=31536000, immutable\r\n";
+  }
 
   (void) mg_printf(conn,
       "HTTP/1.1 %d %s\r\n"
@@ -3062,9 +4059,10 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
       "Content-Length: %" INT64_FMT "\r\n"
       "Connection: %s\r\n"
       "Accept-Ranges: bytes\r\n"
-      "%s%s\r\n",
+      "%s%s%s\r\n",
       conn->status_code, msg, date, lm, etag, (int) mime_vec.len,
-      mime_vec.ptr, cl, suggest_connection_header(conn), range, encoding);
+      mime_vec.ptr, cl, suggest_connection_header(conn), range, encoding,
+      cache_control);
 
   if (strcmp(conn->request_info.request_method, "HEAD") != 0) {
     send_file_data(conn, filep, r1, cl);
@@ -3101,7 +4099,7 @@ static int is_valid_http_method(const char *method) {
     !strcmp(method, "HEAD") || !strcmp(method, "CONNECT") ||
     !strcmp(method, "PUT") || !strcmp(method, "DELETE") ||
     !strcmp(method, "OPTIONS") || !strcmp(method, "PROPFIND")
-    || !strcmp(method, "MKCOL")
+    || !strcmp(method, "MKCOL") || !strcmp(method, "PURGE")
           ;
 }
 
@@ -3209,15 +4207,24 @@ static int substitute_index_file(struct mg_connection *conn, char *path,
   return found;
 }
 
-// Return True if we should reply 304 Not Modified.
-static int is_not_modified(const struct mg_connection *conn,
+// Return True if we should reply 304 Not Modified. If-None-Match takes
+// precedence over If-Modified-Since, see RFC 7232 section 6: a touched
+// but unchanged file is not modified, and a changed file with an older
+// time is.
+static int is_not_modified(struct mg_connection *conn, const char *path,
                            const struct file *filep) {
-  char etag[64];
+  char etag[64], gz_path[PATH_MAX];
   const char *ims = mg_get_header(conn, "If-Modified-Since");
   const char *inm = mg_get_header(conn, "If-None-Match");
-  construct_etag(etag, sizeof(etag), filep);
-  return (inm != NULL && !mg_strcasecmp(etag, inm)) ||
-    (ims != NULL && filep->modification_time <= parse_date_string(ims));
+  if (inm != NULL) {
+    if (filep->gzipped) {
+      snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
+      path = gz_path;
+    }
+    construct_etag(conn, path, filep, etag, sizeof(etag));
+    return !mg_strcasecmp(etag, inm);
+  }
+  return ims != NULL && filep->modification_time <= parse_date_string(ims);
 }
 
 static int forward_body_data(struct mg_connection *conn, FILE *fp,
@@ -3536,173 +4543,1197 @@ static void prepare_cgi_environment(struct mg_connection *conn,
   assert(blk->len < (int) sizeof(blk->buf));
 }
 
-static void handle_cgi_request(struct mg_connection *conn, const char *prog) {
-  int headers_len, data_len, i, fdin[2], fdout[2];
-  const char *status, *status_text;
-  char buf[16384], *pbuf, dir[PATH_MAX], *p;
-  struct mg_request_info ri;
-  struct cgi_env_block blk;
-  FILE *in = NULL, *out = NULL;
-  struct file fout = STRUCT_FILE_INITIALIZER;
-  pid_t pid = (pid_t) -1;
+// Return 1 if the client has closed its side of the connection. Data that
+// the client may have pipelined is left in the socket buffer untouched.
+static int is_client_gone(const struct mg_connection *conn) {
+  char ch;
+  int n = recv(conn->client.sock, &ch, 1, MSG_PEEK);
+#if defined(_WIN32)
+  return n == 0 || (n < 0 && WSAGetLastError() != WSAEWOULDBLOCK &&
+                    WSAGetLastError() != WSAEMSGSIZE);
+#else
+  return n == 0 || (n < 0 && ERRNO != EAGAIN && ERRNO != EWOULDBLOCK &&
+                    ERRNO != EINTR);
+#endif
+}
 
-  prepare_cgi_environment(conn, prog, &blk);
+// Events multiplexed by the CGI relay loop
+#define CGI_OUT_READY     1  // CGI stdout is readable or at EOF
+#define CGI_IN_READY      2  // CGI stdin can take more data
+#define CGI_CLIENT_READY  4  // Client socket is readable or hung up
+#define CGI_IN_STALLED    8  // Last write to CGI stdin did not make progress
 
-  // CGI must be executed in its own directory. 'dir' must point to the
-  // directory containing executable program, 'p' must point to the
-  // executable program name relative to 'dir'.
-  (void) mg_snprintf(conn, dir, sizeof(dir), "%s", prog);
-  if ((p = strrchr(dir, '/')) != NULL) {
-    *p++ = '\0';
-  } else {
-    dir[0] = '.', dir[1] = '\0';
-    p = (char *) prog;
+// Wait until at least one of the events in 'want' happens on the CGI pipes
+// or on the client socket. Return a mask of ready events, or 0 if the
+// server is stopping.
+static int wait_for_cgi_io(struct mg_connection *conn, int fdout, int fdin,
+                           int want) {
+  int ready = 0;
+#if defined(_WIN32)
+  // Anonymous pipes cannot be select()-ed on Windows. Readability is
+  // checked with PeekNamedPipe(), a failing peek means the write end was
+  // closed, let the subsequent read see EOF. The stdin pipe is in
+  // PIPE_NOWAIT mode, so writes never block and are simply retried.
+  HANDLE out_handle = (HANDLE) _get_osfhandle(fdout);
+  struct timeval tv;
+  fd_set set;
+  DWORD avail;
+
+  (void) fdin;
+  while (ready == 0 && conn->ctx->stop_flag == 0) {
+    if (!PeekNamedPipe(out_handle, NULL, 0, NULL, &avail, NULL) ||
+        avail > 0) {
+      ready |= CGI_OUT_READY;
+    }
+    if ((want & CGI_IN_READY) && !(want & CGI_IN_STALLED)) {
+      ready |= CGI_IN_READY;
+    }
+    tv.tv_sec = 0;
+    tv.tv_usec = ready ? 0 : 10 * 1000;
+    if (want & CGI_CLIENT_READY) {
+      FD_ZERO(&set);
+      FD_SET(conn->client.sock, &set);
+      if (select(0, &set, NULL, NULL, &tv) > 0) {
+        ready |= CGI_CLIENT_READY;
+      }
+    } else if (!ready) {
+      (void) mg_sleep(10);
+    }
+    if (want & CGI_IN_READY) {
+      // Whether the pipe has room again can only be found out by trying
+      ready |= CGI_IN_READY;
+    }
+  }
+#else
+  struct pollfd pfd[3];
+  int n = 0, in_idx = -1, client_idx = -1;
+
+  pfd[n].fd = fdout;
+  pfd[n++].events = POLLIN;
+  if (want & CGI_IN_READY) {
+    in_idx = n;
+    pfd[n].fd = fdin;
+    pfd[n++].events = POLLOUT;
+  }
+  if (want & CGI_CLIENT_READY) {
+    client_idx = n;
+    pfd[n].fd = conn->client.sock;
+#ifdef POLLRDHUP
+    pfd[n++].events = POLLIN | POLLRDHUP;
+#else
+    pfd[n++].events = POLLIN;
+#endif
   }
 
-  if (pipe(fdin) != 0 || pipe(fdout) != 0) {
-    send_http_error(conn, 500, http_500_error,
-        "Cannot create CGI pipe: %s", strerror(ERRNO));
-    goto done;
+  while (ready == 0 && conn->ctx->stop_flag == 0) {
+    if (poll(pfd, n, 200) <= 0) {
+      continue;
+    }
+    if (pfd[0].revents != 0) {
+      ready |= CGI_OUT_READY;
+    }
+    if (in_idx != -1 && pfd[in_idx].revents != 0) {
+      ready |= CGI_IN_READY;
+    }
+    if (client_idx != -1 && pfd[client_idx].revents != 0) {
+      ready |= CGI_CLIENT_READY;
+    }
   }
+#endif // _WIN32
 
-  pid = spawn_process(conn, p, blk.buf, blk.vars, fdin[0], fdout[1], dir);
-  if (pid == (pid_t) -1) {
-    send_http_error(conn, 500, http_500_error,
-        "Cannot spawn CGI process [%s]: %s", prog, strerror(ERRNO));
-    goto done;
+  return conn->ctx->stop_flag ? 0 : ready;
+}
+
+// Write to the non-blocking CGI stdin pipe. Return number of bytes written,
+// 0 if the pipe is full, or -1 if CGI program has closed its stdin.
+static int write_cgi_input(int fd, const char *buf, int len) {
+#if defined(_WIN32)
+  DWORD n;
+  if (!WriteFile((HANDLE) _get_osfhandle(fd), buf, (DWORD) len, &n, NULL)) {
+    return -1;
+  }
+  return (int) n;
+#else
+  int n = write(fd, buf, (size_t) len);
+  if (n < 0 && (ERRNO == EAGAIN || ERRNO == EWOULDBLOCK || ERRNO == EINTR)) {
+    n = 0;
   }
+  return n;
+#endif // _WIN32
+}
 
-  // Make sure child closes all pipe descriptors. It must dup them to 0,1
-  set_close_on_exec(fdin[0]);
-  set_close_on_exec(fdin[1]);
-  set_close_on_exec(fdout[0]);
-  set_close_on_exec(fdout[1]);
+static void set_cgi_pipe_mode(int fdin, int fdout) {
+#if defined(_WIN32)
+  DWORD mode = PIPE_READMODE_BYTE | PIPE_NOWAIT;
+  (void) SetNamedPipeHandleState((HANDLE) _get_osfhandle(fdin), &mode,
+                                 NULL, NULL);
+  (void) fdout;
+#else
+  set_non_blocking_mode(fdin);
+#ifdef F_SETPIPE_SZ
+  (void) fcntl(fdin, F_SETPIPE_SZ, CGI_PIPE_SIZE);
+  (void) fcntl(fdout, F_SETPIPE_SZ, CGI_PIPE_SIZE);
+#else
+  (void) fdout;
+#endif
+#endif // _WIN32
+}
 
-  // Parent closes only one side of the pipes.
-  // If we don't mark them as closed, close() attempt before
-  // return from this function throws an exception on Windows.
-  // Windows does not like when closed descriptor is closed again.
-  (void) close(fdin[0]);
-  (void) close(fdout[1]);
-  fdin[0] = fdout[1] = -1;
+// CGI response cache, enabled with cgi_cache_size. Complete responses of
+// GET requests are cached for their Cache-Control s-maxage or max-age, or
+// the max-age of a matching cache rule. Responses with no-store, no-cache,
+// private or Set-Cookie are not cached. Entries are keyed by method and
+// URI, and by the request headers named in Vary. They are kept in a hash
+// table, and in a list by last use for evicting when over the size.
+// A successful POST, PUT or DELETE removes the cached responses of its
+// URI. Requests with no-cache bypass the cache, the response is stored.
+#define CGI_CACHE_BUCKETS 1024
+#define CGI_CACHE_MAX_VARY 1024   // Max size of the Vary request values
+
+struct cgi_cache_entry {
+  struct cgi_cache_entry *hash_next;
+  struct cgi_cache_entry *lru_prev, *lru_next;
+  char *key;            // "METHOD uri?query"
+  char *vary;           // "name\0value\0" for each Vary header
+  size_t vary_len;
+  char *data;           // Status line and headers, then body
+  size_t headers_len;
+  size_t data_len;
+  double stored_time;   // mg_clock()
+  double expire_time;
+  size_t size;          // Counted against cgi_cache_size
+};
 
+// A CGI response being copied while it is sent, see send_cgi_headers().
+struct cgi_capture {
+  char *data;
+  size_t data_len, data_size, headers_len;
+  size_t max_size;
+  int status_code;
+  double max_age;       // 0 if the response may not be cached
+  char *vary;           // Vary header of the response, or NULL
+  int coalesce;         // Keep uncacheable responses for coalescing
+  int failed;           // Not usable, or too big
+};
 
-  if ((in = fdopen(fdin[1], "wb")) == NULL ||
-      (out = fdopen(fdout[0], "rb")) == NULL) {
-    send_http_error(conn, 500, http_500_error,
-        "fopen: %s", strerror(ERRNO));
-    goto done;
-  }
+// Concurrent GET requests for a URI matching coalesce_pattern, with the
+// same query and cookies, run the CGI script once. The first request runs
+// it and captures the response, the others wait up to coalesce_timeout_ms
+// and are sent a copy. If the response is bigger than coalesce_max_size,
+// sets a cookie or the script fails, the waiters run the script
+// themselves. Flights are freed when the last request leaves them.
+struct cgi_flight {
+  struct cgi_flight *next;
+  char *key;            // "METHOD uri?query\ncookies"
+  int num_refs;         // Leader and waiters
+  int done;
+  char *data;           // Captured response, or NULL if not usable
+  size_t headers_len, data_len;
+  int status_code;
+};
 
-  setbuf(in, NULL);
-  setbuf(out, NULL);
-  fout.fp = out;
+static unsigned cgi_cache_bucket(const char *key) {
+  return (unsigned) (fnv1a_64(FNV1A_64_OFFSET, key, strlen(key)) %
+                     CGI_CACHE_BUCKETS);
+}
 
-  // Send POST data to the CGI process if needed
-  if (!strcmp(conn->request_info.request_method, "POST") &&
-      !forward_body_data(conn, in, INVALID_SOCKET, NULL)) {
-    goto done;
+// Returns the time to cache a response for, from a Cache-Control value.
+static double cgi_cache_max_age(const char *cc, size_t len) {
+  const char *end = cc + len, *token;
+  double max_age = 0, s_maxage = -1;
+  size_t n;
+
+  while (cc < end) {
+    while (cc < end && (*cc == ' ' || *cc == ',')) {
+      cc++;
+    }
+    token = cc;
+    while (cc < end && *cc != ',') {
+      cc++;
+    }
+    n = cc - token;
+    if ((n == 8 && !mg_strncasecmp(token, "no-store", 8)) ||
+        (n >= 8 && !mg_strncasecmp(token, "no-cache", 8)) ||
+        (n >= 7 && !mg_strncasecmp(token, "private", 7))) {
+      return 0;
+    } else if (n > 9 && !mg_strncasecmp(token, "s-maxage=", 9)) {
+      s_maxage = atof(token + 9);
+    } else if (n > 8 && !mg_strncasecmp(token, "max-age=", 8)) {
+      max_age = atof(token + 8);
+    }
   }
+  return s_maxage >= 0 ? s_maxage : max_age;
+}
 
-  // Close so child gets an EOF.
-  fclose(in);
-  in = NULL;
-  fdin[1] = -1;
+static void capture_cgi_data(struct cgi_capture *capture, const void *data,
+                             size_t len) {
+  char *p;
+  size_t size;
 
-  // Now read CGI reply into a buffer. We need to set correct
-  // status code, thus we need to see all HTTP headers first.
-  // Do not send anything back to client, until we buffer in all
-  // HTTP headers.
-  data_len = 0;
-  headers_len = read_request(out, conn, buf, sizeof(buf), &data_len);
-  if (headers_len <= 0) {
-    send_http_error(conn, 500, http_500_error,
-                    "CGI program sent malformed or too big (>%u bytes) "
-                    "HTTP headers: [%.*s]",
-                    (unsigned) sizeof(buf), data_len, buf);
-    goto done;
+  if (capture->failed) {
+    return;
+  } else if (capture->data_len + len > capture->max_size) {
+    capture->failed = 1;
+    return;
   }
-  pbuf = buf;
-  buf[headers_len - 1] = '\0';
-  parse_http_headers(&pbuf, &ri);
-
-  // Make up and send the status line
-  status_text = "OK";
-  if ((status = get_header(&ri, "Status")) != NULL) {
-    conn->status_code = atoi(status);
-    status_text = status;
-    while (isdigit(* (unsigned char *) status_text) || *status_text == ' ') {
-      status_text++;
+  if (capture->data_len + len > capture->data_size) {
+    size = capture->data_size > 0 ? capture->data_size * 2 : 4096;
+    while (size < capture->data_len + len) {
+      size *= 2;
     }
-  } else if (get_header(&ri, "Location") != NULL) {
-    conn->status_code = 302;
-  } else {
-    conn->status_code = 200;
-  }
-  if (get_header(&ri, "Connection") != NULL &&
-      !mg_strcasecmp(get_header(&ri, "Connection"), "keep-alive")) {
-    conn->must_close = 1;
+    if ((p = (char *) realloc(capture->data, size)) == NULL) {
+      capture->failed = 1;
+      return;
+    }
+    capture->data = p;
+    capture->data_size = size;
   }
-  (void) mg_printf(conn, "HTTP/1.1 %d %s\r\n", conn->status_code,
-                   status_text);
+  memcpy(capture->data + capture->data_len, data, len);
+  capture->data_len += len;
+}
 
-  // Send headers
-  for (i = 0; i < ri.num_headers; i++) {
-    mg_printf(conn, "%s: %s\r\n",
-              ri.http_headers[i].name, ri.http_headers[i].value);
+static void capture_cgi_header(struct cgi_capture *capture, const char *name,
+                               const char *value) {
+  if (!mg_strcasecmp(name, "Content-Length") ||
+      !mg_strcasecmp(name, "Connection") ||
+      !mg_strcasecmp(name, "Transfer-Encoding")) {
+    return;
   }
-  mg_write(conn, "\r\n", 2);
-
-  // Send chunk of data that may have been read after the headers
-  conn->num_bytes_sent += mg_write(conn, buf + headers_len,
-                                   (size_t)(data_len - headers_len));
+  capture_cgi_data(capture, name, strlen(name));
+  capture_cgi_data(capture, ": ", 2);
+  capture_cgi_data(capture, value, strlen(value));
+  capture_cgi_data(capture, "\r\n", 2);
+}
 
-  // Read the rest of CGI output and send to the client
-  send_file_data(conn, &fout, 0, INT64_MAX);
+// Must be called with ctx->mutex held.
+static void remove_cgi_cache_entry(struct mg_context *ctx,
+                                   struct cgi_cache_entry *entry) {
+  struct cgi_cache_entry **p = &ctx->cgi_cache[cgi_cache_bucket(entry->key)];
 
-done:
-  if (pid != (pid_t) -1) {
-    kill(pid, SIGKILL);
+  while (*p != entry) {
+    p = &(*p)->hash_next;
   }
-  if (fdin[0] != -1) {
-    close(fdin[0]);
+  *p = entry->hash_next;
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    ctx->cgi_cache_head = entry->lru_next;
   }
-  if (fdout[1] != -1) {
-    close(fdout[1]);
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    ctx->cgi_cache_tail = entry->lru_prev;
   }
+  ctx->cgi_cache_stats.num_entries--;
+  ctx->cgi_cache_stats.num_bytes -= (long) entry->size;
+  free(entry);
+}
 
-  if (in != NULL) {
-    fclose(in);
-  } else if (fdin[1] != -1) {
-    close(fdin[1]);
+// Must be called with ctx->mutex held.
+static void touch_cgi_cache_entry(struct mg_context *ctx,
+                                  struct cgi_cache_entry *entry) {
+  if (ctx->cgi_cache_head == entry) {
+    return;
   }
-
-  if (out != NULL) {
-    fclose(out);
-  } else if (fdout[0] != -1) {
-    close(fdout[0]);
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  }
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else if (ctx->cgi_cache_tail == entry) {
+    ctx->cgi_cache_tail = entry->lru_prev;
+  }
+  entry->lru_prev = NULL;
+  entry->lru_next = ctx->cgi_cache_head;
+  if (ctx->cgi_cache_head != NULL) {
+    ctx->cgi_cache_head->lru_prev = entry;
+  }
+  ctx->cgi_cache_head = entry;
+  if (ctx->cgi_cache_tail == NULL) {
+    ctx->cgi_cache_tail = entry;
   }
 }
-#endif // !NO_CGI
 
-// For a given PUT path, create all intermediate subdirectories
-// for given path. Return 0 if the path itself is a directory,
-// or -1 on error, 1 if OK.
-static int put_dir(struct mg_connection *conn, const char *path) {
-  char buf[PATH_MAX];
-  const char *s, *p;
-  struct file file = STRUCT_FILE_INITIALIZER;
-  int len, res = 1;
+// Returns the request header values named in a Vary header, as
+// "name\0value\0" pairs. Returns -1 if the response may not be cached.
+static int get_cgi_cache_vary(const struct mg_connection *conn,
+                              const char *vary, char *buf, size_t buf_len) {
+  const char *name, *value;
+  size_t name_len, value_len, len = 0;
 
-  for (s = p = path + 2; (p = strchr(s, '/')) != NULL; s = ++p) {
-    len = p - path;
-    if (len >= (int) sizeof(buf)) {
-      res = -1;
+  while (vary != NULL && *vary != '\0') {
+    vary += strspn(vary, " ,");
+    name = vary;
+    name_len = strcspn(vary, " ,");
+    vary += name_len;
+    if (name_len == 0) {
       break;
+    } else if (name_len == 1 && *name == '*') {
+      return -1;
     }
-    memcpy(buf, path, len);
-    buf[len] = '\0';
-
+    value = NULL;
+    for (value_len = 0; value_len < (size_t) conn->request_info.num_headers;
+         value_len++) {
+      const struct mg_header *h = &conn->request_info.http_headers[value_len];
+      if (!mg_strncasecmp(h->name, name, name_len) &&
+          h->name[name_len] == '\0') {
+        value = h->value;
+        break;
+      }
+    }
+    value_len = value == NULL ? 0 : strlen(value);
+    if (len + name_len + value_len + 2 > buf_len) {
+      return -1;
+    }
+    memcpy(buf + len, name, name_len);
+    buf[len + name_len] = '\0';
+    len += name_len + 1;
+    memcpy(buf + len, value == NULL ? "" : value, value_len);
+    buf[len + value_len] = '\0';
+    len += value_len + 1;
+  }
+  return (int) len;
+}
+
+// Returns 1 if the request has the header values a cached entry varies on.
+static int cgi_cache_vary_matches(const struct mg_connection *conn,
+                                  const struct cgi_cache_entry *entry) {
+  const char *p = entry->vary, *end = entry->vary + entry->vary_len, *value;
+
+  while (p < end) {
+    value = mg_get_header(conn, p);
+    p += strlen(p) + 1;
+    if (strcmp(value == NULL ? "" : value, p)) {
+      return 0;
+    }
+    p += strlen(p) + 1;
+  }
+  return 1;
+}
+
+// Sends a response captured by send_cgi_headers(). Age is omitted if -1.
+static void send_captured_cgi_response(struct mg_connection *conn,
+                                       int status_code, const char *data,
+                                       size_t headers_len, size_t data_len,
+                                       long age) {
+  conn->status_code = status_code;
+  mg_write(conn, data, headers_len);
+  if (age >= 0) {
+    mg_printf(conn, "Age: %ld\r\n", age);
+  }
+  mg_printf(conn, "Content-Length: %lu\r\nConnection: %s\r\n\r\n",
+            (unsigned long) (data_len - headers_len),
+            suggest_connection_header(conn));
+  mg_write(conn, data + headers_len, data_len - headers_len);
+  conn->num_bytes_sent += data_len - headers_len;
+}
+
+// Sends a cached response. Returns 0 if there is none.
+static int send_cached_cgi_response(struct mg_connection *conn,
+                                    const char *key) {
+  struct mg_context *ctx = conn->ctx;
+  struct cgi_cache_entry *entry, *next;
+  char *copy = NULL;
+  size_t headers_len = 0, data_len = 0;
+  double now = mg_clock(), age = 0;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (entry = ctx->cgi_cache[cgi_cache_bucket(key)]; entry != NULL;
+       entry = next) {
+    next = entry->hash_next;
+    if (strcmp(entry->key, key)) {
+      continue;
+    } else if (entry->expire_time <= now) {
+      remove_cgi_cache_entry(ctx, entry);
+    } else if (cgi_cache_vary_matches(conn, entry)) {
+      if ((copy = (char *) malloc(entry->data_len)) != NULL) {
+        memcpy(copy, entry->data, entry->data_len);
+        headers_len = entry->headers_len;
+        data_len = entry->data_len;
+        age = now - entry->stored_time;
+        touch_cgi_cache_entry(ctx, entry);
+      }
+      break;
+    }
+  }
+  if (copy != NULL) {
+    ctx->cgi_cache_stats.hits++;
+  } else {
+    ctx->cgi_cache_stats.misses++;
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  if (copy == NULL) {
+    return 0;
+  }
+
+  conn->stats.cgi_cache_hit = 1;
+  send_captured_cgi_response(conn, 200, copy, headers_len, data_len,
+                             (long) age);
+  free(copy);
+  return 1;
+}
+
+static void store_cgi_response(struct mg_connection *conn, const char *key,
+                               const struct cgi_capture *capture,
+                               size_t max_bytes) {
+  struct mg_context *ctx = conn->ctx;
+  struct cgi_cache_entry *entry, *next;
+  char vary[CGI_CACHE_MAX_VARY];
+  size_t key_len = strlen(key) + 1, size;
+  unsigned bucket = cgi_cache_bucket(key);
+  int vary_len;
+
+  if ((vary_len = get_cgi_cache_vary(conn, capture->vary, vary,
+                                     sizeof(vary))) < 0) {
+    return;
+  }
+  size = sizeof(*entry) + key_len + vary_len + capture->data_len;
+  if (size > max_bytes / 8 || (entry = (struct cgi_cache_entry *)
+                           malloc(size)) == NULL) {
+    return;
+  }
+  entry->key = (char *) (entry + 1);
+  memcpy(entry->key, key, key_len);
+  entry->vary = entry->key + key_len;
+  memcpy(entry->vary, vary, vary_len);
+  entry->vary_len = vary_len;
+  entry->data = entry->vary + vary_len;
+  memcpy(entry->data, capture->data, capture->data_len);
+  entry->headers_len = capture->headers_len;
+  entry->data_len = capture->data_len;
+  entry->stored_time = mg_clock();
+  entry->expire_time = entry->stored_time + capture->max_age;
+  entry->size = size;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  // Replace the same variant, and make room.
+  for (next = ctx->cgi_cache[bucket]; next != NULL; ) {
+    struct cgi_cache_entry *e = next;
+    next = e->hash_next;
+    if (!strcmp(e->key, key) && e->vary_len == entry->vary_len &&
+        !memcmp(e->vary, entry->vary, e->vary_len)) {
+      remove_cgi_cache_entry(ctx, e);
+    }
+  }
+  while (ctx->cgi_cache_tail != NULL &&
+         (size_t) ctx->cgi_cache_stats.num_bytes + size > max_bytes) {
+    remove_cgi_cache_entry(ctx, ctx->cgi_cache_tail);
+    ctx->cgi_cache_stats.evictions++;
+  }
+  entry->hash_next = ctx->cgi_cache[bucket];
+  ctx->cgi_cache[bucket] = entry;
+  entry->lru_prev = NULL;
+  entry->lru_next = ctx->cgi_cache_head;
+  if (ctx->cgi_cache_head != NULL) {
+    ctx->cgi_cache_head->lru_prev = entry;
+  }
+  ctx->cgi_cache_head = entry;
+  if (ctx->cgi_cache_tail == NULL) {
+    ctx->cgi_cache_tail = entry;
+  }
+  ctx->cgi_cache_stats.num_entries++;
+  ctx->cgi_cache_stats.num_bytes += (long) size;
+  ctx->cgi_cache_stats.stores++;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Removes the entries whose URI starts with uri_prefix, or if exact is
+// set, those for uri_prefix with any query string.
+static int purge_cgi_cache(struct mg_context *ctx, const char *uri_prefix,
+                           int exact) {
+  struct cgi_cache_entry *entry, *next;
+  const char *uri;
+  size_t len = uri_prefix == NULL ? 0 : strlen(uri_prefix);
+  int n = 0;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (entry = ctx->cgi_cache_head; entry != NULL; entry = next) {
+    next = entry->lru_next;
+    uri = strchr(entry->key, ' ') + 1;
+    if (uri_prefix == NULL || (!strncmp(uri, uri_prefix, len) &&
+        (!exact || uri[len] == '\0' || uri[len] == '?'))) {
+      remove_cgi_cache_entry(ctx, entry);
+      n++;
+    }
+  }
+  ctx->cgi_cache_stats.purged += n;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  return n;
+}
+
+int mg_purge_cgi_cache(struct mg_context *ctx, const char *uri_prefix) {
+  return purge_cgi_cache(ctx, uri_prefix, 0);
+}
+
+// Returns 1 for methods that may change what a GET of the URI returns.
+static int is_unsafe_method(const char *method) {
+  return strcmp(method, "GET") && strcmp(method, "HEAD") &&
+    strcmp(method, "OPTIONS");
+}
+
+// Returns 1 if the client asks for a response not served from a cache,
+// as browsers do on a forced reload.
+static int is_no_cache_request(const struct mg_connection *conn) {
+  const char *cc = mg_get_header(conn, "Cache-Control"),
+        *pragma = mg_get_header(conn, "Pragma");
+
+  return (cc != NULL && mg_strcasestr(cc, "no-cache") != NULL) ||
+    (pragma != NULL && mg_strcasestr(pragma, "no-cache") != NULL);
+}
+
+void mg_get_cgi_cache_stats(struct mg_context *ctx,
+                            struct mg_cgi_cache_stats *stats) {
+  (void) pthread_mutex_lock(&ctx->mutex);
+  *stats = ctx->cgi_cache_stats;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+static int is_loopback_client(const struct mg_connection *conn) {
+  const union usa *rsa = &conn->client.rsa;
+#if defined(USE_IPV6)
+  if (rsa->sa.sa_family == AF_INET6) {
+    return IN6_IS_ADDR_LOOPBACK(&rsa->sin6.sin6_addr);
+  }
+#endif
+  return rsa->sa.sa_family == AF_INET &&
+    (ntohl(rsa->sin.sin_addr.s_addr) >> 24) == 127;
+}
+
+static void handle_purge_request(struct mg_connection *conn) {
+  char body[32];
+  int n;
+
+  if (!is_loopback_client(conn)) {
+    send_http_error(conn, 403, "Forbidden", "%s", "Forbidden");
+    return;
+  }
+  n = mg_purge_cgi_cache(conn->ctx, conn->request_info.uri);
+  mg_snprintf(conn, body, sizeof(body), "Purged %d\n", n);
+  conn->status_code = 200;
+  mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+            "Content-Length: %d\r\nConnection: %s\r\n\r\n%s",
+            (int) strlen(body), suggest_connection_header(conn), body);
+}
+
+// Parse CGI reply headers, make up and send the status line and headers.
+static void send_cgi_headers(struct mg_connection *conn, char *buf,
+                             int headers_len) {
+  const char *status, *status_text, *cc;
+  const struct cache_rule *rule;
+  struct cgi_capture *capture;
+  struct mg_request_info ri;
+  char *pbuf = buf, cache_headers[300];
+  int i;
+
+  buf[headers_len - 1] = '\0';
+  parse_http_headers(&pbuf, &ri);
+
+  // Make up and send the status line
+  status_text = "OK";
+  if ((status = get_header(&ri, "Status")) != NULL) {
+    conn->status_code = atoi(status);
+    status_text = status;
+    while (isdigit(* (unsigned char *) status_text) || *status_text == ' ') {
+      status_text++;
+    }
+  } else if (get_header(&ri, "Location") != NULL) {
+    conn->status_code = 302;
+  } else {
+    conn->status_code = 200;
+  }
+  if (get_header(&ri, "Connection") != NULL &&
+      !mg_strcasecmp(get_header(&ri, "Connection"), "keep-alive")) {
+    conn->must_close = 1;
+  }
+  (void) mg_printf(conn, "HTTP/1.1 %d %s\r\n", conn->status_code,
+                   status_text);
+
+  // Send headers
+  for (i = 0; i < ri.num_headers; i++) {
+    mg_printf(conn, "%s: %s\r\n",
+              ri.http_headers[i].name, ri.http_headers[i].value);
+  }
+  // Cache rules apply only when the script did not decide itself.
+  rule = NULL;
+  if (get_header(&ri, "Cache-Control") == NULL &&
+      get_header(&ri, "Expires") == NULL &&
+      (rule = find_cache_rule(conn->ctx, conn->request_info.uri)) != NULL) {
+    cache_rule_headers(rule, cache_headers, sizeof(cache_headers));
+    mg_printf(conn, "%s", cache_headers);
+  }
+  mg_write(conn, "\r\n", 2);
+
+  if ((capture = conn->cgi_capture) != NULL) {
+    cc = get_header(&ri, "Cache-Control");
+    if (get_header(&ri, "Set-Cookie") != NULL) {
+      capture->failed = 1;
+      return;
+    } else if (conn->status_code == 200) {
+      capture->max_age = cc != NULL ? cgi_cache_max_age(cc, strlen(cc)) :
+        rule != NULL ? cgi_cache_max_age(rule->directive.ptr,
+                                         rule->directive.len) : 0;
+    }
+    if (capture->max_age <= 0 && !capture->coalesce) {
+      capture->failed = 1;
+      return;
+    }
+    capture->status_code = conn->status_code;
+    capture->vary = get_header(&ri, "Vary") == NULL ? NULL :
+      mg_strdup(get_header(&ri, "Vary"));
+    mg_snprintf(conn, cache_headers, sizeof(cache_headers),
+                "HTTP/1.1 %d %s\r\n", conn->status_code, status_text);
+    capture_cgi_data(capture, cache_headers, strlen(cache_headers));
+    for (i = 0; i < ri.num_headers; i++) {
+      capture_cgi_header(capture, ri.http_headers[i].name,
+                         ri.http_headers[i].value);
+    }
+    if (rule != NULL) {
+      cache_rule_headers(rule, cache_headers, sizeof(cache_headers));
+      capture_cgi_data(capture, cache_headers, strlen(cache_headers));
+    }
+    capture->headers_len = capture->data_len;
+  }
+}
+
+// Wait up to wait_ms milliseconds for the CGI process to exit, then kill
+// it. Reap the process, and store its exit status and resource usage
+// in conn->stats.
+static void reap_cgi_process(struct mg_connection *conn, pid_t pid,
+                             int wait_ms) {
+  struct mg_request_stats *stats = &conn->stats;
+#if defined(_WIN32)
+  FILETIME created, exited, kernel, user;
+  PROCESS_MEMORY_COUNTERS pmc;
+  DWORD code;
+
+  stats->cgi_exit_status = -1;
+  if (WaitForSingleObject(pid, (DWORD) wait_ms) != WAIT_OBJECT_0) {
+    (void) TerminateProcess(pid, (UINT) -1);
+    (void) WaitForSingleObject(pid, 1000);
+  } else if (GetExitCodeProcess(pid, &code)) {
+    stats->cgi_exit_status = (int) code;
+  }
+  if (GetProcessTimes(pid, &created, &exited, &kernel, &user)) {
+    stats->cgi_user_time = (double) MAKEUQUAD(user.dwLowDateTime,
+        user.dwHighDateTime) / RATE_DIFF;
+    stats->cgi_system_time = (double) MAKEUQUAD(kernel.dwLowDateTime,
+        kernel.dwHighDateTime) / RATE_DIFF;
+  }
+  if (GetProcessMemoryInfo(pid, &pmc, sizeof(pmc))) {
+    stats->cgi_peak_rss_kb = (long) (pmc.PeakWorkingSetSize / 1024);
+  }
+  (void) CloseHandle(pid);
+#else
+  struct rusage ru;
+  int status = 0;
+  pid_t n;
+
+  stats->cgi_exit_status = -1;
+  while ((n = wait4(pid, &status, WNOHANG, &ru)) == 0 && wait_ms > 0) {
+    (void) mg_sleep(5);
+    wait_ms -= 5;
+  }
+  if (n == 0) {
+    kill(pid, SIGKILL);
+    while ((n = wait4(pid, &status, 0, &ru)) == -1 && ERRNO == EINTR) {
+    }
+  }
+  if (n == pid) {
+    if (WIFEXITED(status)) {
+      stats->cgi_exit_status = WEXITSTATUS(status);
+    }
+    stats->cgi_user_time = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    stats->cgi_system_time = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#if defined(__MACH__)
+    stats->cgi_peak_rss_kb = (long) (ru.ru_maxrss / 1024);  // In bytes
+#else
+    stats->cgi_peak_rss_kb = (long) ru.ru_maxrss;
+#endif
+  }
+#endif // _WIN32
+}
+
+// Add resource usage of the finished CGI request to the per-script table.
+static void record_cgi_stats(struct mg_connection *conn, const char *prog,
+                             int cancelled) {
+  struct mg_context *ctx = conn->ctx;
+  const struct mg_request_stats *rs = &conn->stats;
+  struct mg_cgi_script_stats *st = NULL, *p;
+  size_t root_len = strlen(ctx->config[DOCUMENT_ROOT]);
+  const char *script_name;
+  int i;
+
+  // Same as SCRIPT_NAME in prepare_cgi_environment()
+  script_name = strlen(prog) > root_len ? prog + root_len : "";
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (i = 0; i < ctx->num_cgi_stats; i++) {
+    if (!strncmp(ctx->cgi_stats[i].script_name, script_name,
+                 sizeof(st->script_name) - 1)) {
+      st = &ctx->cgi_stats[i];
+      break;
+    }
+  }
+  if (st == NULL && ctx->num_cgi_stats < MAX_CGI_SCRIPT_STATS) {
+    // Table grows in steps of 32 entries
+    p = ctx->cgi_stats;
+    if (ctx->num_cgi_stats % 32 == 0) {
+      p = (struct mg_cgi_script_stats *) realloc(p,
+          (ctx->num_cgi_stats + 32) * sizeof(*p));
+    }
+    if (p != NULL) {
+      ctx->cgi_stats = p;
+      st = &p[ctx->num_cgi_stats++];
+      memset(st, 0, sizeof(*st));
+      mg_strlcpy(st->script_name, script_name, sizeof(st->script_name));
+    }
+  }
+  if (st != NULL) {
+    st->num_requests++;
+    st->num_cancelled += cancelled;
+    st->total_wall_time += rs->wall_time;
+    if (rs->wall_time > st->max_wall_time) {
+      st->max_wall_time = rs->wall_time;
+    }
+    st->total_user_time += rs->cgi_user_time;
+    st->total_system_time += rs->cgi_system_time;
+    if (rs->cgi_peak_rss_kb > st->max_peak_rss_kb) {
+      st->max_peak_rss_kb = rs->cgi_peak_rss_kb;
+    }
+  }
+  if (cancelled) {
+    ctx->num_cgi_cancelled++;
+    ctx->cgi_cancelled_wall_time += rs->wall_time;
+    ctx->cgi_cancelled_cpu_time += rs->cgi_user_time + rs->cgi_system_time;
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+static void handle_cgi_request(struct mg_connection *conn, const char *prog) {
+  int headers_len, data_len, buf_size, n, fdin[2], fdout[2];
+  int want, ready, in_len, in_stalled = 0, client_gone = 0, watch_client = 1;
+  int64_t body_len;
+  const char *expect = NULL, *in_ptr;
+  char *buf = NULL, in_buf[MG_BUF_LEN], dir[PATH_MAX], *p;
+  struct cgi_env_block blk;
+  pid_t pid = (pid_t) -1;
+  double spawn_start;
+
+  fdin[0] = fdin[1] = fdout[0] = fdout[1] = -1;
+  prepare_cgi_environment(conn, prog, &blk);
+
+  // CGI must be executed in its own directory. 'dir' must point to the
+  // directory containing executable program, 'p' must point to the
+  // executable program name relative to 'dir'.
+  (void) mg_snprintf(conn, dir, sizeof(dir), "%s", prog);
+  if ((p = strrchr(dir, '/')) != NULL) {
+    *p++ = '\0';
+  } else {
+    dir[0] = '.', dir[1] = '\0';
+    p = (char *) prog;
+  }
+
+  // Check POST body headers before anything is spawned
+  body_len = 0;
+  if (!strcmp(conn->request_info.request_method, "POST")) {
+    expect = mg_get_header(conn, "Expect");
+    if (conn->content_len == -1) {
+      send_http_error(conn, 411, "Length Required", "%s", "");
+      goto done;
+    } else if (expect != NULL && mg_strcasecmp(expect, "100-continue")) {
+      send_http_error(conn, 417, "Expectation Failed", "%s", "");
+      goto done;
+    }
+    body_len = conn->content_len;
+  }
+
+  buf_size = MG_BUF_LEN * 2;
+  if ((buf = (char *) malloc(buf_size)) == NULL) {
+    send_http_error(conn, 500, http_500_error, "%s", "Out of memory");
+    goto done;
+  }
+
+  if (pipe(fdin) != 0 || pipe(fdout) != 0) {
+    send_http_error(conn, 500, http_500_error,
+        "Cannot create CGI pipe: %s", strerror(ERRNO));
+    goto done;
+  }
+
+  // Make sure child closes all pipe descriptors. It must dup them to 0,1.
+  // This must be done before spawning, otherwise the child inherits the
+  // write end of its own stdin and never sees an EOF on it.
+  set_close_on_exec(fdin[0]);
+  set_close_on_exec(fdin[1]);
+  set_close_on_exec(fdout[0]);
+  set_close_on_exec(fdout[1]);
+
+  spawn_start = trace_clock(conn->ctx);
+  pid = spawn_process(conn, p, blk.buf, blk.vars, fdin[0], fdout[1], dir);
+  trace_event(conn, "cgi spawn", spawn_start);
+  if (pid == (pid_t) -1) {
+    send_http_error(conn, 500, http_500_error,
+        "Cannot spawn CGI process [%s]: %s", prog, strerror(ERRNO));
+    goto done;
+  }
+
+  // Parent closes only one side of the pipes.
+  // If we don't mark them as closed, close() attempt before
+  // return from this function throws an exception on Windows.
+  // Windows does not like when closed descriptor is closed again.
+  (void) close(fdin[0]);
+  (void) close(fdout[1]);
+  fdin[0] = fdout[1] = -1;
+
+  // Writes to CGI stdin must not block: the CGI program may emit output
+  // before it consumes its input, so POST data is fed to it in the same
+  // loop that relays its output back to the client.
+  set_cgi_pipe_mode(fdin[1], fdout[0]);
+
+  if (expect != NULL) {
+    (void) mg_printf(conn, "%s", "HTTP/1.1 100 Continue\r\n\r\n");
+  }
+
+  // Part of the body may have been read together with request headers
+  assert(conn->consumed_content == 0);
+  in_ptr = conn->buf + conn->request_len;
+  in_len = conn->data_len - conn->request_len;
+  if ((int64_t) in_len > body_len) {
+    in_len = (int) body_len;
+  }
+  conn->consumed_content += in_len;
+
+  // Read CGI reply into a buffer, growing it if needed. We need to set
+  // correct status code, thus we need to see all HTTP headers first.
+  // Do not send anything back to client, until we buffer in all
+  // HTTP headers.
+  data_len = headers_len = 0;
+  for (;;) {
+    // All of the body has been passed on, close so child gets an EOF.
+    if (in_len == 0 && fdin[1] != -1 && conn->consumed_content >= body_len) {
+      (void) close(fdin[1]);
+      fdin[1] = -1;
+    }
+
+    want = CGI_OUT_READY;
+    if (in_len > 0) {
+      want |= CGI_IN_READY | (in_stalled ? CGI_IN_STALLED : 0);
+    } else if (watch_client) {
+      // Either more body to read, or watching for the client hanging up,
+      // in which case the script is terminated instead of being run to
+      // completion.
+      want |= CGI_CLIENT_READY;
+    }
+    if ((ready = wait_for_cgi_io(conn, fdout[0], fdin[1], want)) == 0) {
+      break;
+    }
+
+    if (ready & CGI_CLIENT_READY) {
+      if (conn->consumed_content < body_len) {
+        n = sizeof(in_buf);
+        if ((int64_t) n > body_len - conn->consumed_content) {
+          n = (int) (body_len - conn->consumed_content);
+        }
+        if ((n = pull(NULL, conn, in_buf, n)) <= 0) {
+          client_gone = 1;
+          break;
+        }
+        conn->consumed_content += n;
+        in_ptr = in_buf;
+        in_len = n;
+      } else if (is_client_gone(conn)) {
+        client_gone = 1;
+        break;
+      } else {
+        // Client sent more data, e.g. pipelined request. It would keep the
+        // socket readable, stop watching it for this response.
+        watch_client = 0;
+      }
+    }
+
+    if ((ready & CGI_IN_READY) && in_len > 0) {
+      in_stalled = 0;
+      if ((n = write_cgi_input(fdin[1], in_ptr, in_len)) < 0) {
+        // CGI program does not want the rest of the body. Drop it, the
+        // connection cannot be reused as the body is not fully read.
+        (void) close(fdin[1]);
+        fdin[1] = -1;
+        in_len = 0;
+        body_len = conn->consumed_content;
+        conn->must_close = 1;
+      } else {
+        in_ptr += n;
+        in_len -= n;
+        in_stalled = n == 0;
+      }
+    }
+
+    if (ready & CGI_OUT_READY) {
+      if (headers_len == 0 && data_len == buf_size) {
+        if (buf_size >= MAX_CGI_HEADERS_SIZE ||
+            (p = (char *) realloc(buf, buf_size * 2)) == NULL) {
+          break;
+        }
+        buf = p;
+        buf_size *= 2;
+      }
+      if ((n = read(fdout[0], buf + data_len, buf_size - data_len)) <= 0) {
+        break;
+      }
+      data_len += n;
+      if (headers_len == 0) {
+        if ((headers_len = get_request_len(buf, data_len)) < 0) {
+          headers_len = 0;
+          break;
+        } else if (headers_len == 0) {
+          continue;
+        }
+        send_cgi_headers(conn, buf, headers_len);
+        n = data_len - headers_len;
+        memmove(buf, buf + headers_len, n);
+        headers_len = -1;  // Headers are sent, relay the rest as-is
+      }
+      if (mg_write(conn, buf, (size_t) n) != n) {
+        if (conn->cgi_capture != NULL) {
+          conn->cgi_capture->failed = 1;
+        }
+        break;
+      }
+      if (conn->cgi_capture != NULL) {
+        capture_cgi_data(conn->cgi_capture, buf, (size_t) n);
+      }
+      conn->num_bytes_sent += n;
+      data_len = 0;
+    }
+  }
+
+  if ((client_gone || headers_len != -1) && conn->cgi_capture != NULL) {
+    conn->cgi_capture->failed = 1;
+  }
+  if (client_gone) {
+    DEBUG_TRACE(("client closed connection, killing CGI [%s]", prog));
+    conn->must_close = 1;
+  } else if (headers_len == 0) {
+    send_http_error(conn, 500, http_500_error,
+                    "CGI program sent malformed or too big (>%u bytes) "
+                    "HTTP headers: [%.*s]",
+                    (unsigned) MAX_CGI_HEADERS_SIZE,
+                    data_len < 256 ? data_len : 256, buf);
+  }
+  if (conn->consumed_content < body_len) {
+    conn->must_close = 1;
+  }
+
+done:
+  if (fdin[1] != -1) {
+    close(fdin[1]);
+    fdin[1] = -1;
+  }
+  if (pid != (pid_t) -1) {
+    // A script that has sent all of its output is about to exit, give it a
+    // chance to, so its exit status is known. Otherwise kill it right away.
+    conn->stats.is_cgi = 1;
+    reap_cgi_process(conn, pid, client_gone || headers_len == 0 ? 0 :
+                     CGI_EXIT_TIMEOUT);
+    conn->stats.wall_time = mg_clock() - conn->start_time;
+    record_cgi_stats(conn, prog, client_gone);
+  }
+  if (fdin[0] != -1) {
+    close(fdin[0]);
+  }
+  if (fdin[1] != -1) {
+    close(fdin[1]);
+  }
+  if (fdout[0] != -1) {
+    close(fdout[0]);
+  }
+  if (fdout[1] != -1) {
+    close(fdout[1]);
+  }
+  free(buf);
+}
+
+// Must be called with ctx->mutex held.
+static void release_cgi_flight(struct cgi_flight *flight) {
+  if (--flight->num_refs == 0) {
+    free(flight->data);
+    free(flight->key);
+    free(flight);
+  }
+}
+
+// Waits for a running request with the same key and sends a copy of its
+// response. Returns 0 if the request has to run the script itself, and
+// sets *leader if others may wait for it.
+static int join_cgi_flight(struct mg_connection *conn, const char *key,
+                           struct cgi_flight **leader) {
+  struct mg_context *ctx = conn->ctx;
+  struct cgi_flight *flight;
+  double deadline = mg_clock() +
+    atoi(ctx->config[COALESCE_TIMEOUT_MS]) / 1000.0, now;
+  int sent = 0;
+
+  *leader = NULL;
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (flight = ctx->cgi_flights; flight != NULL; flight = flight->next) {
+    if (!strcmp(flight->key, key)) {
+      break;
+    }
+  }
+  if (flight == NULL) {
+    if ((flight = (struct cgi_flight *) calloc(1, sizeof(*flight))) != NULL &&
+        (flight->key = mg_strdup(key)) != NULL) {
+      flight->num_refs = 1;
+      flight->next = ctx->cgi_flights;
+      ctx->cgi_flights = flight;
+      *leader = flight;
+    } else {
+      free(flight);
+    }
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    return 0;
+  }
+
+  flight->num_refs++;
+  // Wake up periodically, a broadcast may be missed on Windows.
+  while (!flight->done && (now = mg_clock()) < deadline &&
+         ctx->stop_flag == 0) {
+    cond_wait_ms(&ctx->cgi_flight_done, &ctx->mutex,
+                 deadline - now < 0.1 ? (int) ((deadline - now) * 1000) + 1 :
+                 100);
+  }
+  if (!flight->done) {
+    ctx->cgi_cache_stats.coalesce_timeouts++;
+  } else if (flight->data != NULL) {
+    ctx->cgi_cache_stats.coalesced++;
+    sent = 1;
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  // The response does not change once done, the reference keeps it.
+  if (sent) {
+    conn->stats.cgi_coalesced = 1;
+    send_captured_cgi_response(conn, flight->status_code, flight->data,
+                               flight->headers_len, flight->data_len, -1);
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  release_cgi_flight(flight);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  return sent;
+}
+
+// Hands the captured response over to the waiting requests.
+static void finish_cgi_flight(struct mg_connection *conn,
+                              struct cgi_flight *flight,
+                              struct cgi_capture *capture) {
+  struct mg_context *ctx = conn->ctx;
+  struct cgi_flight **p;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (p = &ctx->cgi_flights; *p != flight; p = &(*p)->next) {
+  }
+  *p = flight->next;
+  if (!capture->failed && capture->headers_len > 0 &&
+      capture->data_len <= (size_t) atol(ctx->config[COALESCE_MAX_SIZE]) &&
+      conn->stats.cgi_exit_status == 0) {
+    flight->data = capture->data;
+    flight->headers_len = capture->headers_len;
+    flight->data_len = capture->data_len;
+    flight->status_code = capture->status_code;
+    capture->data = NULL;
+  }
+  flight->done = 1;
+  release_cgi_flight(flight);
+  (void) pthread_cond_broadcast(&ctx->cgi_flight_done);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Serves GET requests from the CGI response cache or together with
+// identical concurrent requests, or runs the script and caches its
+// response.
+static void handle_cgi_request_cached(struct mg_connection *conn,
+                                      const char *prog) {
+  struct mg_context *ctx = conn->ctx;
+  const struct mg_request_info *ri = &conn->request_info;
+  const char *pattern = ctx->config[COALESCE_PATTERN], *cookie;
+  struct cgi_capture capture;
+  struct cgi_flight *flight = NULL;
+  size_t cache_size = (size_t) atol(ctx->config[CGI_CACHE_SIZE]);
+  size_t coalesce_size = (size_t) atol(ctx->config[COALESCE_MAX_SIZE]);
+  char key[MG_BUF_LEN], flight_key[MG_BUF_LEN];
+  int n, coalesce;
+
+  coalesce = pattern != NULL &&
+    match_prefix(pattern, strlen(pattern), ri->uri) > 0;
+  n = snprintf(key, sizeof(key), "%s %s%s%s", ri->request_method, ri->uri,
+               ri->query_string == NULL ? "" : "?",
+               ri->query_string == NULL ? "" : ri->query_string);
+  if ((ctx->cgi_cache == NULL && !coalesce) ||
+      strcmp(ri->request_method, "GET") ||
+      n < 0 || n >= (int) sizeof(key)) {
+    handle_cgi_request(conn, prog);
+    if (ctx->cgi_cache != NULL && is_unsafe_method(ri->request_method) &&
+        conn->status_code < 400) {
+      purge_cgi_cache(ctx, ri->uri, 1);
+    }
+    return;
+  }
+  if (ctx->cgi_cache != NULL && !is_no_cache_request(conn) &&
+      send_cached_cgi_response(conn, key)) {
+    return;
+  }
+  if (coalesce) {
+    // Other users' cookies may change the response, the cache has Vary.
+    cookie = mg_get_header(conn, "Cookie");
+    n = snprintf(flight_key, sizeof(flight_key), "%s\n%s", key,
+                 cookie == NULL ? "" : cookie);
+    if (n >= 0 && n < (int) sizeof(flight_key) &&
+        join_cgi_flight(conn, flight_key, &flight)) {
+      return;
+    }
+  }
+
+  memset(&capture, 0, sizeof(capture));
+  capture.max_size = cache_size / 8;
+  if (flight != NULL) {
+    capture.coalesce = 1;
+    if (coalesce_size > capture.max_size) {
+      capture.max_size = coalesce_size;
+    }
+  }
+  conn->cgi_capture = &capture;
+  handle_cgi_request(conn, prog);
+  conn->cgi_capture = NULL;
+  if (ctx->cgi_cache != NULL && !capture.failed && capture.max_age > 0 &&
+      conn->stats.cgi_exit_status == 0) {
+    store_cgi_response(conn, key, &capture, cache_size);
+  }
+  if (flight != NULL) {
+    finish_cgi_flight(conn, flight, &capture);
+  }
+  free(capture.data);
+  free(capture.vary);
+}
+#endif // !NO_CGI
+
+// For a given PUT path, create all intermediate subdirectories
+// for given path. Return 0 if the path itself is a directory,
+// or -1 on error, 1 if OK.
+static int put_dir(struct mg_connection *conn, const char *path) {
+  char buf[PATH_MAX];
+  const char *s, *p;
+  struct file file = STRUCT_FILE_INITIALIZER;
+  int len, res = 1;
+
+  for (s = p = path + 2; (p = strchr(s, '/')) != NULL; s = ++p) {
+    len = p - path;
+    if (len >= (int) sizeof(buf)) {
+      res = -1;
+      break;
+    }
+    memcpy(buf, path, len);
+    buf[len] = '\0';
+
     // Try to create intermediate directory
     DEBUG_TRACE(("mkdir(%s)", buf));
     if (!mg_stat(conn, buf, &file) && mg_mkdir(buf, 0755) != 0) {
@@ -3825,17 +5856,16 @@ static void do_ssi_include(struct mg_connection *conn, const char *ssi,
     return;
   }
 
-  if (!mg_fopen(conn, path, "rb", &file)) {
+  if (match_prefix(conn->ctx->config[SSI_EXTENSIONS],
+                   strlen(conn->ctx->config[SSI_EXTENSIONS]), path) > 0 &&
+      mg_stat(conn, path, &file)) {
+    send_ssi_file(conn, path, &file, include_level + 1);
+  } else if (!mg_fopen(conn, path, "rb", &file)) {
     cry(conn, "Cannot open SSI #include: [%s]: fopen(%s): %s",
         tag, path, strerror(ERRNO));
   } else {
     fclose_on_exec(&file);
-    if (match_prefix(conn->ctx->config[SSI_EXTENSIONS],
-                     strlen(conn->ctx->config[SSI_EXTENSIONS]), path) > 0) {
-      send_ssi_file(conn, path, &file, include_level + 1);
-    } else {
-      send_file_data(conn, &file, 0, INT64_MAX);
-    }
+    send_file_data(conn, &file, 0, INT64_MAX);
     mg_fclose(&file);
   }
 }
@@ -3856,6 +5886,233 @@ static void do_ssi_exec(struct mg_connection *conn, char *tag) {
 }
 #endif // !NO_POPEN
 
+// SSI files are compiled on first use into a list of segments: ranges of
+// literal text, sent straight from the file contents, and the directives
+// between them. Compiled files are cached by path, size and modification
+// time, in at most SSI_CACHE_SIZE bytes, and includes use the cache too.
+// Larger files than SSI_MAX_TEMPLATE_SIZE are parsed as they are sent,
+// so memory use per request stays bounded.
+#define SSI_CACHE_SIZE (4 * 1024 * 1024)
+#define SSI_MAX_TEMPLATE_SIZE (SSI_CACHE_SIZE / 4)
+
+enum {SSI_LITERAL, SSI_INCLUDE, SSI_EXEC, SSI_UNKNOWN};
+
+struct ssi_segment {
+  int type;
+  size_t offset, len;         // Text, or whole tag "<!--#...>" in data
+};
+
+struct ssi_template {
+  struct ssi_template *next;  // In ctx->ssi_templates, newest first
+  char *path;
+  time_t modification_time;
+  int64_t file_size;
+  int num_refs;               // The cache and requests using it
+  char *data;                 // File contents
+  struct ssi_segment *segments;
+  int num_segments, max_segments;
+  size_t size;                // Counted against SSI_CACHE_SIZE
+};
+
+static int add_ssi_segment(struct ssi_template *t, int type, size_t offset,
+                           size_t len) {
+  void *p;
+
+  if (len == 0) {
+    return 1;
+  } else if (t->num_segments >= t->max_segments) {
+    if ((p = realloc(t->segments, 2 * t->max_segments *
+                     sizeof(t->segments[0]))) == NULL) {
+      return 0;
+    }
+    t->segments = (struct ssi_segment *) p;
+    t->max_segments *= 2;
+  }
+  t->segments[t->num_segments].type = type;
+  t->segments[t->num_segments].offset = offset;
+  t->segments[t->num_segments].len = len;
+  t->num_segments++;
+  return 1;
+}
+
+// Splits the file into segments. A tag starts with "<!--#" and ends at
+// the next '>', anything else is literal text.
+static int compile_ssi_template(struct mg_connection *conn,
+                                struct ssi_template *t, size_t size) {
+  const char *data = t->data, *p, *end;
+  size_t literal = 0, i = 0, len;
+  int type;
+
+  while ((p = (const char *) memchr(data + i, '<', size - i)) != NULL) {
+    i = p - data;
+    if (size - i < 6 || memcmp(p, "<!--#", 5) != 0 ||
+        (end = (const char *) memchr(p + 5, '>', size - i - 5)) == NULL) {
+      i++;
+      continue;
+    }
+    len = end - p + 1;
+    if (len > MG_BUF_LEN - 2) {
+      cry(conn, "%s: SSI tag is too large", t->path);
+      type = SSI_LITERAL;
+    } else if (len >= 13 && !memcmp(p + 5, "include", 7)) {
+      type = SSI_INCLUDE;
+#if !defined(NO_POPEN)
+    } else if (len >= 10 && !memcmp(p + 5, "exec", 4)) {
+      type = SSI_EXEC;
+#endif // !NO_POPEN
+    } else {
+      type = SSI_UNKNOWN;
+    }
+    if (type != SSI_LITERAL) {
+      if (!add_ssi_segment(t, SSI_LITERAL, literal, i - literal) ||
+          !add_ssi_segment(t, type, i, len)) {
+        return 0;
+      }
+      literal = i + len;
+    }
+    i += len;
+  }
+  return add_ssi_segment(t, SSI_LITERAL, literal, size - literal);
+}
+
+static void free_ssi_template(struct ssi_template *t) {
+  free(t->path);
+  free(t->data);
+  free(t->segments);
+  free(t);
+}
+
+static void release_ssi_template(struct mg_context *ctx,
+                                 struct ssi_template *t) {
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (--t->num_refs == 0) {
+    free_ssi_template(t);
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+// Must be called with ctx->mutex held.
+static void uncache_ssi_template(struct mg_context *ctx,
+                                 struct ssi_template **p) {
+  struct ssi_template *t = *p;
+
+  *p = t->next;
+  ctx->ssi_templates_size -= t->size;
+  if (--t->num_refs == 0) {
+    free_ssi_template(t);
+  }
+}
+
+// Returns the compiled SSI file, from the cache or by reading it. Release
+// it with release_ssi_template(). Returns NULL if it cannot be read, or
+// is larger than SSI_MAX_TEMPLATE_SIZE.
+static struct ssi_template *get_ssi_template(struct mg_connection *conn,
+                                             const char *path,
+                                             const struct file *filep) {
+  struct mg_context *ctx = conn->ctx;
+  struct ssi_template *t, **p, **last;
+  struct file file = STRUCT_FILE_INITIALIZER;
+  size_t size = (size_t) filep->size;
+  int ok;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (p = &ctx->ssi_templates; (t = *p) != NULL; p = &t->next) {
+    if (!strcmp(t->path, path)) {
+      if (t->modification_time == filep->modification_time &&
+          t->file_size == filep->size) {
+        t->num_refs++;
+        (void) pthread_mutex_unlock(&ctx->mutex);
+        return t;
+      }
+      uncache_ssi_template(ctx, p);
+      break;
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  if (filep->size > SSI_MAX_TEMPLATE_SIZE ||
+      (t = (struct ssi_template *) calloc(1, sizeof(*t))) == NULL) {
+    return NULL;
+  }
+  t->path = mg_strdup(path);
+  t->modification_time = filep->modification_time;
+  t->file_size = filep->size;
+  t->num_refs = 1;
+  t->max_segments = 8;
+  t->segments = (struct ssi_segment *)
+    malloc(t->max_segments * sizeof(t->segments[0]));
+  t->data = (char *) malloc(size + 1);
+  ok = t->path != NULL && t->segments != NULL && t->data != NULL &&
+    mg_fopen(conn, path, "rb", &file);
+  if (ok && file.membuf != NULL) {
+    ok = file.size == filep->size;
+    if (ok) {
+      memcpy(t->data, file.membuf, size);
+    }
+  } else if (ok) {
+    ok = fread(t->data, 1, size, file.fp) == size;
+  }
+  mg_fclose(&file);
+  if (!ok || !compile_ssi_template(conn, t, size)) {
+    free_ssi_template(t);
+    return NULL;
+  }
+  t->size = sizeof(*t) + strlen(path) + size +
+    t->max_segments * sizeof(t->segments[0]);
+
+  if (t->size <= SSI_MAX_TEMPLATE_SIZE) {
+    (void) pthread_mutex_lock(&ctx->mutex);
+    // Another request may have compiled it meanwhile.
+    for (p = &ctx->ssi_templates; *p != NULL; p = &(*p)->next) {
+      if (!strcmp((*p)->path, path)) {
+        uncache_ssi_template(ctx, p);
+        break;
+      }
+    }
+    while (ctx->ssi_templates_size + t->size > SSI_CACHE_SIZE) {
+      for (last = &ctx->ssi_templates; (*last)->next != NULL;
+           last = &(*last)->next) {
+      }
+      uncache_ssi_template(ctx, last);
+    }
+    t->next = ctx->ssi_templates;
+    ctx->ssi_templates = t;
+    ctx->ssi_templates_size += t->size;
+    t->num_refs++;
+    (void) pthread_mutex_unlock(&ctx->mutex);
+  }
+  return t;
+}
+
+static void send_ssi_template(struct mg_connection *conn, const char *path,
+                              const struct ssi_template *t,
+                              int include_level) {
+  const struct ssi_segment *segment;
+  char tag[MG_BUF_LEN];
+  int i;
+
+  for (i = 0; i < t->num_segments; i++) {
+    segment = &t->segments[i];
+    if (segment->type == SSI_LITERAL) {
+      (void) mg_write(conn, t->data + segment->offset, segment->len);
+      continue;
+    }
+    // Directive arguments are parsed with sscanf(), which needs a copy
+    // with a terminating nul.
+    memcpy(tag, t->data + segment->offset, segment->len);
+    tag[segment->len] = '\0';
+    if (segment->type == SSI_INCLUDE) {
+      do_ssi_include(conn, path, tag + 12, include_level);
+#if !defined(NO_POPEN)
+    } else if (segment->type == SSI_EXEC) {
+      do_ssi_exec(conn, tag + 9);
+#endif // !NO_POPEN
+    } else {
+      cry(conn, "%s: unknown SSI " "command: \"%s\"", path, tag);
+    }
+  }
+}
+
 static int mg_fgetc(struct file *filep, int offset) {
   if (filep->membuf != NULL && offset >=0 && offset < filep->size) {
     return ((unsigned char *) filep->membuf)[offset];
@@ -3866,18 +6123,15 @@ static int mg_fgetc(struct file *filep, int offset) {
   }
 }
 
-static void send_ssi_file(struct mg_connection *conn, const char *path,
-                          struct file *filep, int include_level) {
+// Parses and sends an SSI file as it is read, for files too large to
+// compile. filep must be open.
+static void stream_ssi_file(struct mg_connection *conn, const char *path,
+                            struct file *filep, int include_level) {
   char buf[MG_BUF_LEN];
   int ch, offset, len, in_ssi_tag;
 
-  if (include_level > 10) {
-    cry(conn, "SSI #include level is too deep (%s)", path);
-    return;
-  }
-
   in_ssi_tag = len = offset = 0;
-  while ((ch = mg_fgetc(filep, offset)) != EOF) {
+  while ((ch = mg_fgetc(filep, offset++)) != EOF) {
     if (in_ssi_tag && ch == '>') {
       in_ssi_tag = 0;
       buf[len++] = (char) ch;
@@ -3929,21 +6183,52 @@ static void send_ssi_file(struct mg_connection *conn, const char *path,
   }
 }
 
+static void send_ssi_file(struct mg_connection *conn, const char *path,
+                          struct file *filep, int include_level) {
+  struct ssi_template *t;
+  struct file file = STRUCT_FILE_INITIALIZER;
+
+  if (include_level > 10) {
+    cry(conn, "SSI #include level is too deep (%s)", path);
+  } else if (filep->size > SSI_MAX_TEMPLATE_SIZE) {
+    if (!mg_fopen(conn, path, "rb", &file)) {
+      cry(conn, "Cannot read SSI file: %s", path);
+    } else {
+      fclose_on_exec(&file);
+      stream_ssi_file(conn, path, &file, include_level);
+      mg_fclose(&file);
+    }
+  } else if ((t = get_ssi_template(conn, path, filep)) == NULL) {
+    cry(conn, "Cannot read SSI file: %s", path);
+  } else {
+    send_ssi_template(conn, path, t, include_level);
+    release_ssi_template(conn->ctx, t);
+  }
+}
+
 static void handle_ssi_file_request(struct mg_connection *conn,
-                                    const char *path) {
+                                    const char *path, struct file *filep) {
+  struct ssi_template *t = NULL;
   struct file file = STRUCT_FILE_INITIALIZER;
 
-  if (!mg_fopen(conn, path, "rb", &file)) {
+  if (filep->size > SSI_MAX_TEMPLATE_SIZE ?
+      !mg_fopen(conn, path, "rb", &file) :
+      (t = get_ssi_template(conn, path, filep)) == NULL) {
     send_http_error(conn, 500, http_500_error, "fopen(%s): %s", path,
                     strerror(ERRNO));
   } else {
     conn->must_close = 1;
-    fclose_on_exec(&file);
     mg_printf(conn, "HTTP/1.1 200 OK\r\n"
               "Content-Type: text/html\r\nConnection: %s\r\n\r\n",
               suggest_connection_header(conn));
-    send_ssi_file(conn, path, &file, 0);
-    mg_fclose(&file);
+    if (t != NULL) {
+      send_ssi_template(conn, path, t, 0);
+      release_ssi_template(conn->ctx, t);
+    } else {
+      fclose_on_exec(&file);
+      stream_ssi_file(conn, path, &file, 0);
+      mg_fclose(&file);
+    }
   }
 }
 
@@ -3956,11 +6241,12 @@ static void send_options(struct mg_connection *conn) {
 }
 
 // Writes PROPFIND properties for a collection element
-static void print_props(struct mg_connection *conn, const char* uri,
+static void print_props(struct out_batch *out, const char* uri,
                         struct file *filep) {
-  char mtime[64];
+  char mtime[64], row[MG_BUF_LEN];
+  int len;
   gmt_time_string(mtime, sizeof(mtime), &filep->modification_time);
-  conn->num_bytes_sent += mg_printf(conn,
+  len = mg_snprintf(out->conn, row, sizeof(row),
       "<d:response>"
        "<d:href>%s</d:href>"
        "<d:propstat>"
@@ -3976,21 +6262,48 @@ static void print_props(struct mg_connection *conn, const char* uri,
       filep->is_directory ? "<d:collection/>" : "",
       filep->size,
       mtime);
+  write_out_batch(out, row, len);
 }
 
-static void print_dav_dir_entry(struct de *de, void *data) {
-  char href[PATH_MAX];
-  char href_encoded[PATH_MAX];
-  struct mg_connection *conn = (struct mg_connection *) data;
-  mg_snprintf(conn, href, sizeof(href), "%s%s",
-              conn->request_info.uri, de->file_name);
-  mg_url_encode(href, href_encoded, PATH_MAX-1);
-  print_props(conn, href_encoded, &de->file);
+// Writes PROPFIND properties for the entries of a directory, and for
+// levels more below it (Depth: infinity). Output is sent as it is made.
+static void print_dav_dir_entries(struct out_batch *out, const char *dir,
+                                  time_t modification_time, const char *uri,
+                                  int levels) {
+  struct mg_connection *conn = out->conn;
+  const struct dir_entry *entry;
+  struct dir_listing *listing;
+  struct file file;
+  char href[PATH_MAX], href_encoded[PATH_MAX], path[PATH_MAX];
+  const char *name;
+  int i;
+
+  if ((listing = get_dir_listing(conn, dir, modification_time)) == NULL) {
+    return;
+  }
+  for (i = 0; i < listing->num_entries; i++) {
+    entry = &listing->entries[i];
+    name = listing->names + entry->name;
+    dir_entry_file(entry, &file);
+    mg_snprintf(conn, href, sizeof(href), "%s%s", uri, name);
+    mg_url_encode(href, href_encoded, PATH_MAX-1);
+    print_props(out, href_encoded, &file);
+    if (levels > 0 && entry->is_directory &&
+        strlen(dir) + strlen(name) + 2 < sizeof(path) &&
+        strlen(href) + 2 < sizeof(href)) {
+      mg_snprintf(conn, path, sizeof(path), "%s%c%s", dir, '/', name);
+      strcat(href, "/");
+      print_dav_dir_entries(out, path, entry->modification_time, href,
+                            levels - 1);
+    }
+  }
+  release_dir_listing(conn->ctx, listing);
 }
 
 static void handle_propfind(struct mg_connection *conn, const char *path,
                             struct file *filep) {
   const char *depth = mg_get_header(conn, "Depth");
+  struct out_batch out;
 
   conn->must_close = 1;
   conn->status_code = 207;
@@ -4003,14 +6316,20 @@ static void handle_propfind(struct mg_connection *conn, const char *path,
       "<d:multistatus xmlns:d='DAV:'>\n");
 
   // Print properties for the requested resource itself
-  print_props(conn, conn->request_info.uri, filep);
+  out.conn = conn;
+  out.len = 0;
+  print_props(&out, conn->request_info.uri, filep);
 
   // If it is a directory, print directory entries too if Depth is not 0
   if (filep->is_directory &&
       !mg_strcasecmp(conn->ctx->config[ENABLE_DIRECTORY_LISTING], "yes") &&
       (depth == NULL || strcmp(depth, "0") != 0)) {
-    scan_directory(conn, path, conn, &print_dav_dir_entry);
+    print_dav_dir_entries(&out, path, filep->modification_time,
+                          conn->request_info.uri,
+                          depth != NULL && !mg_strcasecmp(depth, "infinity") ?
+                          DAV_MAX_LEVELS : 0);
   }
+  flush_out_batch(&out);
 
   conn->num_bytes_sent += mg_printf(conn, "%s\n", "</d:multistatus>");
 }
@@ -4173,6 +6492,7 @@ static void send_websocket_handshake(struct mg_connection *conn) {
   static const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
   char buf[100], sha[20], b64_sha[sizeof(sha) * 2];
   SHA1_CTX sha_ctx;
+  int on = 1;
 
   mg_snprintf(conn, buf, sizeof(buf), "%s%s",
               mg_get_header(conn, "Sec-WebSocket-Key"), magic);
@@ -4185,103 +6505,225 @@ static void send_websocket_handshake(struct mg_connection *conn) {
             "Upgrade: websocket\r\n"
             "Connection: Upgrade\r\n"
             "Sec-WebSocket-Accept: ", b64_sha, "\r\n\r\n");
+
+  // Frames are written whole. With Nagle's algorithm, echoes of messages
+  // that arrive together wait for the delayed ACK of the first one.
+  setsockopt(conn->client.sock, IPPROTO_TCP, TCP_NODELAY, (void *) &on,
+             sizeof(on));
+}
+
+// XOR frame payload with the 4-byte mask, 8 bytes at a time once aligned.
+static void unmask_websocket_data(char *data, size_t len, const char mask[4]) {
+  unsigned char m[8];
+  uint64_t word;
+  size_t i = 0, j;
+
+  while (i < len && ((uintptr_t) (data + i) & 7) != 0) {
+    data[i] ^= mask[i & 3];
+    i++;
+  }
+  if (len - i >= 8) {
+    for (j = 0; j < 8; j++) {
+      m[j] = (unsigned char) mask[(i + j) & 3];
+    }
+    memcpy(&word, m, sizeof(word));
+    for (; len - i >= 8; i += 8) {
+      * (uint64_t *) (data + i) ^= word;
+    }
+  }
+  for (; i < len; i++) {
+    data[i] ^= mask[i & 3];
+  }
+}
+
+static int deliver_websocket_data(struct mg_connection *conn, int bits,
+                                  char *data, size_t data_len) {
+  return conn->ctx->callbacks.websocket_data == NULL ||
+    conn->ctx->callbacks.websocket_data(conn, bits, data, data_len);
+}
+
+// Sends a close frame with a status code, RFC 6455 section 7.4.
+static void close_websocket(struct mg_connection *conn, int status) {
+  char payload[2];
+  payload[0] = (char) (status >> 8);
+  payload[1] = (char) (status & 0xff);
+  (void) mg_websocket_write(conn, WEBSOCKET_OPCODE_CONNECTION_CLOSE,
+                            payload, sizeof(payload));
+}
+
+// Returns the length of the frame header at the start of frame, or 0 if
+// more data is needed. Payload lengths above max are reported as max + 1.
+static size_t parse_websocket_header(const unsigned char *frame,
+                                     size_t body_len, size_t max,
+                                     size_t *data_len, size_t *mask_len) {
+  size_t len, header_len = 0;
+  uint64_t length;
+  int i;
+
+  if (body_len >= 2) {
+    len = frame[1] & 127;
+    *mask_len = frame[1] & 128 ? 4 : 0;
+    if (len < 126 && body_len >= 2 + *mask_len) {
+      *data_len = len;
+      header_len = 2 + *mask_len;
+    } else if (len == 126 && body_len >= 4 + *mask_len) {
+      header_len = 4 + *mask_len;
+      *data_len = ((((int) frame[2]) << 8) + frame[3]);
+    } else if (len == 127 && body_len >= 10 + *mask_len) {
+      header_len = 10 + *mask_len;
+      for (length = 0, i = 2; i < 10; i++) {
+        length = (length << 8) + frame[i];
+      }
+      // Checked here, size_t is 32 bits wide on 32-bit builds.
+      *data_len = length > max ? max + 1 : (size_t) length;
+    }
+  }
+  return header_len;
 }
 
 static void read_websocket(struct mg_connection *conn) {
-  // Pointer to the beginning of the portion of the incoming websocket message
-  // queue. The original websocket upgrade request is never removed,
-  // so the queue begins after it.
-  unsigned char *buf = (unsigned char *) conn->buf + conn->request_len;
-  int bits, n, stop = 0;
-  size_t i, len, mask_len, data_len, header_len, body_len;
-  // data points to the place where the message is stored when passed to the
-  // websocket_data callback. This is either mem on the stack,
-  // or a dynamically allocated buffer if it is too large.
-  char mem[4 * 1024], mask[4], *data;
+  // The queue of incoming frames begins after the original websocket
+  // upgrade request, which is never removed. Frames are consumed by
+  // advancing pos, and the queue is moved back to the start only when a
+  // frame does not fit in the rest of the buffer.
+  unsigned char *buf = (unsigned char *) conn->buf + conn->request_len,
+                *frame;
+  int bits, opcode, n, stop = 0, message_bits = 0;
+  size_t len, mask_len, data_len, header_len, body_len, pos = 0;
+  size_t queue_size = conn->buf_size - conn->request_len;
+  size_t max_message_size =
+    (size_t) atol(conn->ctx->config[WEBSOCKET_MAX_MESSAGE_SIZE]);
+  // A fragmented message is reassembled in message, see RFC 6455 5.4.
+  char *message = NULL, *data, *allocated, mask[4];
+  size_t message_len = 0, message_size = 0;
+  void *p;
 
   assert(conn->content_len == 0);
 
   // Loop continuously, reading messages from the socket, invoking the callback,
   // and waiting repeatedly until an error occurs.
   while (!stop) {
-    header_len = 0;
-    // body_len is the length of the entire queue in bytes
-    // len is the length of the current message
+    frame = buf + pos;
+    // body_len is the length of the unconsumed queue in bytes
     // data_len is the length of the current message's data payload
     // header_len is the length of the current message's header
-    if ((body_len = conn->data_len - conn->request_len) >= 2) {
-      len = buf[1] & 127;
-      mask_len = buf[1] & 128 ? 4 : 0;
-      if (len < 126 && body_len >= mask_len) {
-        data_len = len;
-        header_len = 2 + mask_len;
-      } else if (len == 126 && body_len >= 4 + mask_len) {
-        header_len = 4 + mask_len;
-        data_len = ((((int) buf[2]) << 8) + buf[3]);
-      } else if (body_len >= 10 + mask_len) {
-        header_len = 10 + mask_len;
-        data_len = (((uint64_t) htonl(* (uint32_t *) &buf[2])) << 32) +
-          htonl(* (uint32_t *) &buf[6]);
-      }
-    }
+    body_len = conn->data_len - conn->request_len - pos;
+    header_len = parse_websocket_header(frame, body_len, max_message_size,
+                                        &data_len, &mask_len);
 
     // Data layout is as follows:
-    //  conn->buf               buf
-    //     v                     v              frame1           | frame2
-    //     |---------------------|----------------|--------------|-------
-    //     |                     |<--header_len-->|<--data_len-->|
-    //     |<-conn->request_len->|<-----body_len----------->|
-    //     |<-------------------conn->data_len------------->|
-
-    if (header_len > 0) {
-      // Allocate space to hold websocket payload
-      data = mem;
-      if (data_len > sizeof(mem) && (data = malloc(data_len)) == NULL) {
-        // Allocation failed, exit the loop and then close the connection
-        // TODO: notify user about the failure
-        break;
+    //  conn->buf               buf       frame
+    //     v                     v          v         frame1      | frame2
+    //     |---------------------|----------|-------|------------|-------
+    //     |                     |<--pos--->|<hdr-->|<-data_len->|
+    //     |<-conn->request_len->|          |<-----body_len---------->|
+    //     |<-------------------conn->data_len----------------------->|
+
+    if (header_len > 0 && data_len > max_message_size) {
+      close_websocket(conn, 1009);  // Message too big
+      break;
+    } else if (header_len > 0 && header_len + data_len > body_len &&
+               header_len + data_len <= queue_size) {
+      // Frame not read completely yet, make room for it if needed.
+      if (pos + header_len + data_len > queue_size) {
+        memmove(buf, frame, body_len);
+        conn->data_len -= pos;
+        pos = 0;
       }
+      header_len = 0;
+    }
 
-      // Save mask and bits, otherwise it may be clobbered by memmove below
-      bits = buf[0];
-      memcpy(mask, buf + header_len - mask_len, mask_len);
-
-      // Read frame payload into the allocated buffer.
-      assert(body_len >= header_len);
-      if (data_len + header_len > body_len) {
+    if (header_len > 0) {
+      bits = frame[0];
+      opcode = bits & 0x0f;
+      memcpy(mask, frame + header_len - mask_len, mask_len);
+      allocated = NULL;
+
+      if (header_len + data_len <= body_len) {
+        // Whole frame is in the queue, unmask and pass it in place.
+        data = (char *) frame + header_len;
+        pos += header_len + data_len;
+      } else {
+        // Frame is larger than the queue, read it into its own buffer.
+        if ((data = allocated = (char *) malloc(data_len)) == NULL) {
+          break;
+        }
         len = body_len - header_len;
-        memcpy(data, buf + header_len, len);
-        // TODO: handle pull error
-        pull_all(NULL, conn, data + len, data_len - len);
+        memcpy(data, frame + header_len, len);
+        if (pull_all(NULL, conn, data + len, data_len - len) !=
+            (int) (data_len - len)) {
+          free(data);
+          break;
+        }
         conn->data_len = conn->request_len;
-      } else {
-        len = data_len + header_len;
-        memcpy(data, buf + header_len, data_len);
-        memmove(buf, buf + len, body_len - len);
-        conn->data_len -= len;
+        pos = 0;
       }
-
-      // Apply mask if necessary
       if (mask_len > 0) {
-        for (i = 0; i < data_len; i++) {
-          data[i] ^= mask[i % 4];
-        }
+        unmask_websocket_data(data, data_len, mask);
       }
 
-      // Exit the loop if callback signalled to exit,
-      // or "connection close" opcode received.
-      if ((bits & WEBSOCKET_OPCODE_CONNECTION_CLOSE) ||
-          (conn->ctx->callbacks.websocket_data != NULL &&
-           !conn->ctx->callbacks.websocket_data(conn, bits, data, data_len))) {
+      if (opcode == WEBSOCKET_OPCODE_CONNECTION_CLOSE) {
+        // Echo the status code and exit the loop.
+        (void) mg_websocket_write(conn, WEBSOCKET_OPCODE_CONNECTION_CLOSE,
+                                  data, data_len >= 2 ? 2 : 0);
+        stop = 1;
+      } else if (opcode & 0x08) {
+        // Other control frames may come between fragments of a message.
+        if (opcode == WEBSOCKET_OPCODE_PING) {
+          (void) mg_websocket_write(conn, WEBSOCKET_OPCODE_PONG,
+                                    data, data_len);
+        }
+        stop = !deliver_websocket_data(conn, bits, data, data_len);
+      } else if (opcode != WEBSOCKET_OPCODE_CONTINUATION && (bits & 0x80)) {
+        // Unfragmented message, the common case.
+        stop = !deliver_websocket_data(conn, bits, data, data_len);
+      } else if ((opcode == WEBSOCKET_OPCODE_CONTINUATION) !=
+                 (message_bits != 0)) {
+        close_websocket(conn, 1002);  // Protocol error
+        stop = 1;
+      } else if (message_len + data_len > max_message_size) {
+        close_websocket(conn, 1009);  // Message too big
         stop = 1;
+      } else {
+        if (opcode != WEBSOCKET_OPCODE_CONTINUATION) {
+          message_bits = 0x80 | opcode;
+        }
+        if (message_len + data_len > message_size) {
+          len = message_size * 2 > message_len + data_len ?
+            message_size * 2 : message_len + data_len;
+          if ((p = realloc(message, len)) == NULL) {
+            stop = 1;
+          } else {
+            message = (char *) p;
+            message_size = len;
+          }
+        }
+        if (!stop) {
+          memcpy(message + message_len, data, data_len);
+          message_len += data_len;
+          if (bits & 0x80) {
+            stop = !deliver_websocket_data(conn, message_bits, message,
+                                           message_len);
+            message_bits = 0;
+            message_len = 0;
+          }
+        }
       }
 
-      if (data != mem) {
-        free(data);
+      free(allocated);
+      if ((size_t) conn->data_len == (size_t) conn->request_len + pos) {
+        // Queue is empty, start again at the beginning.
+        conn->data_len = conn->request_len;
+        pos = 0;
       }
       // Not breaking the loop, process next websocket frame.
     } else {
       // Buffering websocket request
+      if (conn->data_len == conn->buf_size) {
+        memmove(buf, frame, body_len);
+        conn->data_len -= pos;
+        pos = 0;
+      }
       if ((n = pull(NULL, conn, conn->buf + conn->data_len,
                     conn->buf_size - conn->data_len)) <= 0) {
         break;
@@ -4289,46 +6731,53 @@ static void read_websocket(struct mg_connection *conn) {
       conn->data_len += n;
     }
   }
+  free(message);
 }
 
 int mg_websocket_write(struct mg_connection* conn, int opcode,
                        const char *data, size_t data_len) {
-    unsigned char *copy;
-    size_t copy_len = 0;
-    int retval = -1;
-
-    if ((copy = (unsigned char *) malloc(data_len + 10)) == NULL) {
+    unsigned char mem[MG_BUF_LEN], *frame;
+    uint64_t length = data_len;
+    size_t header_len;
+    int i, retval;
+
+    // Header and payload go out in one write. Small frames are put
+    // together on the stack, larger ones in one allocation.
+    if (data_len + 10 <= sizeof(mem)) {
+      frame = mem;
+    } else if ((frame = (unsigned char *) malloc(data_len + 10)) == NULL) {
       return -1;
     }
 
-    copy[0] = 0x80 + (opcode & 0x0f);
+    frame[0] = 0x80 + (opcode & 0x0f);
 
     // Frame format: http://tools.ietf.org/html/rfc6455#section-5.2
     if (data_len < 126) {
       // Inline 7-bit length field
-      copy[1] = data_len;
-      memcpy(copy + 2, data, data_len);
-      copy_len = 2 + data_len;
+      frame[1] = (unsigned char) data_len;
+      header_len = 2;
     } else if (data_len <= 0xFFFF) {
       // 16-bit length field
-      copy[1] = 126;
-      * (uint16_t *) (copy + 2) = htons(data_len);
-      memcpy(copy + 4, data, data_len);
-      copy_len = 4 + data_len;
+      frame[1] = 126;
+      frame[2] = (unsigned char) (data_len >> 8);
+      frame[3] = (unsigned char) data_len;
+      header_len = 4;
     } else {
       // 64-bit length field
-      copy[1] = 127;
-      * (uint32_t *) (copy + 2) = htonl((uint64_t) data_len >> 32);
-      * (uint32_t *) (copy + 6) = htonl(data_len & 0xffffffff);
-      memcpy(copy + 10, data, data_len);
-      copy_len = 10 + data_len;
+      frame[1] = 127;
+      for (i = 9; i > 1; i--) {
+        frame[i] = (unsigned char) length;
+        length >>= 8;
+      }
+      header_len = 10;
     }
+    memcpy(frame + header_len, data, data_len);
 
     // Not thread safe
-    if (copy_len > 0) {
-      retval = mg_write(conn, copy, copy_len);
+    retval = mg_write(conn, frame, header_len + data_len);
+    if (frame != mem) {
+      free(frame);
     }
-    free(copy);
 
     return retval;
 }
@@ -4365,6 +6814,431 @@ static int is_websocket_request(const struct mg_connection *conn) {
 }
 #endif // !USE_WEBSOCKET
 
+// Push channel, see PUSH_URI. Pages subscribe to topics with a GET
+// request: a websocket, or a text/event-stream for EventSource. Local
+// processes and mg_publish() publish messages to all subscribers of a
+// topic. Every subscriber occupies a worker thread while connected.
+
+// A published message, encoded once and shared by all subscribers.
+struct push_message {
+  int refcount;               // Protected by ctx->mutex
+  char *event;                // Server-sent event
+  size_t event_len;
+  size_t frame_len;           // Websocket text frame at the start of buf
+  char buf[1];
+};
+
+struct push_subscriber {
+  struct push_subscriber *next;  // In ctx->push_subscribers
+  const char *topics;         // ",topic1,topic2,"
+  int is_websocket;
+  int overflow;               // Queue limit reached, disconnect
+  struct push_message **queue;  // Messages not sent yet
+  int queue_len;
+  int queue_size;
+  size_t queue_bytes;
+  pthread_cond_t cond;        // Signaled when queue changes
+};
+
+static int is_valid_push_topic(const char *topic) {
+  return topic[0] != '\0' && strpbrk(topic, ",\r\n") == NULL;
+}
+
+static int push_topic_matches(const char *topics, const char *topic) {
+  size_t len = strlen(topic);
+  const char *p;
+
+  for (p = topics; (p = strstr(p + 1, topic)) != NULL; ) {
+    if (p[-1] == ',' && p[len] == ',') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Websocket messages are the topic, a newline and the data. Server-sent
+// events have the topic as event type, with data lines split on any of
+// the line endings EventSource knows.
+static struct push_message *new_push_message(const char *topic,
+                                             const char *data,
+                                             size_t data_len) {
+  struct push_message *msg;
+  size_t i, topic_len = strlen(topic), payload_len, lines = 1;
+  unsigned char *frame;
+  char *p;
+
+  for (i = 0; i < data_len; i++) {
+    lines += data[i] == '\r' || data[i] == '\n';
+  }
+  payload_len = topic_len + 1 + data_len;
+  if ((msg = (struct push_message *) malloc(sizeof(*msg) + 10 +
+      payload_len + topic_len + 9 + lines * 7 + data_len)) == NULL) {
+    return NULL;
+  }
+  msg->refcount = 1;
+
+  // Frame format: http://tools.ietf.org/html/rfc6455#section-5.2
+  frame = (unsigned char *) msg->buf;
+  frame[0] = 0x80 | WEBSOCKET_OPCODE_TEXT;
+  if (payload_len < 126) {
+    frame[1] = (unsigned char) payload_len;
+    msg->frame_len = 2;
+  } else if (payload_len <= 0xFFFF) {
+    frame[1] = 126;
+    frame[2] = (unsigned char) (payload_len >> 8);
+    frame[3] = (unsigned char) payload_len;
+    msg->frame_len = 4;
+  } else {
+    frame[1] = 127;
+    for (i = 9; i > 1; i--) {
+      frame[i] = (unsigned char) ((uint64_t) payload_len >> ((9 - i) * 8));
+    }
+    msg->frame_len = 10;
+  }
+  p = msg->buf + msg->frame_len;
+  memcpy(p, topic, topic_len);
+  p[topic_len] = '\n';
+  memcpy(p + topic_len + 1, data, data_len);
+  msg->frame_len += payload_len;
+
+  msg->event = p = msg->buf + msg->frame_len;
+  memcpy(p, "event: ", 7);
+  memcpy(p + 7, topic, topic_len);
+  memcpy(p + 7 + topic_len, "\ndata: ", 7);
+  p += topic_len + 14;
+  for (i = 0; i < data_len; i++) {
+    if (data[i] == '\r' && i + 1 < data_len && data[i + 1] == '\n') {
+      continue;
+    } else if (data[i] == '\r' || data[i] == '\n') {
+      memcpy(p, "\ndata: ", 7);
+      p += 7;
+    } else {
+      *p++ = data[i];
+    }
+  }
+  *p++ = '\n';
+  *p++ = '\n';
+  msg->event_len = p - msg->event;
+
+  return msg;
+}
+
+// Drops references to messages. Must be called with ctx->mutex held.
+static void release_push_messages(struct push_message **queue, int len) {
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (--queue[i]->refcount == 0) {
+      free(queue[i]);
+    }
+  }
+}
+
+int mg_publish(struct mg_context *ctx, const char *topic,
+               const char *data, size_t data_len) {
+  struct push_subscriber *sub;
+  struct push_message *msg, **queue;
+  size_t limit = (size_t) atol(ctx->config[PUSH_QUEUE_SIZE]), size;
+  int n = 0;
+
+  if (!is_valid_push_topic(topic)) {
+    return -1;
+  } else if ((msg = new_push_message(topic, data, data_len)) == NULL) {
+    return -1;
+  } else if (msg->frame_len > limit || msg->event_len > limit) {
+    // Would not fit any queue, and must not disconnect every subscriber.
+    free(msg);
+    return -1;
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (sub = ctx->push_subscribers; sub != NULL; sub = sub->next) {
+    if (sub->overflow || !push_topic_matches(sub->topics, topic)) {
+      continue;
+    }
+    // A subscriber that does not keep up is disconnected, so a slow
+    // page never holds up others or makes memory grow without bound.
+    size = sub->is_websocket ? msg->frame_len : msg->event_len;
+    if (sub->queue_bytes + size > limit) {
+      sub->overflow = 1;
+    } else if (sub->queue_len == sub->queue_size &&
+               (queue = (struct push_message **) realloc(sub->queue,
+                   sizeof(*queue) * (sub->queue_size * 2 + 16))) == NULL) {
+      sub->overflow = 1;
+    } else {
+      if (sub->queue_len == sub->queue_size) {
+        sub->queue = queue;
+        sub->queue_size = sub->queue_size * 2 + 16;
+      }
+      sub->queue[sub->queue_len++] = msg;
+      sub->queue_bytes += size;
+      msg->refcount++;
+      n++;
+    }
+    (void) pthread_cond_signal(&sub->cond);
+  }
+  release_push_messages(&msg, 1);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  return n;
+}
+
+static int is_socket_readable(SOCKET sock) {
+  struct timeval tv;
+  fd_set set;
+
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  FD_ZERO(&set);
+  FD_SET(sock, &set);
+  return select((int) sock + 1, &set, NULL, NULL, &tv) > 0;
+}
+
+// Reads what a subscriber sent. Websocket control frames are answered,
+// anything else is ignored. Returns 0 when the connection is done.
+static int read_push_subscriber(struct mg_connection *conn,
+                                struct push_subscriber *sub) {
+#if defined(USE_WEBSOCKET)
+  unsigned char *buf = (unsigned char *) conn->buf + conn->request_len;
+  size_t queue_size = conn->buf_size - conn->request_len;
+  size_t header_len = 0, data_len, mask_len, body_len;
+  char mask[4], *data;
+  int opcode;
+#endif
+  int n;
+
+  if ((n = pull(NULL, conn, conn->buf + conn->data_len,
+                conn->buf_size - conn->data_len)) <= 0) {
+    return 0;
+  }
+  conn->data_len += n;
+  if (!sub->is_websocket) {
+    conn->data_len = conn->request_len;
+    return 1;
+  }
+
+#if defined(USE_WEBSOCKET)
+  while ((body_len = conn->data_len - conn->request_len) > 0 &&
+         (header_len = parse_websocket_header(buf, body_len, queue_size,
+                                              &data_len, &mask_len)) > 0 &&
+         header_len + data_len <= body_len) {
+    opcode = buf[0] & 0x0f;
+    data = (char *) buf + header_len;
+    memcpy(mask, data - mask_len, mask_len);
+    if (mask_len > 0) {
+      unmask_websocket_data(data, data_len, mask);
+    }
+    if (opcode == WEBSOCKET_OPCODE_CONNECTION_CLOSE) {
+      (void) mg_websocket_write(conn, WEBSOCKET_OPCODE_CONNECTION_CLOSE,
+                                data, data_len >= 2 ? 2 : 0);
+      return 0;
+    } else if (opcode == WEBSOCKET_OPCODE_PING) {
+      (void) mg_websocket_write(conn, WEBSOCKET_OPCODE_PONG, data, data_len);
+    }
+    memmove(buf, data + data_len, body_len - header_len - data_len);
+    conn->data_len -= (int) (header_len + data_len);
+  }
+
+  // Subscribers have no reason to send frames that do not fit the buffer.
+  return header_len == 0 || header_len + data_len <= queue_size;
+#else
+  return 1;
+#endif
+}
+
+// Return 1 if the request has no Origin header, or if Origin is this
+// server. Pages from any web site connect from the loopback address too,
+// so only Origin tells them apart from pages served here.
+static int is_own_origin(const struct mg_connection *conn) {
+  const char *origin = mg_get_header(conn, "Origin"), *host;
+  int port = ntohs(conn->client.lsa.sin.sin_port);
+  char addr[64], expected[80];
+
+  if (origin == NULL) {
+    return 1;
+  } else if ((host = strstr(origin, "://")) == NULL) {
+    return 0;
+  }
+  host += 3;
+  sockaddr_to_string(addr, sizeof(addr), &conn->client.lsa);
+  snprintf(expected, sizeof(expected), strchr(addr, ':') != NULL ?
+           "[%s]:%d" : "%s:%d", addr, port);
+  if (!mg_strcasecmp(host, expected)) {
+    return 1;
+  }
+  snprintf(expected, sizeof(expected), "localhost:%d", port);
+  return !mg_strcasecmp(host, expected);
+}
+
+static void handle_push_subscribe(struct mg_connection *conn) {
+  struct mg_context *ctx = conn->ctx;
+  const char *qs = conn->request_info.query_string;
+  struct push_subscriber *sub, **p;
+  struct push_message **queue;
+  char topics[1024];
+  int i, len, queue_len, done = 0;
+
+  if (!is_own_origin(conn)) {
+    send_http_error(conn, 403, "Forbidden", "%s", "Forbidden");
+    return;
+  } else if (qs == NULL ||
+             (len = mg_get_var(qs, strlen(qs), "topic", topics + 1,
+                               sizeof(topics) - 2)) <= 0) {
+    send_http_error(conn, 400, "Bad Request", "%s", "Missing topic");
+    return;
+  }
+  topics[0] = ',';
+  topics[len + 1] = ',';
+  topics[len + 2] = '\0';
+  if (strstr(topics, ",,") != NULL || strpbrk(topics, "\r\n") != NULL) {
+    send_http_error(conn, 400, "Bad Request", "%s", "Invalid topic");
+    return;
+  } else if ((sub = (struct push_subscriber *)
+              calloc(1, sizeof(*sub) + len + 3)) == NULL) {
+    send_http_error(conn, 500, http_500_error, "%s", "Out of memory");
+    return;
+  }
+  sub->topics = memcpy(sub + 1, topics, len + 3);
+#if defined(USE_WEBSOCKET)
+  sub->is_websocket = is_websocket_request(conn);
+#endif
+  (void) pthread_cond_init(&sub->cond, NULL);
+
+  // Keep at least half of the worker threads for ordinary requests.
+  (void) pthread_mutex_lock(&ctx->mutex);
+  if (ctx->num_push_subscribers < atoi(ctx->config[NUM_THREADS]) / 2) {
+    sub->next = ctx->push_subscribers;
+    ctx->push_subscribers = sub;
+    ctx->num_push_subscribers++;
+  } else {
+    done = 1;
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  conn->must_close = 1;
+  if (done) {
+    send_http_error(conn, 503, "Service Unavailable", "%s",
+                    "Too many subscribers");
+    (void) pthread_cond_destroy(&sub->cond);
+    free(sub);
+    return;
+  }
+
+#if defined(USE_WEBSOCKET)
+  if (sub->is_websocket) {
+    conn->status_code = 101;
+    send_websocket_handshake(conn);
+  } else
+#endif
+  {
+    conn->status_code = 200;
+    mg_printf(conn, "%s", "HTTP/1.1 200 OK\r\n"
+              "Content-Type: text/event-stream\r\n"
+              "Cache-Control: no-cache\r\n"
+              "Connection: close\r\n\r\n");
+  }
+
+  while (!done && !ctx->stop_flag) {
+    (void) pthread_mutex_lock(&ctx->mutex);
+    if (sub->queue_len == 0 && !sub->overflow) {
+      cond_wait_ms(&sub->cond, &ctx->mutex, 100);
+    }
+    queue = sub->queue;
+    queue_len = sub->queue_len;
+    sub->queue = NULL;
+    sub->queue_len = sub->queue_size = 0;
+    sub->queue_bytes = 0;
+    done = sub->overflow;
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    for (i = 0; i < queue_len && !done; i++) {
+      if (sub->is_websocket) {
+        done = mg_write(conn, queue[i]->buf, queue[i]->frame_len) <= 0;
+      } else {
+        done = mg_write(conn, queue[i]->event, queue[i]->event_len) <= 0;
+      }
+    }
+    if (queue_len > 0) {
+      (void) pthread_mutex_lock(&ctx->mutex);
+      release_push_messages(queue, queue_len);
+      (void) pthread_mutex_unlock(&ctx->mutex);
+      free(queue);
+    }
+    if (!done && is_socket_readable(conn->client.sock)) {
+      done = !read_push_subscriber(conn, sub);
+    }
+  }
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  for (p = &ctx->push_subscribers; *p != sub; p = &(*p)->next) {
+  }
+  *p = sub->next;
+  ctx->num_push_subscribers--;
+  release_push_messages(sub->queue, sub->queue_len);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  (void) pthread_cond_destroy(&sub->cond);
+  free(sub->queue);
+  free(sub);
+}
+
+static void handle_push_publish(struct mg_connection *conn) {
+  const char *qs = conn->request_info.query_string;
+  char topic[256], body[32], *data;
+  int64_t limit = atol(conn->ctx->config[PUSH_QUEUE_SIZE]);
+  int n;
+
+  // php-cgi and other local processes send no Origin, browsers always
+  // do for a POST. Pages, even those served here, cannot publish.
+  if (!is_loopback_client(conn) ||
+      mg_get_header(conn, "Origin") != NULL) {
+    send_http_error(conn, 403, "Forbidden", "%s", "Forbidden");
+  } else if (qs == NULL ||
+             mg_get_var(qs, strlen(qs), "topic", topic, sizeof(topic)) <= 0 ||
+             !is_valid_push_topic(topic)) {
+    send_http_error(conn, 400, "Bad Request", "%s", "Invalid topic");
+  } else if (conn->content_len == -1) {
+    send_http_error(conn, 411, "Length Required", "%s", "");
+  } else if (conn->content_len > limit) {
+    send_http_error(conn, 413, "Request Entity Too Large", "%s", "");
+  } else if ((data = (char *) malloc((size_t) conn->content_len + 1)) ==
+             NULL) {
+    send_http_error(conn, 500, http_500_error, "%s", "Out of memory");
+  } else {
+    if (mg_read(conn, data, (size_t) conn->content_len) !=
+        conn->content_len) {
+      send_http_error(conn, 400, "Bad Request", "%s", "Incomplete body");
+    } else if ((n = mg_publish(conn->ctx, topic, data,
+                               (size_t) conn->content_len)) < 0) {
+      // Encoded with the topic, the message exceeds push_queue_size.
+      send_http_error(conn, 413, "Request Entity Too Large", "%s", "");
+    } else {
+      mg_snprintf(conn, body, sizeof(body), "Published to %d\n", n);
+      conn->status_code = 200;
+      mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                "Content-Length: %d\r\nConnection: %s\r\n\r\n%s",
+                (int) strlen(body), suggest_connection_header(conn), body);
+    }
+    free(data);
+  }
+}
+
+static int is_push_request(const struct mg_connection *conn) {
+  const char *push_uri = conn->ctx->config[PUSH_URI];
+  return push_uri != NULL && push_uri[0] != '\0' &&
+    !strcmp(conn->request_info.uri, push_uri);
+}
+
+static void handle_push_request(struct mg_connection *conn) {
+  if (!strcmp(conn->request_info.request_method, "GET")) {
+    handle_push_subscribe(conn);
+  } else if (!strcmp(conn->request_info.request_method, "POST")) {
+    handle_push_publish(conn);
+  } else {
+    send_http_error(conn, 405, "Method Not Allowed", "%s",
+                    "Method Not Allowed");
+  }
+}
+
 static int isbyte(int n) {
   return n >= 0 && n <= 255;
 }
@@ -4574,14 +7448,15 @@ static void handle_request(struct mg_connection *conn) {
   char path[PATH_MAX];
   int uri_len, ssl_index;
   struct file file = STRUCT_FILE_INITIALIZER;
+  double stat_start;
 
   if ((conn->request_info.query_string = strchr(ri->uri, '?')) != NULL) {
     * ((char *) conn->request_info.query_string++) = '\0';
   }
-  uri_len = (int) strlen(ri->uri);
-  mg_url_decode(ri->uri, uri_len, (char *) ri->uri, uri_len + 1, 0);
-  remove_double_dots_and_double_slashes((char *) ri->uri);
+  uri_len = normalize_uri((char *) ri->uri);
+  stat_start = trace_clock(conn->ctx);
   convert_uri_to_file_name(conn, path, sizeof(path), &file);
+  trace_event(conn, "stat", stat_start);
   conn->throttle = set_throttle(conn->ctx->config[THROTTLE],
                                 get_remote_ip(conn), ri->uri);
   
@@ -4597,20 +7472,29 @@ static void handle_request(struct mg_connection *conn) {
   } else if (conn->ctx->callbacks.begin_request != NULL &&
       conn->ctx->callbacks.begin_request(conn)) {
     // Do nothing, callback has served the request
+  } else if (is_push_request(conn)) {
+    handle_push_request(conn);
 #if defined(USE_WEBSOCKET)
-  } else if (is_websocket_request(conn)) {
+  } else if (is_websocket_request(conn) &&
+             (conn->ctx->callbacks.websocket_connect != NULL ||
+              conn->ctx->callbacks.websocket_ready != NULL ||
+              conn->ctx->callbacks.websocket_data != NULL)) {
     handle_websocket_request(conn);
 #endif
   } else if (!strcmp(ri->request_method, "OPTIONS")) {
     send_options(conn);
+  } else if (!strcmp(ri->request_method, "PURGE")) {
+    handle_purge_request(conn);
   } else if (conn->ctx->config[DOCUMENT_ROOT] == NULL) {
     send_http_error(conn, 404, "Not Found", "Not Found");
   } else if (is_put_or_delete_request(conn) &&
              (is_authorized_for_put(conn) != 1)) {
     send_authorization_request(conn);
   } else if (!strcmp(ri->request_method, "PUT")) {
+    clear_route_cache(conn->ctx);
     put_file(conn, path);
   } else if (!strcmp(ri->request_method, "MKCOL")) {
+    clear_route_cache(conn->ctx);
     mkcol(conn, path);
   } else if (!strcmp(ri->request_method, "DELETE")) {
       struct de de;
@@ -4645,7 +7529,7 @@ static void handle_request(struct mg_connection *conn) {
   } else if (file.is_directory &&
              !substitute_index_file(conn, path, sizeof(path), &file)) {
     if (!mg_strcasecmp(conn->ctx->config[ENABLE_DIRECTORY_LISTING], "yes")) {
-      handle_directory_request(conn, path);
+      handle_directory_request(conn, path, &file);
     } else {
       send_http_error(conn, 403, "Directory Listing Denied",
           "Directory listing denied");
@@ -4655,23 +7539,21 @@ static void handle_request(struct mg_connection *conn) {
     handle_lsp_request(conn, path, &file, NULL);
 #endif
 #if !defined(NO_CGI)
-  } else if (match_prefix(conn->ctx->config[CGI_EXTENSIONS],
-                          strlen(conn->ctx->config[CGI_EXTENSIONS]),
-                          path) > 0) {
+  } else if (match_option(conn->ctx, CGI_EXTENSIONS, path) > 0) {
     if (strcmp(ri->request_method, "POST") &&
         strcmp(ri->request_method, "HEAD") &&
         strcmp(ri->request_method, "GET")) {
       send_http_error(conn, 501, "Not Implemented",
                       "Method %s is not implemented", ri->request_method);
     } else {
-      handle_cgi_request(conn, path);
+      handle_cgi_request_cached(conn, path);
     }
 #endif // !NO_CGI
   } else if (match_prefix(conn->ctx->config[SSI_EXTENSIONS],
                           strlen(conn->ctx->config[SSI_EXTENSIONS]),
                           path) > 0) {
-    handle_ssi_file_request(conn, path);
-  } else if (is_not_modified(conn, &file)) {
+    handle_ssi_file_request(conn, path, &file);
+  } else if (is_not_modified(conn, path, &file)) {
     send_http_error(conn, 304, "Not Modified", "%s", "");
   } else {
     handle_file_request(conn, path, &file);
@@ -5211,6 +8093,7 @@ static void process_new_connection(struct mg_connection *conn) {
   struct mg_request_info *ri = &conn->request_info;
   int keep_alive_enabled, keep_alive, discard_len;
   char ebuf[100];
+  double read_start;
 
   keep_alive_enabled = !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes");
   keep_alive = 0;
@@ -5219,6 +8102,8 @@ static void process_new_connection(struct mg_connection *conn) {
   // to crule42.
   conn->data_len = 0;
   do {
+    // On keep-alive connections this includes waiting for the request.
+    read_start = trace_clock(conn->ctx);
     if (!getreq(conn, ebuf, sizeof(ebuf))) {
       send_http_error(conn, 500, "Server Error", "%s", ebuf);
       conn->must_close = 1;
@@ -5232,9 +8117,23 @@ static void process_new_connection(struct mg_connection *conn) {
     }
 
     if (ebuf[0] == '\0') {
+      trace_event(conn, "read request", read_start);
+      memset(&conn->stats, 0, sizeof(conn->stats));
+      conn->start_time = mg_clock();
+      conn->first_byte_time = 0;
       handle_request(conn);
+      conn->stats.wall_time = mg_clock() - conn->start_time;
+      if (conn->ctx->callbacks.trace_event != NULL) {
+        if (conn->first_byte_time != 0) {
+          conn->ctx->callbacks.trace_event(conn, "first byte",
+                                           conn->start_time,
+                                           conn->first_byte_time);
+        }
+        trace_event(conn, "request", conn->start_time);
+      }
       if (conn->ctx->callbacks.end_request != NULL) {
-        conn->ctx->callbacks.end_request(conn, conn->status_code);
+        conn->ctx->callbacks.end_request(conn, conn->status_code,
+                                         &conn->stats);
       }
       log_access(conn);
     }
@@ -5311,6 +8210,10 @@ static void *worker_thread(void *thread_func_param) {
     // sq_empty condvar to wake up the master waiting in produce_socket()
     while (consume_socket(ctx, &conn->client)) {
       conn->birth_time = time(NULL);
+      if (ctx->callbacks.trace_event != NULL) {
+        ctx->callbacks.trace_event(NULL, "queue wait",
+                                   conn->client.queued_time, mg_clock());
+      }
 
       // Fill in IP, port info early so even if SSL setup below fails,
       // error handler would have the corresponding info.
@@ -5385,6 +8288,7 @@ static void accept_new_connection(const struct socket *listener,
   char src_addr[IP_ADDR_STR_LEN];
   socklen_t len = sizeof(so.rsa);
   int on = 1;
+  double start = trace_clock(ctx);
 
   if ((so.sock = accept(listener->sock, &so.rsa.sa, &len)) == INVALID_SOCKET) {
   } else if (!check_acl(ctx, ntohl(* (uint32_t *) &so.rsa.sin.sin_addr))) {
@@ -5406,6 +8310,10 @@ static void accept_new_connection(const struct socket *listener,
     // Thanks to Igor Klopov who suggested the patch.
     setsockopt(so.sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on, sizeof(on));
     set_sock_timeout(so.sock, atoi(ctx->config[REQUEST_TIMEOUT]));
+    so.queued_time = trace_clock(ctx);
+    if (ctx->callbacks.trace_event != NULL) {
+      ctx->callbacks.trace_event(NULL, "accept", start, so.queued_time);
+    }
     produce_socket(ctx, &so);
   }
 }
@@ -5463,9 +8371,11 @@ static void *master_thread(void *thread_func_param) {
 
   // All threads exited, no sync is needed. Destroy mutex and condvars
   (void) pthread_mutex_destroy(&ctx->mutex);
+  (void) pthread_mutex_destroy(&ctx->manifest_mutex);
   (void) pthread_cond_destroy(&ctx->cond);
   (void) pthread_cond_destroy(&ctx->sq_empty);
   (void) pthread_cond_destroy(&ctx->sq_full);
+  (void) pthread_cond_destroy(&ctx->cgi_flight_done);
 
 #if !defined(NO_SSL)
   uninitialize_ssl(ctx);
@@ -5480,6 +8390,8 @@ static void *master_thread(void *thread_func_param) {
 }
 
 static void free_context(struct mg_context *ctx) {
+  struct content_hash *entry;
+  struct route_cache_entry *route;
   int i;
 
   // Deallocate config parameters
@@ -5499,6 +8411,47 @@ static void free_context(struct mg_context *ctx) {
   }
 #endif // !NO_SSL
 
+  free(ctx->cgi_stats);
+
+  for (i = 0; i < ctx->num_content_hash_buckets; i++) {
+    while ((entry = ctx->content_hashes[i]) != NULL) {
+      ctx->content_hashes[i] = entry->next;
+      free(entry);
+    }
+  }
+  free(ctx->content_hashes);
+  free(ctx->cache_rules);
+
+  if (ctx->cgi_cache != NULL) {
+    while (ctx->cgi_cache_head != NULL) {
+      remove_cgi_cache_entry(ctx, ctx->cgi_cache_head);
+    }
+    free(ctx->cgi_cache);
+  }
+
+  while (ctx->dir_listings != NULL) {
+    uncache_dir_listing(ctx, &ctx->dir_listings);
+  }
+
+  while (ctx->ssi_templates != NULL) {
+    uncache_ssi_template(ctx, &ctx->ssi_templates);
+  }
+
+  if (ctx->route_cache != NULL) {
+    for (i = 0; i < ROUTE_CACHE_BUCKETS; i++) {
+      while ((route = ctx->route_cache[i]) != NULL) {
+        ctx->route_cache[i] = route->next;
+        free(route);
+      }
+    }
+    free(ctx->route_cache);
+  }
+
+  for (i = 0; i < ctx->num_retired_config; i++) {
+    free(ctx->retired_config[i]);
+  }
+  free(ctx->retired_config);
+
   // Deallocate context itself
   free(ctx);
 }
@@ -5533,6 +8486,35 @@ void mg_stop_immediately(struct mg_context *ctx) {
 #endif // _WIN32
 }
 
+long mg_get_num_cgi_cancelled(struct mg_context *ctx) {
+  long n;
+  (void) pthread_mutex_lock(&ctx->mutex);
+  n = ctx->num_cgi_cancelled;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  return n;
+}
+
+void mg_get_cgi_cancelled_time(struct mg_context *ctx, double *wall_time,
+                               double *cpu_time) {
+  (void) pthread_mutex_lock(&ctx->mutex);
+  *wall_time = ctx->cgi_cancelled_wall_time;
+  *cpu_time = ctx->cgi_cancelled_cpu_time;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+int mg_get_cgi_script_stats(struct mg_context *ctx,
+                            struct mg_cgi_script_stats *stats,
+                            int max_entries) {
+  int n;
+  (void) pthread_mutex_lock(&ctx->mutex);
+  n = ctx->num_cgi_stats < max_entries ? ctx->num_cgi_stats : max_entries;
+  if (n > 0) {
+    memcpy(stats, ctx->cgi_stats, n * sizeof(stats[0]));
+  }
+  (void) pthread_mutex_unlock(&ctx->mutex);
+  return n;
+}
+
 int mg_get_listening_port(struct mg_context *ctx) {
     int i;
     int port = 0;
@@ -5609,14 +8591,39 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
   // Ignore SIGPIPE signal, so if browser cancels the request, it
   // won't kill the whole process.
   (void) signal(SIGPIPE, SIG_IGN);
-  // Also ignoring SIGCHLD to let the OS to reap zombies properly.
-  (void) signal(SIGCHLD, SIG_IGN);
+  // SIGCHLD is not ignored: CGI processes are reaped with wait4() to get
+  // their exit status and resource usage, see reap_cgi_process().
 #endif // !_WIN32
 
   (void) pthread_mutex_init(&ctx->mutex, NULL);
+  (void) pthread_mutex_init(&ctx->manifest_mutex, NULL);
   (void) pthread_cond_init(&ctx->cond, NULL);
   (void) pthread_cond_init(&ctx->sq_empty, NULL);
   (void) pthread_cond_init(&ctx->sq_full, NULL);
+  (void) pthread_cond_init(&ctx->cgi_flight_done, NULL);
+
+  load_content_manifest(ctx);
+  if (ctx->config[CACHE_RULES] != NULL) {
+    ctx->cache_rules = compile_cache_rules(ctx->config[CACHE_RULES]);
+  }
+  if (atol(ctx->config[CGI_CACHE_SIZE]) > 0) {
+    ctx->cgi_cache = (struct cgi_cache_entry **)
+      calloc(CGI_CACHE_BUCKETS, sizeof(ctx->cgi_cache[0]));
+  }
+  if (atoi(ctx->config[ROUTE_CACHE_SIZE]) > 0 &&
+      ctx->config[DOCUMENT_ROOT] != NULL) {
+    ctx->route_cache = (struct route_cache_entry **)
+      calloc(ROUTE_CACHE_BUCKETS, sizeof(ctx->route_cache[0]));
+#if defined(_WIN32)
+    if (ctx->route_cache != NULL) {
+      if (mg_start_thread(route_cache_watcher, ctx) != 0) {
+        cry(fc(ctx), "Cannot start route cache watcher: %ld", (long) ERRNO);
+      } else {
+        ctx->num_threads++;
+      }
+    }
+#endif // _WIN32
+  }
 
   // Start master (listening) thread
   mg_start_thread(master_thread, ctx);
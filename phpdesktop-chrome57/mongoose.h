@@ -26,6 +26,7 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -56,6 +57,48 @@ struct mg_request_info {
 };
 
 
+// Statistics of a processed request, passed to end_request() callback.
+// The cgi_* fields are set only if is_cgi is 1.
+struct mg_request_stats {
+  double wall_time;           // Seconds spent processing the request
+  int is_cgi;                 // 1 if request was served by a CGI program
+  int cgi_exit_status;        // Exit code of CGI program, -1 if killed
+  double cgi_user_time;       // CPU seconds CGI program spent in user mode
+  double cgi_system_time;     // CPU seconds CGI program spent in kernel mode
+  long cgi_peak_rss_kb;       // Peak resident set size of CGI program, KB
+  int cgi_cache_hit;          // 1 if served from the CGI response cache
+  int cgi_coalesced;          // 1 if served with a concurrent request's reply
+};
+
+
+// CGI resource usage aggregated per SCRIPT_NAME, see
+// mg_get_cgi_script_stats().
+struct mg_cgi_script_stats {
+  char script_name[256];      // SCRIPT_NAME, e.g. "/index.php"
+  long num_requests;          // Number of finished requests
+  long num_cancelled;         // Requests killed because client hung up
+  double total_wall_time;     // Sum of request wall times, seconds
+  double max_wall_time;       // Longest request wall time, seconds
+  double total_user_time;     // Sum of CPU time in user mode, seconds
+  double total_system_time;   // Sum of CPU time in kernel mode, seconds
+  long max_peak_rss_kb;       // Highest peak resident set size, KB
+};
+
+
+// CGI response cache counters, see mg_get_cgi_cache_stats().
+struct mg_cgi_cache_stats {
+  long hits;                  // Requests served from the cache
+  long misses;                // Cacheable requests that ran the script
+  long stores;                // Responses added to the cache
+  long evictions;             // Entries removed to stay within the size
+  long purged;                // Removed by purging or by a POST/PUT/DELETE
+  long num_entries;           // Entries in the cache
+  long num_bytes;             // Bytes used by the entries
+  long coalesced;             // Requests served with a concurrent reply
+  long coalesce_timeouts;     // Requests that stopped waiting and ran
+};
+
+
 // This structure needs to be passed to mg_start(), to let mongoose know
 // which callbacks to invoke. For detailed description, see
 // https://github.com/valenok/mongoose/blob/master/UserManual.md
@@ -69,7 +112,8 @@ struct mg_callbacks {
   int  (*begin_request)(struct mg_connection *);
 
   // Called when mongoose has finished processing request.
-  void (*end_request)(const struct mg_connection *, int reply_status_code);
+  void (*end_request)(const struct mg_connection *, int reply_status_code,
+                      const struct mg_request_stats *stats);
 
   // Called when mongoose is about to log a message. If callback returns
   // non-zero, mongoose does not log anything.
@@ -127,6 +171,24 @@ struct mg_callbacks {
   // Parameters:
   //   status: HTTP error status code.
   int  (*http_error)(struct mg_connection *, int status);
+
+  // Called when a phase of handling a connection has finished, on the
+  // thread that ran it. Phases are "accept", "queue wait",
+  // "read request", "stat", "cgi spawn", "first byte" and "request".
+  // If this callback is NULL, mongoose does not take the timestamps.
+  // Parameters:
+  //   conn: NULL for "accept" and "queue wait".
+  //   start, end: monotonic time in seconds, QueryPerformanceCounter()
+  //               on Windows.
+  void (*trace_event)(const struct mg_connection *, const char *name,
+                      double start, double end);
+
+  // Same as open_file, and also reports the modification time of the
+  // in-memory file, used for Last-Modified and Etag headers. If set,
+  // open_file is not called.
+  const char * (*open_file_with_time)(const struct mg_connection *,
+                                      const char *path, size_t *data_len,
+                                      time_t *modification_time);
 };
 
 // Start web server.
@@ -168,16 +230,59 @@ void mg_stop(struct mg_context *);
 void mg_stop_immediately(struct mg_context *);
 int mg_get_listening_port(struct mg_context *);
 
+// Return number of CGI requests whose scripts were terminated early,
+// because the client closed the connection before the output was sent.
+long mg_get_num_cgi_cancelled(struct mg_context *);
+
+// Sum of the wall time those CGI requests took until the script was
+// terminated, and of the user and kernel CPU time the scripts used, in
+// seconds.
+void mg_get_cgi_cancelled_time(struct mg_context *, double *wall_time,
+                               double *cpu_time);
+
+// Copy CGI resource usage aggregated per SCRIPT_NAME into the stats array.
+// At most max_entries entries are copied. Statistics are kept for at most
+// 1024 distinct scripts.
+//
+// Return:
+//   number of entries copied.
+int mg_get_cgi_script_stats(struct mg_context *,
+                            struct mg_cgi_script_stats *stats,
+                            int max_entries);
+
+// Copy CGI response cache and request coalescing counters into stats.
+void mg_get_cgi_cache_stats(struct mg_context *,
+                            struct mg_cgi_cache_stats *stats);
+
+// Remove cached CGI responses whose URI starts with uri_prefix, or all
+// of them if uri_prefix is NULL. Clients on the local machine may also
+// send a "PURGE <uri_prefix>" request.
+//
+// Return:
+//   number of responses removed.
+int mg_purge_cgi_cache(struct mg_context *, const char *uri_prefix);
+
 
 // Get the value of particular configuration parameter.
-// The value returned is read-only. Mongoose does not allow changing
-// configuration at run time.
+// The value returned is read-only. Only options listed in mg_set_option()
+// may change at run time.
 // If given parameter name is not valid, NULL is returned. For valid
 // names, return value is guaranteed to be non-NULL. If parameter is not
 // set, zero-length string is returned.
 const char *mg_get_option(const struct mg_context *ctx, const char *name);
 
 
+// Change configuration parameter of a running server, without dropping
+// connections. Requests that already started may finish with the old
+// value. Only cgi_pattern, index_files, extra_mime_types,
+// hide_files_patterns and 404_handler can be changed.
+//
+// Return:
+//   1 on success, 0 if the option is unknown or cannot be changed.
+int mg_set_option(struct mg_context *ctx, const char *name,
+                  const char *value);
+
+
 // Return array of strings that represent valid configuration options.
 // For each option, option name and default value is returned, i.e. the
 // number of entries in the array equals to number_of_options x 2.
@@ -237,6 +342,22 @@ enum {
 };
 
 
+// Publish a message to subscribers of a topic on the push_uri endpoint.
+// Pages subscribe with "GET <push_uri>?topic=a,b", as a websocket or an
+// EventSource, and must have been served by this server (Origin). Websocket
+// messages are the topic, a newline and the data, events have the topic
+// as event type. Local processes publish with "POST <push_uri>?topic=a",
+// the body being the message, and without an Origin header, so that web
+// pages cannot publish. Thread safe.
+//
+// Return:
+//  -1  on error, if topic is empty or contains a comma or newline, or if
+//      the encoded message is larger than push_queue_size
+//  >=0 number of subscribers the message was queued for
+int mg_publish(struct mg_context *ctx, const char *topic,
+               const char *data, size_t data_len);
+
+
 // Macros for enabling compiler-specific checks for printf-like arguments.
 #undef PRINTF_FORMAT_STRING
 #if defined(_MSC_VER) && _MSC_VER >= 1400
@@ -11,14 +11,12 @@ extern wchar_t g_windowClassName[256]; // main.cpp
 extern HINSTANCE g_hInstance; // main.cpp
 
 HWND CreatePopupWindow(HWND parentHandle) {
-    json_value* appSettings = GetApplicationSettings();
+    const ApplicationSettings& settings = GetSettings();
     bool center_relative_to_parent =
-            (*appSettings)["popup_window"]["center_relative_to_parent"];
-    bool dpi_aware = (*appSettings)["application"]["dpi_aware"];
-    int default_width = static_cast<long>(\
-            (*appSettings)["popup_window"]["default_size"][0]);
-    int default_height = static_cast<long>(\
-            (*appSettings)["popup_window"]["default_size"][1]);
+            settings.popup_window.center_relative_to_parent;
+    bool dpi_aware = settings.application.dpi_aware;
+    int default_width = settings.popup_window.default_size[0];
+    int default_height = settings.popup_window.default_size[1];
     int width = CW_USEDEFAULT;
     int height = CW_USEDEFAULT;
     if (default_width && default_height) {
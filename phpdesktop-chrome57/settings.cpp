@@ -3,12 +3,25 @@
 // Website: http://code.google.com/p/phpdesktop/
 
 #include "defines.h"
+#include "settings.h"
+#include <Windows.h>
+#include <crtdbg.h> // _ASSERT() macro
 #include "executable.h"
 #include "file_utils.h"
 #include "json.h"
 #include "log.h"
+#include "settings_snapshot.h"
+#include "string_utils.h"
+
+// Editors often save in several writes, reload once they settle.
+#define SETTINGS_RELOAD_DELAY_MS 300
 
 std::string g_applicationSettingsError = "";
+std::vector<std::string> g_settingsProblems;
+ApplicationSettings* volatile g_settings = 0;
+std::vector<SettingsListener> g_settingsListeners;
+HANDLE g_settingsWatcherThread = NULL;
+HANDLE g_settingsWatcherStopEvent = NULL;
 
 json_value* GetApplicationSettings() {
     static json_value* ret = new json_value();
@@ -28,6 +41,7 @@ json_value* GetApplicationSettings() {
 
     json_settings settings;
     memset(&settings, 0, sizeof(json_settings));
+    settings.settings = json_enable_key_index;
     char error[256];
     json_value* json_parsed = json_parse_ex(&settings, contents.c_str(),
                                             &error[0]);
@@ -43,3 +57,441 @@ json_value* GetApplicationSettings() {
 std::string GetApplicationSettingsError() {
     return g_applicationSettingsError;
 }
+
+// Reads typed values from one object in settings.json. Values with
+// a wrong type are reported and replaced with the default, keys that
+// were never read are reported by CheckUnknownKeys().
+class SettingsSection {
+public:
+    SettingsSection(const json_value& value, const std::string& path)
+            : value_(value), path_(path) {
+        if (value_.type != json_none && value_.type != json_object) {
+            Problem(path_, "should be an object, ignored");
+        }
+    }
+    SettingsSection Section(const char* name) {
+        return SettingsSection(Get(name, json_object, "an object"),
+                               KeyPath(name));
+    }
+    void Read(const char* name, bool* out) {
+        *out = Get(name, json_boolean, "a boolean");
+    }
+    void Read(const char* name, std::string* out) {
+        *out = static_cast<const char*>(Get(name, json_string, "a string"));
+    }
+    void Read(const char* name, long* out, long min, long max) {
+        const json_value& value = Get(name, json_integer, "an integer");
+        *out = value;
+        if (*out < min || *out > max) {
+            Problem(KeyPath(name), "is out of range "
+                    + IntToString(min) + ".." + IntToString(max)
+                    + ", using default");
+            *out = 0;
+        }
+    }
+    void Read(const char* name, long out[2]) {
+        const json_value& value = Get(name, json_array, "an array");
+        out[0] = value[0];
+        out[1] = value[1];
+        if (out[0] < 0 || out[1] < 0) {
+            Problem(KeyPath(name), "should not be negative, using default");
+            out[0] = 0;
+            out[1] = 0;
+        }
+    }
+    void Read(const char* name, std::vector<std::string>* out) {
+        const json_value& value = Get(name, json_array, "an array");
+        out->clear();
+        if (value.type != json_array)
+            return;
+        for (unsigned int i = 0; i < value.u.array.length; i++) {
+            const json_value& item = value[i];
+            if (item.type != json_string) {
+                Problem(KeyPath(name), "should contain only strings, skipped"
+                        " value at index " + IntToString(i));
+                continue;
+            }
+            out->push_back(static_cast<const char*>(item));
+        }
+    }
+    void Read(const char* name,
+              std::vector<std::pair<std::string, std::string> >* out) {
+        const json_value& value = Get(name, json_object, "an object");
+        out->clear();
+        if (value.type != json_object)
+            return;
+        for (unsigned int i = 0; i < value.u.object.length; i++) {
+            const json_value& item = *value.u.object.values[i].value;
+            if (item.type != json_string) {
+                Problem(KeyPath(name) + "." + value.u.object.values[i].name,
+                        "should be a string, value ignored");
+                continue;
+            }
+            out->push_back(std::make_pair(
+                    std::string(value.u.object.values[i].name),
+                    std::string(static_cast<const char*>(item))));
+        }
+    }
+    // Marks a key as known without reading it, for values with
+    // a non-uniform layout that the caller decodes itself.
+    const json_value& Raw(const char* name) {
+        known_.push_back(name);
+        return value_[name];
+    }
+    void CheckUnknownKeys() {
+        if (value_.type != json_object)
+            return;
+        for (unsigned int i = 0; i < value_.u.object.length; i++) {
+            const char* name = value_.u.object.values[i].name;
+            bool known = false;
+            for (size_t j = 0; j < known_.size(); j++) {
+                if (known_[j] == name) {
+                    known = true;
+                    break;
+                }
+            }
+            if (!known) {
+                Problem(KeyPath(name), "is not a known option, ignored");
+            }
+        }
+    }
+private:
+    const json_value& Get(const char* name, json_type type,
+                          const char* type_name) {
+        const json_value& value = Raw(name);
+        if (value.type == json_none || value.type == type
+                || (type == json_integer && value.type == json_double)) {
+            return value;
+        }
+        Problem(KeyPath(name), std::string("should be ") + type_name
+                + ", using default");
+        return json_value_none;
+    }
+    std::string KeyPath(const char* name) const {
+        return path_.empty() ? std::string(name) : path_ + "." + name;
+    }
+    static void Problem(const std::string& path, const std::string& what) {
+        g_settingsProblems.push_back("settings.json: \"" + path + "\" "
+                                     + what);
+    }
+    const json_value& value_;
+    std::string path_;
+    std::vector<std::string> known_;
+};
+
+static bool IsOneOf(const std::string& value, const char* const* allowed) {
+    for (; *allowed; allowed++) {
+        if (value == *allowed)
+            return true;
+    }
+    return false;
+}
+
+static void LoadSettings(const json_value& root, ApplicationSettings* s) {
+    SettingsSection top(root, "");
+
+    SettingsSection application = top.Section("application");
+    application.Read("single_instance_guid",
+                     &s->application.single_instance_guid);
+    application.Read("dpi_aware", &s->application.dpi_aware);
+    application.CheckUnknownKeys();
+
+    SettingsSection debugging = top.Section("debugging");
+    debugging.Read("show_console", &s->debugging.show_console);
+    debugging.Read("subprocess_show_console",
+                   &s->debugging.subprocess_show_console);
+    debugging.Read("log_level", &s->debugging.log_level);
+    debugging.Read("log_file", &s->debugging.log_file);
+    debugging.Read("trace_file", &s->debugging.trace_file);
+    debugging.Read("trace_ring_buffer", &s->debugging.trace_ring_buffer);
+    debugging.Read("trace_buffer_size", &s->debugging.trace_buffer_size,
+                   0, 10000000);
+    debugging.CheckUnknownKeys();
+    static const char* const log_levels[] = {"", "ERROR", "WARNING", "INFO",
+            "DEBUG", "DEBUG1", "DEBUG2", "DEBUG3", "DEBUG4", 0};
+    if (!IsOneOf(s->debugging.log_level, log_levels)) {
+        g_settingsProblems.push_back("settings.json: \"debugging.log_level\""
+                " is not a known log level, using default");
+        s->debugging.log_level = "";
+    }
+
+    SettingsSection main_window = top.Section("main_window");
+    main_window.Read("title", &s->main_window.title);
+    main_window.Read("icon", &s->main_window.icon);
+    main_window.Read("default_size", s->main_window.default_size);
+    main_window.Read("minimum_size", s->main_window.minimum_size);
+    main_window.Read("maximum_size", s->main_window.maximum_size);
+    main_window.Read("disable_maximize_button",
+                     &s->main_window.disable_maximize_button);
+    main_window.Read("center_on_screen", &s->main_window.center_on_screen);
+    main_window.Read("start_maximized", &s->main_window.start_maximized);
+    main_window.Read("start_fullscreen", &s->main_window.start_fullscreen);
+    main_window.Read("always_on_top", &s->main_window.always_on_top);
+    main_window.Read("minimize_to_tray", &s->main_window.minimize_to_tray);
+    main_window.Read("minimize_to_tray_message",
+                     &s->main_window.minimize_to_tray_message);
+    main_window.CheckUnknownKeys();
+
+    SettingsSection popup_window = top.Section("popup_window");
+    popup_window.Read("icon", &s->popup_window.icon);
+    popup_window.Read("fixed_title", &s->popup_window.fixed_title);
+    popup_window.Read("center_relative_to_parent",
+                      &s->popup_window.center_relative_to_parent);
+    popup_window.Read("default_size", s->popup_window.default_size);
+    popup_window.CheckUnknownKeys();
+
+    SettingsSection web_server = top.Section("web_server");
+    // listen_on is [ip, port] where port is a number or a string.
+    const json_value& listen_on = web_server.Raw("listen_on");
+    s->web_server.listen_on_ip = static_cast<const char*>(listen_on[0]);
+    s->web_server.listen_on_port = static_cast<const char*>(listen_on[1]);
+    if (s->web_server.listen_on_port.empty()) {
+        long port = listen_on[1];
+        if (port < 0 || port > 65535) {
+            g_settingsProblems.push_back("settings.json: \"web_server."
+                    "listen_on\" port is out of range 0..65535,"
+                    " using default");
+        } else if (port) {
+            s->web_server.listen_on_port = IntToString(port);
+        }
+    }
+    web_server.Read("www_directory", &s->web_server.www_directory);
+    web_server.Read("index_files", &s->web_server.index_files);
+    web_server.Read("cgi_interpreter", &s->web_server.cgi_interpreter);
+    web_server.Read("cgi_extensions", &s->web_server.cgi_extensions);
+    web_server.Read("cgi_temp_dir", &s->web_server.cgi_temp_dir);
+    web_server.Read("404_handler", &s->web_server.handler_404);
+    web_server.Read("hide_files", &s->web_server.hide_files);
+    web_server.Read("mime_types", &s->web_server.mime_types);
+    web_server.Read("cache_rules", &s->web_server.cache_rules);
+    web_server.Read("cache_fingerprinted_urls",
+                    &s->web_server.cache_fingerprinted_urls);
+    web_server.Read("www_archive", &s->web_server.www_archive);
+    web_server.Read("www_archive_extract",
+                    &s->web_server.www_archive_extract);
+    web_server.Read("cgi_cache_size_mb", &s->web_server.cgi_cache_size_mb,
+                    0, 1024);
+    web_server.Read("coalesce_urls", &s->web_server.coalesce_urls);
+    web_server.Read("push_url", &s->web_server.push_url);
+    web_server.CheckUnknownKeys();
+
+    SettingsSection chrome = top.Section("chrome");
+    chrome.Read("log_file", &s->chrome.log_file);
+    chrome.Read("log_severity", &s->chrome.log_severity);
+    chrome.Read("cache_path", &s->chrome.cache_path);
+    chrome.Read("external_drag", &s->chrome.external_drag);
+    chrome.Read("external_navigation", &s->chrome.external_navigation);
+    chrome.Read("reload_page_F5", &s->chrome.reload_page_F5);
+    chrome.Read("devtools_F12", &s->chrome.devtools_F12);
+    // A value of -1 disables remote debugging, 0 picks a random port.
+    chrome.Read("remote_debugging_port", &s->chrome.remote_debugging_port,
+                -1, 65535);
+    chrome.Read("command_line_switches", &s->chrome.command_line_switches);
+    chrome.Read("enable_downloads", &s->chrome.enable_downloads);
+    SettingsSection context_menu = chrome.Section("context_menu");
+    context_menu.Read("enable_menu", &s->chrome.context_menu.enable_menu);
+    context_menu.Read("navigation", &s->chrome.context_menu.navigation);
+    context_menu.Read("print", &s->chrome.context_menu.print);
+    context_menu.Read("view_source", &s->chrome.context_menu.view_source);
+    context_menu.Read("reload_page", &s->chrome.context_menu.reload_page);
+    context_menu.Read("open_in_external_browser",
+                      &s->chrome.context_menu.open_in_external_browser);
+    context_menu.Read("devtools", &s->chrome.context_menu.devtools);
+    context_menu.CheckUnknownKeys();
+    chrome.CheckUnknownKeys();
+    static const char* const log_severities[] = {"", "default", "verbose",
+            "info", "warning", "error", "disable", 0};
+    if (!IsOneOf(s->chrome.log_severity, log_severities)) {
+        g_settingsProblems.push_back("settings.json: \"chrome.log_severity\""
+                " is not a known severity, using default");
+        s->chrome.log_severity = "";
+    }
+
+    top.CheckUnknownKeys();
+}
+
+const ApplicationSettings& GetSettings() {
+    if (!g_settings) {
+        // First call happens on the main thread during startup.
+        ApplicationSettings* settings = new ApplicationSettings();
+        LoadSettings(*GetApplicationSettings(), settings);
+        g_settings = settings;
+    }
+    return *g_settings;
+}
+
+void SetSettings(ApplicationSettings* settings) {
+    _ASSERT(!g_settings);
+    g_settings = settings;
+}
+
+void LogSettingsProblems() {
+    GetSettings();
+    for (size_t i = 0; i < g_settingsProblems.size(); i++) {
+        LOG_WARNING << g_settingsProblems[i];
+    }
+    g_settingsProblems.clear();
+}
+
+void AddSettingsListener(SettingsListener listener) {
+    _ASSERT(!g_settingsWatcherThread);
+    g_settingsListeners.push_back(listener);
+}
+
+static std::string GetSettingsSectionNames(int sections) {
+    static const char* names[] = {"application", "debugging", "main_window",
+            "popup_window", "web_server", "chrome"};
+    std::string result;
+    for (int i = 0; i < static_cast<int>(_countof(names)); i++) {
+        if (sections & (1 << i)) {
+            if (result.length())
+                result.append(", ");
+            result.append(names[i]);
+        }
+    }
+    return result;
+}
+
+// Runs on the watcher thread. Parsing errors keep the current settings.
+static void ReloadSettings() {
+    std::string settingsFile = GetExecutableDirectory() + "\\settings.json";
+    std::string contents = GetFileContents(settingsFile);
+    if (contents.empty()) {
+        // Probably truncated while being saved, the next change
+        // notification will try again.
+        LOG_DEBUG << "Reloading settings.json: file is empty";
+        return;
+    }
+    json_settings parser_settings;
+    memset(&parser_settings, 0, sizeof(json_settings));
+    parser_settings.settings = json_enable_key_index;
+    char error[256];
+    json_value* json = json_parse_ex(&parser_settings, contents.c_str(),
+                                     &error[0]);
+    if (json == 0) {
+        LOG_WARNING << "Reloading settings.json failed, keeping current "
+                       "settings: " << error;
+        return;
+    }
+    ApplicationSettings* settings = new ApplicationSettings();
+    LoadSettings(*json, settings);
+    json_value_free(json);
+    LogSettingsProblems();
+
+    const ApplicationSettings* old_settings = g_settings;
+    int changed = GetChangedSettingsSections(*old_settings, *settings);
+    if (!changed) {
+        LOG_DEBUG << "Reloading settings.json: nothing changed";
+        delete settings;
+        return;
+    }
+    // The old snapshot is not freed, other threads may still use it.
+    InterlockedExchangePointer(
+            reinterpret_cast<void* volatile*>(&g_settings), settings);
+    LOG_INFO << "Reloaded settings.json, changed sections: "
+             << GetSettingsSectionNames(changed);
+    for (size_t i = 0; i < g_settingsListeners.size(); i++) {
+        g_settingsListeners[i](*old_settings, *settings, changed);
+    }
+}
+
+static DWORD WINAPI SettingsWatcherThread(LPVOID param) {
+    std::wstring directory = Utf8ToWide(GetExecutableDirectory());
+    HANDLE dir = CreateFile(directory.c_str(), FILE_LIST_DIRECTORY,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL, OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (dir == INVALID_HANDLE_VALUE) {
+        LOG_WARNING << "Watching settings.json failed, CreateFile() error "
+                    << GetLastError();
+        return 0;
+    }
+    OVERLAPPED overlapped = {0};
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    HANDLE handles[2] = {g_settingsWatcherStopEvent, overlapped.hEvent};
+    // DWORD aligned, as required by ReadDirectoryChangesW.
+    DWORD buffer[2048];
+    bool reading = false;
+    bool changed = false;
+
+    for (;;) {
+        if (!reading) {
+            ResetEvent(overlapped.hEvent);
+            if (!ReadDirectoryChangesW(dir, buffer, sizeof(buffer), FALSE,
+                    FILE_NOTIFY_CHANGE_FILE_NAME
+                    | FILE_NOTIFY_CHANGE_LAST_WRITE
+                    | FILE_NOTIFY_CHANGE_SIZE,
+                    NULL, &overlapped, NULL)) {
+                LOG_WARNING << "Watching settings.json failed, "
+                               "ReadDirectoryChangesW() error "
+                            << GetLastError();
+                break;
+            }
+            reading = true;
+        }
+        DWORD wait = WaitForMultipleObjects(2, handles, FALSE,
+                changed ? SETTINGS_RELOAD_DELAY_MS : INFINITE);
+        if (wait == WAIT_OBJECT_0) {
+            break;
+        } else if (wait == WAIT_TIMEOUT) {
+            changed = false;
+            ReloadSettings();
+            continue;
+        } else if (wait != WAIT_OBJECT_0 + 1) {
+            break;
+        }
+        reading = false;
+        DWORD bytes = 0;
+        if (!GetOverlappedResult(dir, &overlapped, &bytes, FALSE))
+            continue;
+        if (!bytes) {
+            // Buffer overflow, the file may have changed.
+            changed = true;
+            continue;
+        }
+        FILE_NOTIFY_INFORMATION* info =
+                reinterpret_cast<FILE_NOTIFY_INFORMATION*>(buffer);
+        for (;;) {
+            std::wstring name(info->FileName,
+                              info->FileNameLength / sizeof(wchar_t));
+            if (_wcsicmp(name.c_str(), L"settings.json") == 0)
+                changed = true;
+            if (!info->NextEntryOffset)
+                break;
+            info = reinterpret_cast<FILE_NOTIFY_INFORMATION*>(
+                    reinterpret_cast<char*>(info) + info->NextEntryOffset);
+        }
+    }
+
+    if (reading) {
+        DWORD bytes = 0;
+        CancelIo(dir);
+        GetOverlappedResult(dir, &overlapped, &bytes, TRUE);
+    }
+    CloseHandle(overlapped.hEvent);
+    CloseHandle(dir);
+    return 0;
+}
+
+void StartSettingsWatcher() {
+    if (g_settingsWatcherThread)
+        return;
+    g_settingsWatcherStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    g_settingsWatcherThread = CreateThread(NULL, 0, &SettingsWatcherThread,
+                                           NULL, 0, NULL);
+    if (!g_settingsWatcherThread) {
+        LOG_WARNING << "Watching settings.json failed, CreateThread() error "
+                    << GetLastError();
+    }
+}
+
+void StopSettingsWatcher() {
+    if (!g_settingsWatcherThread)
+        return;
+    SetEvent(g_settingsWatcherStopEvent);
+    WaitForSingleObject(g_settingsWatcherThread, INFINITE);
+    CloseHandle(g_settingsWatcherThread);
+    CloseHandle(g_settingsWatcherStopEvent);
+    g_settingsWatcherThread = NULL;
+    g_settingsWatcherStopEvent = NULL;
+}
@@ -7,6 +7,129 @@
 #include "defines.h"
 #include "json.h"
 #include <string>
+#include <utility>
+#include <vector>
+
+// Settings from settings.json compiled into plain typed fields. The json
+// tree is walked only once, when GetSettings() is first called, so code
+// running on hot paths (window procedures, CEF handlers) does no string
+// lookups. Keys missing from settings.json get the same values that the
+// json accessors used to return: false, 0 or an empty string.
+struct ApplicationSettings {
+    struct {
+        std::string single_instance_guid;
+        bool dpi_aware;
+    } application;
+    struct {
+        bool show_console;
+        bool subprocess_show_console;
+        std::string log_level;
+        std::string log_file;
+        std::string trace_file;
+        bool trace_ring_buffer;
+        long trace_buffer_size;
+    } debugging;
+    struct {
+        std::string title;
+        std::string icon;
+        long default_size[2];
+        long minimum_size[2];
+        long maximum_size[2];
+        bool disable_maximize_button;
+        bool center_on_screen;
+        bool start_maximized;
+        bool start_fullscreen;
+        bool always_on_top;
+        bool minimize_to_tray;
+        std::string minimize_to_tray_message;
+    } main_window;
+    struct {
+        std::string icon;
+        std::string fixed_title;
+        bool center_relative_to_parent;
+        long default_size[2];
+    } popup_window;
+    struct {
+        // Port may be a number or a mongoose port spec string.
+        std::string listen_on_ip;
+        std::string listen_on_port;
+        std::string www_directory;
+        std::vector<std::string> index_files;
+        std::string cgi_interpreter;
+        std::vector<std::string> cgi_extensions;
+        std::string cgi_temp_dir;
+        std::string handler_404;
+        std::vector<std::string> hide_files;
+        // Extension without the dot, and mime type.
+        std::vector<std::pair<std::string, std::string> > mime_types;
+        // Url pattern and Cache-Control directive, first match wins.
+        std::vector<std::pair<std::string, std::string> > cache_rules;
+        // Cache urls like "app.3f2a9c1b.js" forever, unless a rule matches.
+        bool cache_fingerprinted_urls;
+        // Packed www, see www_archive.h. Replaces www_directory.
+        std::string www_archive;
+        std::vector<std::string> www_archive_extract;
+        // Memory for caching php responses that allow it, 0 disables.
+        long cgi_cache_size_mb;
+        // Url patterns whose concurrent identical GETs run php once.
+        std::vector<std::string> coalesce_urls;
+        // Url of the push channel, see PublishWebServerMessage().
+        std::string push_url;
+    } web_server;
+    struct {
+        std::string log_file;
+        std::string log_severity;
+        std::string cache_path;
+        bool external_drag;
+        bool external_navigation;
+        bool reload_page_F5;
+        bool devtools_F12;
+        long remote_debugging_port;
+        std::vector<std::pair<std::string, std::string> >
+                command_line_switches;
+        bool enable_downloads;
+        struct {
+            bool enable_menu;
+            bool navigation;
+            bool print;
+            bool view_source;
+            bool reload_page;
+            bool open_in_external_browser;
+            bool devtools;
+        } context_menu;
+    } chrome;
+};
+
+// Sections of ApplicationSettings, for change notifications.
+#define SETTINGS_SECTION_APPLICATION 1
+#define SETTINGS_SECTION_DEBUGGING 2
+#define SETTINGS_SECTION_MAIN_WINDOW 4
+#define SETTINGS_SECTION_POPUP_WINDOW 8
+#define SETTINGS_SECTION_WEB_SERVER 16
+#define SETTINGS_SECTION_CHROME 32
+#define SETTINGS_SECTION_ALL 63
+
+// Returns the current snapshot. Snapshots are immutable and are never
+// freed, so the reference stays valid after settings.json is reloaded,
+// it just may be outdated. Call GetSettings() again instead of keeping it.
+const ApplicationSettings& GetSettings();
+// Installs settings that were compiled elsewhere, see settings_snapshot.h.
+// Takes ownership. Must be called before the first GetSettings().
+void SetSettings(ApplicationSettings* settings);
+
+// Called on the watcher thread after a new snapshot was published,
+// changed_sections is a combination of SETTINGS_SECTION_* flags.
+typedef void (*SettingsListener)(const ApplicationSettings& old_settings,
+                                 const ApplicationSettings& new_settings,
+                                 int changed_sections);
+// Listeners must be added before StartSettingsWatcher().
+void AddSettingsListener(SettingsListener listener);
+// Watches settings.json for changes and reloads it in the background.
+void StartSettingsWatcher();
+void StopSettingsWatcher();
+// Logs keys that are unknown, have a wrong type or are out of range.
+// Must be called after logging was initialized.
+void LogSettingsProblems();
 
 json_value* GetApplicationSettings();
 std::string GetApplicationSettingsError();
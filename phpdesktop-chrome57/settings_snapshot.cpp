@@ -0,0 +1,356 @@
+// Copyright (c) 2012-2014 The PHP Desktop authors. All rights reserved.
+// License: New BSD License.
+// Website: http://code.google.com/p/phpdesktop/
+
+#include "defines.h"
+#include "settings_snapshot.h"
+#include <Windows.h>
+#include <stdio.h>
+#include "log.h"
+#include "string_utils.h"
+
+// Increase when fields in ApplicationSettings change.
+#define SETTINGS_SNAPSHOT_VERSION 9
+
+struct SettingsSnapshotHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int size;
+    // FNV-1a hash of the payload that follows the header.
+    unsigned long long hash;
+};
+
+static const char g_settingsSnapshotMagic[8] = {
+        'P', 'H', 'P', 'D', 'S', 'E', 'T', 'S'};
+HANDLE g_settingsSnapshotHandle = NULL;
+std::string g_settingsSnapshotName = "";
+// Guards the two above, the snapshot is republished from the settings
+// watcher thread while children are launched on CEF threads.
+CRITICAL_SECTION g_settingsSnapshotLock;
+
+static unsigned long long HashSnapshot(const char* data, size_t size) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+class SnapshotWriter {
+public:
+    void Field(bool& value) {
+        data_.push_back(value ? 1 : 0);
+    }
+    void Field(long& value) {
+        Put32(static_cast<unsigned int>(value));
+    }
+    void Field(std::string& value) {
+        Put32(static_cast<unsigned int>(value.size()));
+        data_.append(value);
+    }
+    void Field(std::vector<std::string>& value) {
+        Put32(static_cast<unsigned int>(value.size()));
+        for (size_t i = 0; i < value.size(); i++) {
+            Field(value[i]);
+        }
+    }
+    void Field(std::vector<std::pair<std::string, std::string> >& value) {
+        Put32(static_cast<unsigned int>(value.size()));
+        for (size_t i = 0; i < value.size(); i++) {
+            Field(value[i].first);
+            Field(value[i].second);
+        }
+    }
+    const std::string& data() const { return data_; }
+private:
+    void Put32(unsigned int value) {
+        char bytes[4];
+        memcpy(bytes, &value, 4);
+        data_.append(bytes, 4);
+    }
+    std::string data_;
+};
+
+// Reads fields in the same order as SnapshotWriter. Any read past
+// the end marks the reader as failed.
+class SnapshotReader {
+public:
+    SnapshotReader(const char* data, size_t size)
+            : data_(data), size_(size), pos_(0), failed_(false) {}
+    void Field(bool& value) {
+        value = Has(1) && data_[pos_++] != 0;
+    }
+    void Field(long& value) {
+        value = static_cast<long>(static_cast<int>(Get32()));
+    }
+    void Field(std::string& value) {
+        unsigned int length = Get32();
+        if (!Has(length)) {
+            value.clear();
+            return;
+        }
+        value.assign(data_ + pos_, length);
+        pos_ += length;
+    }
+    void Field(std::vector<std::string>& value) {
+        unsigned int count = Get32();
+        value.clear();
+        for (unsigned int i = 0; i < count && !failed_; i++) {
+            value.push_back(std::string());
+            Field(value.back());
+        }
+    }
+    void Field(std::vector<std::pair<std::string, std::string> >& value) {
+        unsigned int count = Get32();
+        value.clear();
+        for (unsigned int i = 0; i < count && !failed_; i++) {
+            value.push_back(std::pair<std::string, std::string>());
+            Field(value.back().first);
+            Field(value.back().second);
+        }
+    }
+    bool Done() const { return !failed_ && pos_ == size_; }
+private:
+    bool Has(size_t length) {
+        if (failed_ || length > size_ - pos_) {
+            failed_ = true;
+            return false;
+        }
+        return true;
+    }
+    unsigned int Get32() {
+        unsigned int value = 0;
+        if (Has(4)) {
+            memcpy(&value, data_ + pos_, 4);
+            pos_ += 4;
+        }
+        return value;
+    }
+    const char* data_;
+    size_t size_;
+    size_t pos_;
+    bool failed_;
+};
+
+// The only place that lists fields, so that writing and reading
+// always use the same order. Sections are SETTINGS_SECTION_* flags.
+template <class Archive>
+static void SerializeSettings(Archive& ar, ApplicationSettings& s,
+                              int sections = SETTINGS_SECTION_ALL) {
+    if (sections & SETTINGS_SECTION_APPLICATION) {
+        ar.Field(s.application.single_instance_guid);
+        ar.Field(s.application.dpi_aware);
+    }
+    if (sections & SETTINGS_SECTION_DEBUGGING) {
+        ar.Field(s.debugging.show_console);
+        ar.Field(s.debugging.subprocess_show_console);
+        ar.Field(s.debugging.log_level);
+        ar.Field(s.debugging.log_file);
+        ar.Field(s.debugging.trace_file);
+        ar.Field(s.debugging.trace_ring_buffer);
+        ar.Field(s.debugging.trace_buffer_size);
+    }
+    if (sections & SETTINGS_SECTION_MAIN_WINDOW) {
+        ar.Field(s.main_window.title);
+        ar.Field(s.main_window.icon);
+        for (int i = 0; i < 2; i++) {
+            ar.Field(s.main_window.default_size[i]);
+            ar.Field(s.main_window.minimum_size[i]);
+            ar.Field(s.main_window.maximum_size[i]);
+        }
+        ar.Field(s.main_window.disable_maximize_button);
+        ar.Field(s.main_window.center_on_screen);
+        ar.Field(s.main_window.start_maximized);
+        ar.Field(s.main_window.start_fullscreen);
+        ar.Field(s.main_window.always_on_top);
+        ar.Field(s.main_window.minimize_to_tray);
+        ar.Field(s.main_window.minimize_to_tray_message);
+    }
+    if (sections & SETTINGS_SECTION_POPUP_WINDOW) {
+        ar.Field(s.popup_window.icon);
+        ar.Field(s.popup_window.fixed_title);
+        ar.Field(s.popup_window.center_relative_to_parent);
+        ar.Field(s.popup_window.default_size[0]);
+        ar.Field(s.popup_window.default_size[1]);
+    }
+    if (sections & SETTINGS_SECTION_WEB_SERVER) {
+        ar.Field(s.web_server.listen_on_ip);
+        ar.Field(s.web_server.listen_on_port);
+        ar.Field(s.web_server.www_directory);
+        ar.Field(s.web_server.index_files);
+        ar.Field(s.web_server.cgi_interpreter);
+        ar.Field(s.web_server.cgi_extensions);
+        ar.Field(s.web_server.cgi_temp_dir);
+        ar.Field(s.web_server.handler_404);
+        ar.Field(s.web_server.hide_files);
+        ar.Field(s.web_server.mime_types);
+        ar.Field(s.web_server.cache_rules);
+        ar.Field(s.web_server.cache_fingerprinted_urls);
+        ar.Field(s.web_server.www_archive);
+        ar.Field(s.web_server.www_archive_extract);
+        ar.Field(s.web_server.cgi_cache_size_mb);
+        ar.Field(s.web_server.coalesce_urls);
+        ar.Field(s.web_server.push_url);
+    }
+    if (sections & SETTINGS_SECTION_CHROME) {
+        ar.Field(s.chrome.log_file);
+        ar.Field(s.chrome.log_severity);
+        ar.Field(s.chrome.cache_path);
+        ar.Field(s.chrome.external_drag);
+        ar.Field(s.chrome.external_navigation);
+        ar.Field(s.chrome.reload_page_F5);
+        ar.Field(s.chrome.devtools_F12);
+        ar.Field(s.chrome.remote_debugging_port);
+        ar.Field(s.chrome.command_line_switches);
+        ar.Field(s.chrome.enable_downloads);
+        ar.Field(s.chrome.context_menu.enable_menu);
+        ar.Field(s.chrome.context_menu.navigation);
+        ar.Field(s.chrome.context_menu.print);
+        ar.Field(s.chrome.context_menu.view_source);
+        ar.Field(s.chrome.context_menu.reload_page);
+        ar.Field(s.chrome.context_menu.open_in_external_browser);
+        ar.Field(s.chrome.context_menu.devtools);
+    }
+}
+
+int GetChangedSettingsSections(const ApplicationSettings& a,
+                               const ApplicationSettings& b) {
+    ApplicationSettings copy_a = a;
+    ApplicationSettings copy_b = b;
+    int changed = 0;
+    for (int section = 1; section < SETTINGS_SECTION_ALL; section <<= 1) {
+        SnapshotWriter writer_a;
+        SnapshotWriter writer_b;
+        SerializeSettings(writer_a, copy_a, section);
+        SerializeSettings(writer_b, copy_b, section);
+        if (writer_a.data() != writer_b.data())
+            changed |= section;
+    }
+    return changed;
+}
+
+bool PublishSettingsSnapshot() {
+    static bool lock_initialized = false;
+    if (!lock_initialized) {
+        // First call happens on the main thread during startup.
+        InitializeCriticalSection(&g_settingsSnapshotLock);
+        lock_initialized = true;
+    }
+    ApplicationSettings settings = GetSettings();
+    SnapshotWriter writer;
+    SerializeSettings(writer, settings);
+    const std::string& payload = writer.data();
+
+    SettingsSnapshotHeader header;
+    memcpy(header.magic, g_settingsSnapshotMagic, sizeof(header.magic));
+    header.version = SETTINGS_SNAPSHOT_VERSION;
+    header.size = static_cast<unsigned int>(payload.size());
+    header.hash = HashSnapshot(payload.data(), payload.size());
+    DWORD total = static_cast<DWORD>(sizeof(header) + payload.size());
+
+    // Process id and hash make the name unique, so that another
+    // running instance of the application never gets mixed up.
+    char name[128];
+    _snprintf_s(name, _countof(name), _TRUNCATE,
+                "Local\\PHPDesktopSettings.%lu.%016llx",
+                GetCurrentProcessId(), header.hash);
+
+    HANDLE handle = CreateFileMapping(INVALID_HANDLE_VALUE, NULL,
+            PAGE_READWRITE, 0, total, Utf8ToWide(name).c_str());
+    if (!handle) {
+        LOG_WARNING << "PublishSettingsSnapshot(): CreateFileMapping() "
+                       "failed, error = " << GetLastError();
+        return false;
+    }
+    char* view = static_cast<char*>(
+            MapViewOfFile(handle, FILE_MAP_WRITE, 0, 0, total));
+    if (!view) {
+        LOG_WARNING << "PublishSettingsSnapshot(): MapViewOfFile() "
+                       "failed, error = " << GetLastError();
+        CloseHandle(handle);
+        return false;
+    }
+    memcpy(view, &header, sizeof(header));
+    memcpy(view + sizeof(header), payload.data(), payload.size());
+    UnmapViewOfFile(view);
+
+    // The handle stays open while subprocesses can still be launched.
+    // A child started with the previous name just after it was replaced
+    // does not find it and parses settings.json itself.
+    EnterCriticalSection(&g_settingsSnapshotLock);
+    HANDLE old_handle = g_settingsSnapshotHandle;
+    g_settingsSnapshotHandle = handle;
+    g_settingsSnapshotName = name;
+    LeaveCriticalSection(&g_settingsSnapshotLock);
+    if (old_handle)
+        CloseHandle(old_handle);
+    LOG_DEBUG << "Published settings snapshot " << name << ", "
+              << total << " bytes";
+    return true;
+}
+
+std::string GetSettingsSnapshotName() {
+    if (!g_settingsSnapshotHandle)
+        return "";
+    EnterCriticalSection(&g_settingsSnapshotLock);
+    std::string name = g_settingsSnapshotName;
+    LeaveCriticalSection(&g_settingsSnapshotLock);
+    return name;
+}
+
+bool LoadSettingsSnapshot(const std::wstring& commandLine) {
+    std::wstring prefix = Utf8ToWide(
+            std::string("--") + SETTINGS_SNAPSHOT_SWITCH + "=");
+    size_t pos = commandLine.find(prefix);
+    if (pos == std::wstring::npos)
+        return false;
+    pos += prefix.length();
+    size_t end = commandLine.find_first_of(L" \t\"", pos);
+    std::wstring name = commandLine.substr(pos, end == std::wstring::npos ?
+                                           std::wstring::npos : end - pos);
+    if (name.empty())
+        return false;
+
+    HANDLE handle = OpenFileMapping(FILE_MAP_READ, FALSE, name.c_str());
+    if (!handle)
+        return false;
+    const char* view = static_cast<const char*>(
+            MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0));
+    if (!view) {
+        CloseHandle(handle);
+        return false;
+    }
+    MEMORY_BASIC_INFORMATION info;
+    size_t mapped = 0;
+    if (VirtualQuery(view, &info, sizeof(info)))
+        mapped = info.RegionSize;
+
+    bool loaded = false;
+    SettingsSnapshotHeader header;
+    if (mapped >= sizeof(header)) {
+        memcpy(&header, view, sizeof(header));
+        char hash[17];
+        _snprintf_s(hash, _countof(hash), _TRUNCATE, "%016llx", header.hash);
+        const char* payload = view + sizeof(header);
+        if (memcmp(header.magic, g_settingsSnapshotMagic,
+                   sizeof(header.magic)) == 0
+                && header.version == SETTINGS_SNAPSHOT_VERSION
+                && header.size <= mapped - sizeof(header)
+                && WideToUtf8(name).find(hash) != std::string::npos
+                && HashSnapshot(payload, header.size) == header.hash) {
+            ApplicationSettings* settings = new ApplicationSettings();
+            SnapshotReader reader(payload, header.size);
+            SerializeSettings(reader, *settings);
+            if (reader.Done()) {
+                SetSettings(settings);
+                loaded = true;
+            } else {
+                delete settings;
+            }
+        }
+    }
+    UnmapViewOfFile(view);
+    CloseHandle(handle);
+    return loaded;
+}
@@ -0,0 +1,30 @@
+// Copyright (c) 2012-2014 The PHP Desktop authors. All rights reserved.
+// License: New BSD License.
+// Website: http://code.google.com/p/phpdesktop/
+
+#pragma once
+
+#include "defines.h"
+#include "settings.h"
+#include <string>
+
+// CEF subprocesses run the same executable as the browser process.
+// Instead of every renderer parsing settings.json again, the browser
+// process serializes the compiled settings into a read-only shared
+// memory section, and passes its name to children using this switch.
+#define SETTINGS_SNAPSHOT_SWITCH "phpdesktop-settings"
+
+// Browser process: serialize GetSettings() and publish it. Called again
+// after settings.json was reloaded, the new section replaces the old one.
+bool PublishSettingsSnapshot();
+// Name of the published section, empty if publishing failed.
+std::string GetSettingsSnapshotName();
+
+// Subprocess: look for the switch in the command line, map the section
+// and install the settings using SetSettings(). Returns false if there
+// is no snapshot or it is invalid, then settings.json gets parsed.
+bool LoadSettingsSnapshot(const std::wstring& commandLine);
+
+// Returns SETTINGS_SECTION_* flags of sections that differ.
+int GetChangedSettingsSections(const ApplicationSettings& a,
+                               const ApplicationSettings& b);
@@ -0,0 +1,202 @@
+// Copyright (c) 2012-2014 The PHP Desktop authors. All rights reserved.
+// License: New BSD License.
+// Website: http://code.google.com/p/phpdesktop/
+
+#include "trace.h"
+
+#include <Windows.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "json.h"
+#include "log.h"
+#include "string_utils.h"
+
+#define TRACE_DEFAULT_MAX_EVENTS 100000
+
+struct TraceRecord {
+    const char* category;
+    const char* name;
+    double start;
+    double end;
+    DWORD thread_id;
+    // Slot number + 1, set after the other fields were written.
+    volatile LONGLONG sequence;
+    char detail[TRACE_DETAIL_SIZE];
+};
+
+TraceRecord* g_traceRecords = NULL;
+LONGLONG g_traceCapacity = 0;
+volatile LONGLONG g_traceNext = 0;
+bool g_traceRingBuffer = false;
+volatile bool g_tracing = false;
+std::string g_traceFile;
+DWORD g_traceMainThreadId = 0;
+
+void StartTracing(const std::string& file, bool ring_buffer,
+                  long max_events) {
+    if (g_traceRecords || file.empty())
+        return;
+    if (max_events <= 0)
+        max_events = TRACE_DEFAULT_MAX_EVENTS;
+    g_traceRecords = static_cast<TraceRecord*>(
+            calloc(max_events, sizeof(TraceRecord)));
+    if (!g_traceRecords) {
+        LOG_WARNING << "Tracing disabled, could not allocate "
+                    << max_events << " events";
+        return;
+    }
+    g_traceCapacity = max_events;
+    g_traceRingBuffer = ring_buffer;
+    g_traceFile = file;
+    g_traceMainThreadId = GetCurrentThreadId();
+    g_tracing = true;
+    LOG_INFO << "Tracing to: " << file << " ("
+             << (ring_buffer ? "last " : "first ") << max_events
+             << " events)";
+}
+
+bool IsTracing() {
+    return g_tracing;
+}
+
+double TraceClock() {
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart / (double) freq.QuadPart;
+}
+
+void TraceEvent(const char* category, const char* name,
+                double start, double end, const char* detail) {
+    if (!g_tracing)
+        return;
+    LONGLONG slot = InterlockedIncrement64(&g_traceNext) - 1;
+    if (slot >= g_traceCapacity && !g_traceRingBuffer)
+        return;
+    TraceRecord* record = &g_traceRecords[slot % g_traceCapacity];
+    // Invalidate first, in case the slot is being reused.
+    record->sequence = 0;
+    MemoryBarrier();
+    record->category = category;
+    record->name = name;
+    record->start = start;
+    record->end = end;
+    record->thread_id = GetCurrentThreadId();
+    if (detail) {
+        strncpy_s(record->detail, sizeof(record->detail), detail,
+                  _TRUNCATE);
+    } else {
+        record->detail[0] = '\0';
+    }
+    MemoryBarrier();
+    record->sequence = slot + 1;
+}
+
+static void WriteTraceString(json_buffer* buffer, const char* key,
+                             const char* value) {
+    json_write_key(buffer, key, strlen(key));
+    json_write_string(buffer, value, strlen(value));
+}
+
+static void WriteTraceMetadata(json_buffer* buffer, DWORD pid, DWORD tid,
+                               const char* name, const char* value) {
+    json_write_object_begin(buffer);
+    WriteTraceString(buffer, "name", name);
+    WriteTraceString(buffer, "ph", "M");
+    json_write_key(buffer, "pid", 3);
+    json_write_integer(buffer, pid);
+    json_write_key(buffer, "tid", 3);
+    json_write_integer(buffer, tid);
+    json_write_key(buffer, "args", 4);
+    json_write_object_begin(buffer);
+    WriteTraceString(buffer, "name", value);
+    json_write_object_end(buffer);
+    json_write_object_end(buffer);
+}
+
+void StopTracing() {
+    if (!g_tracing)
+        return;
+    g_tracing = false;
+
+    LONGLONG next = g_traceNext;
+    LONGLONG first = 0;
+    if (next > g_traceCapacity) {
+        if (g_traceRingBuffer)
+            first = next - g_traceCapacity;
+        else
+            next = g_traceCapacity;
+    }
+    DWORD pid = GetCurrentProcessId();
+    json_buffer buffer;
+    json_buffer_init(&buffer, NULL, 0, json_serialize_compact);
+    json_write_object_begin(&buffer);
+    WriteTraceString(&buffer, "displayTimeUnit", "ms");
+    json_write_key(&buffer, "traceEvents", 11);
+    json_write_array_begin(&buffer);
+    WriteTraceMetadata(&buffer, pid, g_traceMainThreadId, "process_name",
+                       "phpdesktop");
+    WriteTraceMetadata(&buffer, pid, g_traceMainThreadId, "thread_name",
+                       "main");
+    long written = 0;
+    for (LONGLONG slot = first; slot < next; slot++) {
+        const TraceRecord& record = g_traceRecords[slot % g_traceCapacity];
+        if (record.sequence != slot + 1) {
+            // Not finished writing or already overwritten.
+            continue;
+        }
+        json_write_object_begin(&buffer);
+        WriteTraceString(&buffer, "name", record.name);
+        WriteTraceString(&buffer, "cat", record.category);
+        WriteTraceString(&buffer, "ph", "X");
+        // Trace event timestamps are in microseconds.
+        json_write_key(&buffer, "ts", 2);
+        json_write_double(&buffer, record.start * 1000000.0);
+        json_write_key(&buffer, "dur", 3);
+        json_write_double(&buffer, (record.end - record.start) * 1000000.0);
+        json_write_key(&buffer, "pid", 3);
+        json_write_integer(&buffer, pid);
+        json_write_key(&buffer, "tid", 3);
+        json_write_integer(&buffer, record.thread_id);
+        if (record.detail[0]) {
+            json_write_key(&buffer, "args", 4);
+            json_write_object_begin(&buffer);
+            WriteTraceString(&buffer, "detail", record.detail);
+            json_write_object_end(&buffer);
+        }
+        json_write_object_end(&buffer);
+        written++;
+    }
+    json_write_array_end(&buffer);
+    json_write_object_end(&buffer);
+
+    if (buffer.failed) {
+        LOG_ERROR << "Writing trace failed, out of memory";
+        json_buffer_free(&buffer);
+        return;
+    }
+    FILE* file = NULL;
+    if (_wfopen_s(&file, Utf8ToWide(g_traceFile).c_str(), L"wb") != 0
+            || !file) {
+        LOG_ERROR << "Writing trace failed, could not open: " << g_traceFile;
+        json_buffer_free(&buffer);
+        return;
+    }
+    fwrite(buffer.buf, 1, buffer.length, file);
+    fclose(file);
+    json_buffer_free(&buffer);
+    LOG_INFO << "Trace written: " << g_traceFile << " (" << written
+             << " events)";
+}
+
+TraceScope::TraceScope(const char* category, const char* name)
+        : category_(category),
+          name_(name),
+          start_(g_tracing ? TraceClock() : 0) {
+}
+
+TraceScope::~TraceScope() {
+    if (g_tracing && start_ != 0)
+        TraceEvent(category_, name_, start_, TraceClock());
+}
@@ -0,0 +1,49 @@
+// Copyright (c) 2012-2014 The PHP Desktop authors. All rights reserved.
+// License: New BSD License.
+// Website: http://code.google.com/p/phpdesktop/
+
+#pragma once
+
+#include "defines.h"
+#include <string>
+
+// Opt-in timeline tracer, enabled with "debugging.trace_file". Events
+// are written in the Chrome trace event format when tracing stops, open
+// the file in chrome://tracing or https://ui.perfetto.dev.
+//
+// Events are kept in a preallocated array of trace_buffer_size entries.
+// Without trace_ring_buffer recording stops when the array is full. With
+// it, the oldest events are overwritten, so tracing can stay enabled
+// and the file shows what happened just before the application closed.
+
+#define TRACE_DETAIL_SIZE 64
+
+void StartTracing(const std::string& file, bool ring_buffer,
+                  long max_events);
+// Writes the trace file. Events recorded afterwards are ignored.
+void StopTracing();
+bool IsTracing();
+
+// Monotonic time in seconds. Uses the same clock as mg_clock() in
+// mongoose.c, so timestamps from the web server can be recorded as is.
+double TraceClock();
+
+// Records a complete event on the calling thread. category and name
+// must be string literals, they are not copied. detail is copied and
+// truncated to TRACE_DETAIL_SIZE.
+void TraceEvent(const char* category, const char* name,
+                double start, double end, const char* detail = NULL);
+
+// Records the lifetime of a scope.
+class TraceScope {
+public:
+    TraceScope(const char* category, const char* name);
+    ~TraceScope();
+private:
+    const char* category_;
+    const char* name_;
+    double start_;
+};
+
+#define TRACE_SCOPE(category, name) \
+    TraceScope trace_scope_(category, name)
@@ -6,7 +6,10 @@
 
 #include <Windows.h>
 #include <stdio.h>
+#include <string.h>
 #include <wchar.h>
+#include <algorithm>
+#include <vector>
 
 #include "executable.h"
 #include "file_utils.h"
@@ -14,14 +17,17 @@
 #include "mongoose.h"
 #include "settings.h"
 #include "string_utils.h"
+#include "trace.h"
 #include "version.h"
 #include "temp_dir.h"
+#include "www_archive.h"
 
 int g_webServerPort = 0;
 std::string g_webServerIpAddress = "";
 std::string g_webServerUrl = "";
 std::string g_wwwDirectory = "";
 std::string g_cgiInterpreter = "";
+bool g_wwwArchiveOpened = false;
 
 struct mg_context* g_mongooseContext = 0;
 extern std::string g_cgiEnvironmentFromArgv;
@@ -33,8 +39,17 @@ static int log_message(const struct mg_connection* conn, const char *message) {
     return 0;
 }
 
+// Called when mongoose opens a file, serves static files from
+// the www archive.
+static const char* open_file_with_time(const struct mg_connection* conn,
+                                       const char* path, size_t* data_len,
+                                       time_t* modification_time) {
+    return GetWwwArchiveFile(path, data_len, modification_time);
+}
+
 // Called when mongoose has finished processing request.
-static void end_request(const struct mg_connection* conn, int reply_status_code) {
+static void end_request(const struct mg_connection* conn, int reply_status_code,
+                        const struct mg_request_stats* stats) {
     mg_request_info* request = mg_get_request_info(const_cast<mg_connection*>(conn));
     std::string message;
     message.append(request->request_method);
@@ -46,23 +61,307 @@ static void end_request(const struct mg_connection* conn, int reply_status_code)
         message.append("?");
         message.append(request->query_string);
     }
+    if (stats->is_cgi) {
+        message.append(" (");
+        message.append(IntToString(static_cast<long>(stats->wall_time * 1000)));
+        message.append(" ms, cpu ");
+        message.append(IntToString(static_cast<long>(
+                (stats->cgi_user_time + stats->cgi_system_time) * 1000)));
+        message.append(" ms, peak ");
+        message.append(IntToString(stats->cgi_peak_rss_kb));
+        message.append(" KB)");
+    } else if (stats->cgi_cache_hit) {
+        message.append(" (cached)");
+    } else if (stats->cgi_coalesced) {
+        message.append(" (coalesced)");
+    }
     LOG_INFO << message;
 }
 
+// Called when mongoose finished a phase of handling a connection,
+// only set when tracing.
+static void trace_event(const struct mg_connection* conn, const char* name,
+                        double start, double end) {
+    if (conn && strcmp(name, "request") == 0) {
+        mg_request_info* request =
+                mg_get_request_info(const_cast<mg_connection*>(conn));
+        char detail[TRACE_DETAIL_SIZE];
+        _snprintf_s(detail, sizeof(detail), _TRUNCATE, "%s %s",
+                    request->request_method, request->uri);
+        TraceEvent("server", name, start, end, detail);
+    } else {
+        TraceEvent("server", name, start, end);
+    }
+}
+
+static bool CompareCgiScriptStats(const mg_cgi_script_stats& a,
+                                  const mg_cgi_script_stats& b) {
+    return a.total_user_time + a.total_system_time
+            > b.total_user_time + b.total_system_time;
+}
+
+// Log CGI resource usage aggregated per script, most expensive first.
+void LogCgiScriptStats() {
+    if (!g_mongooseContext) {
+        return;
+    }
+    std::vector<mg_cgi_script_stats> stats(1024);
+    int count = mg_get_cgi_script_stats(g_mongooseContext, &stats[0],
+                                        static_cast<int>(stats.size()));
+    stats.resize(count);
+    std::sort(stats.begin(), stats.end(), CompareCgiScriptStats);
+    for (int i = 0; i < count; i++) {
+        LOG_INFO << "CGI " << stats[i].script_name
+                 << ": requests=" << stats[i].num_requests
+                 << " cancelled=" << stats[i].num_cancelled
+                 << " wall=" << stats[i].total_wall_time << "s"
+                 << " max_wall=" << stats[i].max_wall_time << "s"
+                 << " user=" << stats[i].total_user_time << "s"
+                 << " sys=" << stats[i].total_system_time << "s"
+                 << " max_rss=" << stats[i].max_peak_rss_kb << "KB";
+    }
+}
+
+// Log how well the CGI response cache and request coalescing did,
+// if they are enabled.
+static void LogCgiCacheStats() {
+    if (!g_mongooseContext) {
+        return;
+    }
+    const ApplicationSettings& settings = GetSettings();
+    mg_cgi_cache_stats stats;
+    mg_get_cgi_cache_stats(g_mongooseContext, &stats);
+    if (settings.web_server.cgi_cache_size_mb > 0) {
+        long lookups = stats.hits + stats.misses;
+        LOG_INFO << "CGI cache: hits=" << stats.hits
+                 << " misses=" << stats.misses
+                 << " hit_ratio="
+                 << (lookups ? stats.hits * 100 / lookups : 0)
+                 << "% stores=" << stats.stores
+                 << " evictions=" << stats.evictions
+                 << " purged=" << stats.purged
+                 << " entries=" << stats.num_entries
+                 << " bytes=" << stats.num_bytes;
+    }
+    if (settings.web_server.coalesce_urls.size()) {
+        LOG_INFO << "CGI requests coalesced: " << stats.coalesced
+                 << ", waits timed out: " << stats.coalesce_timeouts;
+    }
+}
+
+static std::string GetIndexFilesOption(const ApplicationSettings& settings) {
+    const std::vector<std::string>& indexFilesArray =
+            settings.web_server.index_files;
+    std::string indexFiles;
+    for (size_t i = 0; i < indexFilesArray.size(); i++) {
+        const std::string& file = indexFilesArray[i];
+        if (file.length()) {
+            if (indexFiles.length())
+                indexFiles.append(",");
+            indexFiles.append(file);
+        }
+    }
+    if (indexFiles.empty())
+        indexFiles = "index.html,index.php";
+    return indexFiles;
+}
+
+static std::string GetCgiPatternOption(const ApplicationSettings& settings) {
+    const std::vector<std::string>& cgiExtensions =
+            settings.web_server.cgi_extensions;
+    std::string cgiPattern;
+    for (size_t i = 0; i < cgiExtensions.size(); i++) {
+        const std::string& extension = cgiExtensions[i];
+        if (extension.length()) {
+            if (cgiPattern.length())
+                cgiPattern.append("|");
+            cgiPattern.append("**.").append(extension).append("$");
+        }
+    }
+    if (cgiPattern.empty())
+        cgiPattern = "**.php$";
+    return cgiPattern;
+}
+
+static std::string GetHideFilesOption(const ApplicationSettings& settings) {
+    const std::vector<std::string>& hide_files =
+            settings.web_server.hide_files;
+    std::string hide_files_patterns = "";
+    for (size_t i = 0; i < hide_files.size(); i++) {
+        const std::string& pattern = hide_files[i];
+        if (pattern.length()) {
+            if (hide_files_patterns.length())
+                hide_files_patterns.append("|");
+            hide_files_patterns.append("**/").append(pattern).append("$");
+        }
+    }
+    return hide_files_patterns;
+}
+
+// Mongoose expects ".ext1=type1,.ext2=type2".
+static std::string GetMimeTypesOption(const ApplicationSettings& settings) {
+    const std::vector<std::pair<std::string, std::string> >& mime_types =
+            settings.web_server.mime_types;
+    std::string extra_mime_types = "";
+    for (size_t i = 0; i < mime_types.size(); i++) {
+        const std::string& extension = mime_types[i].first;
+        const std::string& type = mime_types[i].second;
+        if (extension.empty() || type.empty()) {
+            continue;
+        }
+        if (extra_mime_types.length())
+            extra_mime_types.append(",");
+        if (extension[0] != '.')
+            extra_mime_types.append(".");
+        extra_mime_types.append(extension).append("=").append(type);
+    }
+    return extra_mime_types;
+}
+
+// Mongoose expects "pattern=directive;...". Patterns without a leading
+// slash match in any directory, like hide_files.
+static std::string GetCacheRulesOption(const ApplicationSettings& settings) {
+    const std::vector<std::pair<std::string, std::string> >& cache_rules =
+            settings.web_server.cache_rules;
+    std::string option = "";
+    for (size_t i = 0; i < cache_rules.size(); i++) {
+        const std::string& pattern = cache_rules[i].first;
+        const std::string& directive = cache_rules[i].second;
+        if (pattern.empty() || directive.empty()) {
+            continue;
+        }
+        if (pattern.find_first_of("=;") != std::string::npos
+                || directive.find(';') != std::string::npos) {
+            LOG_WARNING << "Invalid cache rule: " << pattern;
+            continue;
+        }
+        if (option.length())
+            option.append(";");
+        if (pattern[0] != '/' && pattern.find("**") != 0)
+            option.append("**/");
+        option.append(pattern);
+        if (pattern[pattern.length() - 1] != '$')
+            option.append("$");
+        option.append("=").append(directive);
+    }
+    return option;
+}
+
+// Mongoose expects "pattern|pattern". Patterns without a leading slash
+// match in any directory, like cache_rules.
+static std::string GetCoalescePatternOption(
+        const ApplicationSettings& settings) {
+    const std::vector<std::string>& coalesce_urls =
+            settings.web_server.coalesce_urls;
+    std::string option = "";
+    for (size_t i = 0; i < coalesce_urls.size(); i++) {
+        const std::string& pattern = coalesce_urls[i];
+        if (pattern.empty()) {
+            continue;
+        }
+        if (option.length())
+            option.append("|");
+        if (pattern[0] != '/' && pattern.find("**") != 0)
+            option.append("**/");
+        option.append(pattern);
+        if (pattern[pattern.length() - 1] != '$')
+            option.append("$");
+    }
+    return option;
+}
+
+static void UpdateWebServerOption(const char* name,
+                                  const std::string& old_value,
+                                  const std::string& new_value) {
+    if (old_value == new_value) {
+        return;
+    }
+    if (mg_set_option(g_mongooseContext, name, new_value.c_str())) {
+        LOG_INFO << "Web server option changed: " << name << " = "
+                 << new_value;
+    } else {
+        LOG_WARNING << "Changing web server option failed: " << name;
+    }
+}
+
+// Applies a reloaded settings.json to the running web server. Options
+// that mongoose cannot change at run time take effect after restart.
+static void OnSettingsChanged(const ApplicationSettings& old_settings,
+                              const ApplicationSettings& new_settings,
+                              int changed_sections) {
+    if (!(changed_sections & SETTINGS_SECTION_WEB_SERVER)
+            || !g_mongooseContext) {
+        return;
+    }
+    UpdateWebServerOption("index_files",
+                          GetIndexFilesOption(old_settings),
+                          GetIndexFilesOption(new_settings));
+    // Scripts are extracted from www_archive at startup, so new
+    // cgi_extensions would match files that are not on disk.
+    if (!g_wwwArchiveOpened) {
+        UpdateWebServerOption("cgi_pattern",
+                              GetCgiPatternOption(old_settings),
+                              GetCgiPatternOption(new_settings));
+    } else if (old_settings.web_server.cgi_extensions
+                    != new_settings.web_server.cgi_extensions) {
+        LOG_WARNING << "Changes to cgi_extensions take effect after "
+                       "restarting the application when serving "
+                       "www_archive";
+    }
+    UpdateWebServerOption("hide_files_patterns",
+                          GetHideFilesOption(old_settings),
+                          GetHideFilesOption(new_settings));
+    UpdateWebServerOption("extra_mime_types",
+                          GetMimeTypesOption(old_settings),
+                          GetMimeTypesOption(new_settings));
+    UpdateWebServerOption("cache_rules",
+                          GetCacheRulesOption(old_settings),
+                          GetCacheRulesOption(new_settings));
+    UpdateWebServerOption("cache_fingerprinted_uris",
+            old_settings.web_server.cache_fingerprinted_urls ? "yes" : "no",
+            new_settings.web_server.cache_fingerprinted_urls ? "yes" : "no");
+    UpdateWebServerOption("coalesce_pattern",
+                          GetCoalescePatternOption(old_settings),
+                          GetCoalescePatternOption(new_settings));
+    UpdateWebServerOption("404_handler",
+                          old_settings.web_server.handler_404,
+                          new_settings.web_server.handler_404);
+    if (old_settings.web_server.listen_on_ip
+                    != new_settings.web_server.listen_on_ip
+            || old_settings.web_server.listen_on_port
+                    != new_settings.web_server.listen_on_port
+            || old_settings.web_server.www_directory
+                    != new_settings.web_server.www_directory
+            || old_settings.web_server.www_archive
+                    != new_settings.web_server.www_archive
+            || old_settings.web_server.www_archive_extract
+                    != new_settings.web_server.www_archive_extract
+            || old_settings.web_server.cgi_interpreter
+                    != new_settings.web_server.cgi_interpreter
+            || old_settings.web_server.cgi_temp_dir
+                    != new_settings.web_server.cgi_temp_dir
+            || old_settings.web_server.cgi_cache_size_mb
+                    != new_settings.web_server.cgi_cache_size_mb
+            || old_settings.web_server.push_url
+                    != new_settings.web_server.push_url) {
+        LOG_WARNING << "Changes to listen_on, www_directory, www_archive, "
+                       "www_archive_extract, cgi_interpreter, cgi_temp_dir, "
+                       "cgi_cache_size_mb or push_url take effect after "
+                       "restarting the application";
+    }
+}
+
 bool StartWebServer() {
     LOG_INFO << "Starting Mongoose " << mg_version() << " web server";
-    json_value* appSettings = GetApplicationSettings();
+    const ApplicationSettings& settings = GetSettings();
 
     // 404_handler
-    std::string _404_handler = (*appSettings)["web_server"]["404_handler"];
+    std::string _404_handler = settings.web_server.handler_404;
 
     // Ip address and port. If port was set to 0, then real port
     // will be known only after the webserver was started.
-    std::string ipAddress = (*appSettings)["web_server"]["listen_on"][0];
-    std::string port = (*appSettings)["web_server"]["listen_on"][1];
-    long portInt = (*appSettings)["web_server"]["listen_on"][1];
-    if (portInt)
-        port = IntToString(portInt);
+    std::string ipAddress = settings.web_server.listen_on_ip;
+    std::string port = settings.web_server.listen_on_port;
     if (ipAddress.empty()) {
         ipAddress = "127.0.0.1";
     }
@@ -71,30 +370,43 @@ bool StartWebServer() {
     }
 
     // WWW directory from settings.
-    std::string wwwDirectory = (*appSettings)["web_server"]["www_directory"];
+    std::string wwwDirectory = settings.web_server.www_directory;
     if (wwwDirectory.empty()) {
         wwwDirectory = "www";
     }
     wwwDirectory = GetAbsolutePath(wwwDirectory);
-    LOG_INFO << "WWW directory: " << wwwDirectory;
 
-    // Index files from settings.
-    const json_value indexFilesArray = (*appSettings)["web_server"]["index_files"];
-    std::string indexFiles;
-    for (int i = 0; i < 32; i++) {
-        const char* file = indexFilesArray[i];
-        if (strlen(file)) {
-            if (indexFiles.length())
-                indexFiles.append(",");
-            indexFiles.append(file);
+    // WWW archive from settings. Scripts are extracted to a directory
+    // that becomes the document root, static files are served from
+    // the archive.
+    if (settings.web_server.www_archive.length()) {
+        std::string wwwArchive =
+                GetAbsolutePath(settings.web_server.www_archive);
+        std::vector<std::string> extract = settings.web_server.cgi_extensions;
+        if (extract.empty())
+            extract.push_back("php");
+        extract.insert(extract.end(),
+                       settings.web_server.www_archive_extract.begin(),
+                       settings.web_server.www_archive_extract.end());
+        std::string extractDirectory = OpenWwwArchive(wwwArchive, extract);
+        if (extractDirectory.length()) {
+            LOG_INFO << "Serving www from archive, www_directory "
+                        "is not used";
+            wwwDirectory = extractDirectory;
+            g_wwwArchiveOpened = true;
+        } else {
+            LOG_ERROR << "Opening www archive failed, serving "
+                         "www_directory instead";
         }
     }
-    if (indexFiles.empty())
-        indexFiles = "index.html,index.php";
+    LOG_INFO << "WWW directory: " << wwwDirectory;
+
+    // Index files from settings.
+    std::string indexFiles = GetIndexFilesOption(settings);
     LOG_INFO << "Index files: " << indexFiles;
 
     // CGI interpreter from settings.
-    std::string cgiInterpreter = (*appSettings)["web_server"]["cgi_interpreter"];
+    std::string cgiInterpreter = settings.web_server.cgi_interpreter;
     if (cgiInterpreter.empty()) {
         cgiInterpreter = "php\\php-cgi.exe";
     }
@@ -102,37 +414,26 @@ bool StartWebServer() {
     LOG_INFO << "CGI interpreter: " << cgiInterpreter;
 
     // CGI extensions from settings.
-    const json_value cgiExtensions =
-            (*appSettings)["web_server"]["cgi_extensions"];
-    std::string cgiPattern;
-    for (int i = 0; i < 32; i++) {
-        const char* extension = cgiExtensions[i];
-        if (strlen(extension)) {
-            if (cgiPattern.length())
-                cgiPattern.append("|");
-            cgiPattern.append("**.").append(extension).append("$");
-        }
-    }
-    if (cgiPattern.empty())
-        cgiPattern = "**.php$";
+    std::string cgiPattern = GetCgiPatternOption(settings);
     LOG_INFO << "CGI pattern: " << cgiPattern;
 
     // Hide files patterns.
-    const json_value hide_files = (*appSettings)["web_server"]["hide_files"];
-    std::string hide_files_patterns = "";
-    for (int i = 0; i < 100; i++) {
-        const char* pattern = hide_files[i];
-        if (strlen(pattern)) {
-            if (hide_files_patterns.length())
-                hide_files_patterns.append("|");
-            hide_files_patterns.append("**/").append(pattern).append("$");
-        }
-    }
+    std::string hide_files_patterns = GetHideFilesOption(settings);
     LOG_INFO << "Hide files patterns: " << hide_files_patterns;
 
+    // Additional mime types.
+    std::string extra_mime_types = GetMimeTypesOption(settings);
+    if (extra_mime_types.length())
+        LOG_INFO << "Extra mime types: " << extra_mime_types;
+
+    // Cache-Control rules.
+    std::string cache_rules = GetCacheRulesOption(settings);
+    if (cache_rules.length())
+        LOG_INFO << "Cache rules: " << cache_rules;
+
     // Temp directory.
-    std::string cgi_temp_dir = (*appSettings)["web_server"]["cgi_temp_dir"];
-    cgi_temp_dir = GetAbsolutePath(cgi_temp_dir);
+    std::string cgi_temp_dir =
+            GetAbsolutePath(settings.web_server.cgi_temp_dir);
     if (!cgi_temp_dir.length() || !DirectoryExists(cgi_temp_dir)) {
         if (cgi_temp_dir.length()) {
             LOG_WARNING << "cgi_temp_dir directory does not exist: "
@@ -141,6 +442,42 @@ bool StartWebServer() {
         cgi_temp_dir.assign(GetAnsiTempDirectory());
     }
 
+    // Content hashes of www files, for Etag headers that survive
+    // application updates. One manifest per www directory.
+    unsigned long wwwDirectoryHash = 5381;
+    for (size_t i = 0; i < wwwDirectory.length(); i++) {
+        wwwDirectoryHash = wwwDirectoryHash * 33
+                + static_cast<unsigned char>(wwwDirectory[i]);
+    }
+    char contentHashManifest[MAX_PATH];
+    _snprintf_s(contentHashManifest, sizeof(contentHashManifest), _TRUNCATE,
+                "%s\\phpdesktop-etags-%08lx.txt",
+                GetAnsiTempDirectory().c_str(), wwwDirectoryHash);
+    LOG_DEBUG << "Content hash manifest: " << contentHashManifest;
+
+    // Cache of php responses, in bytes.
+    std::string cgiCacheSize = IntToString(
+            settings.web_server.cgi_cache_size_mb * 1024 * 1024);
+    if (settings.web_server.cgi_cache_size_mb > 0) {
+        LOG_INFO << "CGI cache size: "
+                 << settings.web_server.cgi_cache_size_mb << " MB";
+    }
+
+    // Urls whose identical concurrent requests run php once.
+    std::string coalesce_pattern = GetCoalescePatternOption(settings);
+    if (coalesce_pattern.length())
+        LOG_INFO << "Coalesce pattern: " << coalesce_pattern;
+
+    // Push channel for messages from the application and php to pages.
+    std::string push_url = settings.web_server.push_url;
+    if (push_url.length() && push_url[0] != '/') {
+        LOG_WARNING << "push_url must start with a slash, push channel "
+                       "disabled: " << push_url;
+        push_url = "";
+    } else if (push_url.length()) {
+        LOG_INFO << "Push url: " << push_url;
+    }
+
     // CGI environment variables.
     std::string cgiEnvironment = "";
     cgiEnvironment.append("TMP=").append(cgi_temp_dir).append(",");
@@ -157,6 +494,10 @@ bool StartWebServer() {
     // Let users identify whether web app runs in a normal browser
     // or a phpdesktop browser.
     cgiEnvironment.append("PHPDESKTOP_VERSION=").append(GetPhpDesktopVersion());
+    // Scripts publish to pages by POSTing to this url.
+    if (push_url.length()) {
+        cgiEnvironment.append(",PHPDESKTOP_PUSH_URL=").append(push_url);
+    }
     // Environment from application args
     if (g_cgiEnvironmentFromArgv.length()) {
         cgiEnvironment.append(",").append(g_cgiEnvironmentFromArgv);
@@ -179,6 +520,16 @@ bool StartWebServer() {
         "cgi_environment", cgiEnvironment.c_str(),
         "404_handler", _404_handler.c_str(),
         "hide_files_patterns", hide_files_patterns.c_str(),
+        "extra_mime_types", extra_mime_types.c_str(),
+        "content_hash_manifest", contentHashManifest,
+        "cache_rules", cache_rules.c_str(),
+        "cache_fingerprinted_uris",
+                settings.web_server.cache_fingerprinted_urls ? "yes" : "no",
+        "cgi_cache_size", cgiCacheSize.c_str(),
+        "coalesce_pattern", coalesce_pattern.c_str(),
+        // Remembered pretty urls that have no file, see 404_handler.
+        "route_cache_size", "4096",
+        "push_uri", push_url.c_str(),
         NULL
     };
 
@@ -189,6 +540,10 @@ bool StartWebServer() {
     mg_callbacks callbacks = {0};
     callbacks.log_message = &log_message;
     callbacks.end_request = &end_request;
+    if (g_wwwArchiveOpened)
+        callbacks.open_file_with_time = &open_file_with_time;
+    if (IsTracing())
+        callbacks.trace_event = &trace_event;
     g_mongooseContext = mg_start(&callbacks, NULL, options);
     if (g_mongooseContext == NULL)
         return false;
@@ -204,12 +559,22 @@ bool StartWebServer() {
     }
     LOG_INFO << "Web server url: " << g_webServerUrl;
 
+    AddSettingsListener(&OnSettingsChanged);
     return true;
 }
 
 void StopWebServer() {
     if (g_mongooseContext) {
         LOG_INFO << "Stopping Mongoose web server";
+        double cancelledWallTime = 0, cancelledCpuTime = 0;
+        mg_get_cgi_cancelled_time(g_mongooseContext, &cancelledWallTime,
+                                  &cancelledCpuTime);
+        LOG_INFO << "CGI requests cancelled by client: "
+                 << mg_get_num_cgi_cancelled(g_mongooseContext)
+                 << ", scripts ran wall=" << cancelledWallTime << "s"
+                 << " cpu=" << cancelledCpuTime << "s until terminated";
+        LogCgiScriptStats();
+        LogCgiCacheStats();
         /*
         Stoppping Mongoose webserver freezes for about 30 seconds
         on Win7/MSIE if we call mg_stop(). Introduced new function
@@ -241,3 +606,10 @@ std::string GetWwwDirectory() {
 std::string GetCgiInterpreter() {
     return g_cgiInterpreter;
 }
+int PublishWebServerMessage(const std::string& topic,
+                            const std::string& message) {
+    if (!g_mongooseContext)
+        return -1;
+    return mg_publish(g_mongooseContext, topic.c_str(), message.data(),
+                      message.length());
+}
@@ -9,8 +9,15 @@
 
 bool StartWebServer();
 void StopWebServer();
+void LogCgiScriptStats();
 int GetWebServerPort();
 std::string GetWebServerIpAddress();
 std::string GetWebServerUrl();
 std::string GetWwwDirectory();
 std::string GetCgiInterpreter();
+
+// Sends a message to pages subscribed to topic on web_server.push_url,
+// with a WebSocket or an EventSource. Returns the number of subscribers,
+// or -1 if the push channel is disabled or topic is invalid.
+int PublishWebServerMessage(const std::string& topic,
+                            const std::string& message);
@@ -0,0 +1,519 @@
+// Copyright (c) 2012-2014 The PHP Desktop authors. All rights reserved.
+// License: New BSD License.
+// Website: http://code.google.com/p/phpdesktop/
+
+#include "www_archive.h"
+
+#include <Windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <set>
+
+#include "log.h"
+#include "string_utils.h"
+#include "temp_dir.h"
+
+#define WWW_ARCHIVE_MAGIC "PHPDWWW1"
+#define WWW_ARCHIVE_VERSION 1
+
+// Layout: header, entries sorted by ComparePaths(), path strings, then
+// file contents aligned to 8 bytes. Integers are little-endian and
+// offsets are from the start of the file.
+struct WwwArchiveHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_entries;
+    uint64_t strings_offset;
+    uint64_t data_offset;
+};
+
+struct WwwArchiveEntry {
+    // UTF-8 path relative to www with "/" separators, not terminated.
+    // path_offset is relative to strings_offset.
+    uint32_t path_offset;
+    uint32_t path_length;
+    uint64_t data_offset;
+    uint64_t size;
+    // Unix time.
+    int64_t modification_time;
+};
+
+static_assert(sizeof(WwwArchiveHeader) == 32, "WwwArchiveHeader size");
+static_assert(sizeof(WwwArchiveEntry) == 32, "WwwArchiveEntry size");
+
+const char* g_archiveView = NULL;
+const WwwArchiveEntry* g_archiveEntries = NULL;
+uint32_t g_archiveNumEntries = 0;
+const char* g_archiveStrings = NULL;
+// Entries served from the extraction directory instead of the mapping.
+std::vector<char> g_archiveExtracted;
+std::string g_archiveRoot;
+
+// Windows paths are case-insensitive. Only ASCII is folded, same as
+// what the packer sorted by.
+static inline char FoldPathChar(char c) {
+    if (c >= 'A' && c <= 'Z')
+        return c + ('a' - 'A');
+    if (c == '\\')
+        return '/';
+    return c;
+}
+
+static int ComparePaths(const char* a, size_t a_length,
+                        const char* b, size_t b_length) {
+    size_t length = std::min(a_length, b_length);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char ca = FoldPathChar(a[i]);
+        unsigned char cb = FoldPathChar(b[i]);
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+    }
+    if (a_length == b_length)
+        return 0;
+    return a_length < b_length ? -1 : 1;
+}
+
+static int64_t FileTimeToUnixTime(const FILETIME& file_time) {
+    ULARGE_INTEGER value;
+    value.LowPart = file_time.dwLowDateTime;
+    value.HighPart = file_time.dwHighDateTime;
+    return static_cast<int64_t>(value.QuadPart / 10000000ULL)
+            - 11644473600LL;
+}
+
+static FILETIME UnixTimeToFileTime(int64_t unix_time) {
+    ULARGE_INTEGER value;
+    value.QuadPart = static_cast<uint64_t>(unix_time + 11644473600LL)
+            * 10000000ULL;
+    FILETIME file_time;
+    file_time.dwLowDateTime = value.LowPart;
+    file_time.dwHighDateTime = value.HighPart;
+    return file_time;
+}
+
+// ----------------------------------------------------------------------------
+// Packer
+// ----------------------------------------------------------------------------
+
+struct WwwPackFile {
+    std::string path;
+    std::wstring full_path;
+    uint64_t size;
+    int64_t modification_time;
+};
+
+static bool CompareWwwPackFiles(const WwwPackFile& a, const WwwPackFile& b) {
+    return ComparePaths(a.path.data(), a.path.length(),
+                        b.path.data(), b.path.length()) < 0;
+}
+
+static bool ListWwwFiles(const std::wstring& directory,
+                         const std::string& prefix,
+                         std::vector<WwwPackFile>* files,
+                         std::string* error) {
+    WIN32_FIND_DATAW data;
+    HANDLE find = FindFirstFileW((directory + L"\\*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE) {
+        error->assign("could not list directory: ")
+              .append(WideToUtf8(directory));
+        return false;
+    }
+    bool ok = true;
+    do {
+        std::wstring name = data.cFileName;
+        if (name == L"." || name == L"..")
+            continue;
+        std::string path = prefix + WideToUtf8(name);
+        std::wstring full_path = directory + L"\\" + name;
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            ok = ListWwwFiles(full_path, path + "/", files, error);
+            continue;
+        }
+        WwwPackFile file;
+        file.path = path;
+        file.full_path = full_path;
+        file.size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32)
+                | data.nFileSizeLow;
+        file.modification_time = FileTimeToUnixTime(data.ftLastWriteTime);
+        files->push_back(file);
+    } while (ok && FindNextFileW(find, &data));
+    FindClose(find);
+    return ok;
+}
+
+static uint64_t AlignArchiveOffset(uint64_t offset) {
+    return (offset + 7) & ~static_cast<uint64_t>(7);
+}
+
+static bool WriteArchivePadding(FILE* out, uint64_t from, uint64_t to) {
+    static const char zeros[8] = {0};
+    return fwrite(zeros, 1, static_cast<size_t>(to - from), out)
+            == to - from;
+}
+
+static bool CopyFileToArchive(FILE* out, const WwwPackFile& file,
+                              std::string* error) {
+    FILE* in = NULL;
+    if (_wfopen_s(&in, file.full_path.c_str(), L"rb") != 0 || !in) {
+        error->assign("could not open: ").append(file.path);
+        return false;
+    }
+    char buffer[65536];
+    uint64_t copied = 0;
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, read, out) != read) {
+            fclose(in);
+            error->assign("writing archive failed");
+            return false;
+        }
+        copied += read;
+    }
+    fclose(in);
+    if (copied != file.size) {
+        error->assign("file changed while packing: ").append(file.path);
+        return false;
+    }
+    return true;
+}
+
+bool PackWwwArchive(const std::string& directory,
+                    const std::string& archive_file, std::string* error) {
+    std::vector<WwwPackFile> files;
+    if (!ListWwwFiles(Utf8ToWide(directory), "", &files, error))
+        return false;
+    // The archive may be created inside the directory being packed.
+    std::wstring archive_path = Utf8ToWide(archive_file);
+    for (size_t i = 0; i < files.size(); i++) {
+        if (_wcsicmp(files[i].full_path.c_str(), archive_path.c_str()) == 0) {
+            files.erase(files.begin() + i);
+            break;
+        }
+    }
+    std::sort(files.begin(), files.end(), CompareWwwPackFiles);
+
+    WwwArchiveHeader header = {};
+    memcpy(header.magic, WWW_ARCHIVE_MAGIC, sizeof(header.magic));
+    header.version = WWW_ARCHIVE_VERSION;
+    header.num_entries = static_cast<uint32_t>(files.size());
+    header.strings_offset = sizeof(WwwArchiveHeader)
+            + files.size() * sizeof(WwwArchiveEntry);
+    std::vector<WwwArchiveEntry> entries(files.size());
+    std::string strings;
+    for (size_t i = 0; i < files.size(); i++) {
+        entries[i].path_offset = static_cast<uint32_t>(strings.length());
+        entries[i].path_length = static_cast<uint32_t>(files[i].path.length());
+        entries[i].size = files[i].size;
+        entries[i].modification_time = files[i].modification_time;
+        strings.append(files[i].path);
+    }
+    header.data_offset = AlignArchiveOffset(header.strings_offset
+                                            + strings.length());
+    uint64_t offset = header.data_offset;
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].data_offset = offset;
+        offset = AlignArchiveOffset(offset + entries[i].size);
+    }
+
+    FILE* out = NULL;
+    if (_wfopen_s(&out, Utf8ToWide(archive_file).c_str(), L"wb") != 0
+            || !out) {
+        error->assign("could not create: ").append(archive_file);
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+            && (entries.empty() || fwrite(&entries[0], sizeof(entries[0]),
+                                          entries.size(), out)
+                                   == entries.size())
+            && fwrite(strings.data(), 1, strings.length(), out)
+                    == strings.length()
+            && WriteArchivePadding(out, header.strings_offset
+                                        + strings.length(),
+                                   header.data_offset);
+    if (!ok)
+        error->assign("writing archive failed");
+    for (size_t i = 0; ok && i < files.size(); i++) {
+        ok = CopyFileToArchive(out, files[i], error)
+                && WriteArchivePadding(out,
+                        entries[i].data_offset + entries[i].size,
+                        AlignArchiveOffset(entries[i].data_offset
+                                           + entries[i].size));
+    }
+    if (fclose(out) != 0 && ok) {
+        error->assign("writing archive failed");
+        ok = false;
+    }
+    if (!ok) {
+        _wremove(Utf8ToWide(archive_file).c_str());
+        return false;
+    }
+    LOG_INFO << "Packed " << files.size() << " files from " << directory
+             << " to " << archive_file << " (" << offset << " bytes)";
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Runtime
+// ----------------------------------------------------------------------------
+
+// Paths are used to create files in the extraction directory, so they
+// must not escape it.
+static bool IsSafeArchivePath(const char* path, size_t length) {
+    size_t component_start = 0;
+    for (size_t i = 0; i <= length; i++) {
+        if (i == length || path[i] == '/') {
+            size_t component_length = i - component_start;
+            const char* component = path + component_start;
+            if (component_length == 0
+                    || (component_length == 1 && component[0] == '.')
+                    || (component_length == 2 && component[0] == '.'
+                            && component[1] == '.')) {
+                return false;
+            }
+            component_start = i + 1;
+        } else if (path[i] == '\\' || path[i] == ':' || path[i] == '\0') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool IsValidWwwArchive(const char* view, uint64_t size) {
+    if (size < sizeof(WwwArchiveHeader))
+        return false;
+    const WwwArchiveHeader* header =
+            reinterpret_cast<const WwwArchiveHeader*>(view);
+    if (memcmp(header->magic, WWW_ARCHIVE_MAGIC, sizeof(header->magic)) != 0
+            || header->version != WWW_ARCHIVE_VERSION) {
+        return false;
+    }
+    uint64_t entries_end = sizeof(WwwArchiveHeader)
+            + static_cast<uint64_t>(header->num_entries)
+              * sizeof(WwwArchiveEntry);
+    if (entries_end > header->strings_offset
+            || header->strings_offset > header->data_offset
+            || header->data_offset > size) {
+        return false;
+    }
+    uint64_t strings_size = header->data_offset - header->strings_offset;
+    const WwwArchiveEntry* entries =
+            reinterpret_cast<const WwwArchiveEntry*>(view + sizeof(*header));
+    const char* strings = view + header->strings_offset;
+    for (uint32_t i = 0; i < header->num_entries; i++) {
+        const WwwArchiveEntry& entry = entries[i];
+        if (static_cast<uint64_t>(entry.path_offset) + entry.path_length
+                    > strings_size
+                || entry.data_offset < header->data_offset
+                || entry.data_offset > size
+                || entry.size > size - entry.data_offset
+                || !IsSafeArchivePath(strings + entry.path_offset,
+                                      entry.path_length)) {
+            return false;
+        }
+        // Lookups are a binary search, so the order must be right.
+        if (i && ComparePaths(strings + entries[i - 1].path_offset,
+                              entries[i - 1].path_length,
+                              strings + entry.path_offset,
+                              entry.path_length) >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool MatchesExtension(const std::string& path,
+                             const std::vector<std::string>& extensions) {
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos
+            || path.find('/', dot) != std::string::npos) {
+        return false;
+    }
+    const char* extension = path.c_str() + dot + 1;
+    size_t length = path.length() - dot - 1;
+    for (size_t i = 0; i < extensions.size(); i++) {
+        const std::string& wanted = extensions[i];
+        if (ComparePaths(extension, length,
+                         wanted.data(), wanted.length()) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::wstring ArchivePathToWide(const std::string& root,
+                                      const std::string& path) {
+    return Utf8ToWide(root + "\\" + ReplaceString(path, "/", "\\"));
+}
+
+// The whole directory tree is created, even for directories without
+// extracted files, so that the web server finds directories on disk.
+static void CreateArchiveDirectories(const std::string& root,
+                                     const std::string& path,
+                                     std::set<std::string>* directories) {
+    for (size_t slash = path.find('/'); slash != std::string::npos;
+            slash = path.find('/', slash + 1)) {
+        std::string directory = path.substr(0, slash);
+        if (directories->insert(directory).second) {
+            CreateDirectoryW(ArchivePathToWide(root, directory).c_str(),
+                             NULL);
+        }
+    }
+}
+
+static bool ExtractArchiveEntry(const std::string& root,
+                                const WwwArchiveEntry& entry,
+                                const std::string& path) {
+    std::wstring file_path = ArchivePathToWide(root, path);
+    FILETIME file_time = UnixTimeToFileTime(entry.modification_time);
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (GetFileAttributesExW(file_path.c_str(), GetFileExInfoStandard,
+                             &attributes)
+            && attributes.nFileSizeLow == static_cast<DWORD>(entry.size)
+            && attributes.nFileSizeHigh == static_cast<DWORD>(entry.size >> 32)
+            && CompareFileTime(&attributes.ftLastWriteTime, &file_time) == 0) {
+        // Extracted by a previous run.
+        return true;
+    }
+    HANDLE file = CreateFileW(file_path.c_str(), GENERIC_WRITE, 0, NULL,
+                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    const char* data = g_archiveView + entry.data_offset;
+    uint64_t left = entry.size;
+    bool ok = true;
+    while (ok && left) {
+        DWORD chunk = static_cast<DWORD>(std::min<uint64_t>(left, 1 << 20));
+        DWORD written = 0;
+        ok = WriteFile(file, data, chunk, &written, NULL)
+                && written == chunk;
+        data += chunk;
+        left -= chunk;
+    }
+    ok = ok && SetFileTime(file, NULL, NULL, &file_time);
+    CloseHandle(file);
+    return ok;
+}
+
+std::string OpenWwwArchive(const std::string& archive_file,
+                           const std::vector<std::string>& extract_extensions) {
+    if (g_archiveView)
+        return g_archiveRoot;
+    HANDLE file = CreateFileW(Utf8ToWide(archive_file).c_str(), GENERIC_READ,
+                              FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        LOG_ERROR << "Could not open www archive: " << archive_file;
+        return "";
+    }
+    LARGE_INTEGER file_size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0
+            && static_cast<uint64_t>(file_size.QuadPart)
+                   <= static_cast<size_t>(-1)) {
+        mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    // The mapping keeps the file open and the view keeps the mapping.
+    CloseHandle(file);
+    const char* view = NULL;
+    if (mapping) {
+        view = static_cast<const char*>(
+                MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        CloseHandle(mapping);
+    }
+    if (!view) {
+        LOG_ERROR << "Could not map www archive: " << archive_file;
+        return "";
+    }
+    if (!IsValidWwwArchive(view, file_size.QuadPart)) {
+        LOG_ERROR << "Invalid www archive: " << archive_file;
+        UnmapViewOfFile(view);
+        return "";
+    }
+    const WwwArchiveHeader* header =
+            reinterpret_cast<const WwwArchiveHeader*>(view);
+    g_archiveView = view;
+    g_archiveEntries =
+            reinterpret_cast<const WwwArchiveEntry*>(view + sizeof(*header));
+    g_archiveNumEntries = header->num_entries;
+    g_archiveStrings = view + header->strings_offset;
+
+    // One extraction directory per archive index (FNV-1a), so that
+    // different applications and versions do not share files.
+    uint32_t hash = 2166136261U;
+    for (uint64_t i = 0; i < header->data_offset; i++) {
+        hash = (hash ^ static_cast<unsigned char>(view[i])) * 16777619U;
+    }
+    char hash_string[9];
+    sprintf_s(hash_string, sizeof(hash_string), "%08x", hash);
+    std::string root = GetAnsiTempDirectory();
+    if (root.length() && (root[root.length() - 1] == '\\'
+                          || root[root.length() - 1] == '/')) {
+        root.erase(root.length() - 1);
+    }
+    root.append("\\phpdesktop-www-").append(hash_string);
+    CreateDirectoryW(Utf8ToWide(root).c_str(), NULL);
+
+    g_archiveExtracted.assign(g_archiveNumEntries, 0);
+    std::set<std::string> directories;
+    int num_extracted = 0;
+    for (uint32_t i = 0; i < g_archiveNumEntries; i++) {
+        const WwwArchiveEntry& entry = g_archiveEntries[i];
+        std::string path(g_archiveStrings + entry.path_offset,
+                         entry.path_length);
+        CreateArchiveDirectories(root, path, &directories);
+        if (!MatchesExtension(path, extract_extensions))
+            continue;
+        // Never served from the mapping, even if extracting failed, so
+        // that scripts are not sent as plain text.
+        g_archiveExtracted[i] = 1;
+        if (ExtractArchiveEntry(root, entry, path)) {
+            num_extracted++;
+        } else {
+            LOG_WARNING << "Could not extract from www archive: " << path;
+        }
+    }
+    LOG_INFO << "WWW archive: " << archive_file << " (" << g_archiveNumEntries
+             << " files, " << num_extracted << " extracted to " << root
+             << ")";
+    g_archiveRoot = root;
+    return root;
+}
+
+const char* GetWwwArchiveFile(const char* path, size_t* size,
+                              time_t* modification_time) {
+    if (!g_archiveView)
+        return NULL;
+    // Strip the document root, mongoose appends the uri to it.
+    size_t root_length = g_archiveRoot.length();
+    if (ComparePaths(path, std::min(strlen(path), root_length),
+                     g_archiveRoot.data(), root_length) != 0
+            || (path[root_length] != '/' && path[root_length] != '\\')) {
+        return NULL;
+    }
+    const char* relative = path + root_length + 1;
+    size_t relative_length = strlen(relative);
+    uint32_t low = 0;
+    uint32_t high = g_archiveNumEntries;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        const WwwArchiveEntry& entry = g_archiveEntries[middle];
+        int result = ComparePaths(g_archiveStrings + entry.path_offset,
+                                  entry.path_length,
+                                  relative, relative_length);
+        if (result < 0) {
+            low = middle + 1;
+        } else if (result > 0) {
+            high = middle;
+        } else {
+            if (g_archiveExtracted[middle])
+                return NULL;
+            *size = static_cast<size_t>(entry.size);
+            *modification_time =
+                    static_cast<time_t>(entry.modification_time);
+            return g_archiveView + entry.data_offset;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,38 @@
+// Copyright (c) 2012-2014 The PHP Desktop authors. All rights reserved.
+// License: New BSD License.
+// Website: http://code.google.com/p/phpdesktop/
+
+#pragma once
+
+#include "defines.h"
+#include <time.h>
+#include <string>
+#include <vector>
+
+// Packed www directory, enabled with "web_server.www_archive". The
+// archive is one file with a path table sorted case-insensitively,
+// followed by the file contents. It is memory mapped and static files
+// are served straight from the mapping, so startup and first requests
+// do not open thousands of loose files.
+//
+// php-cgi needs real files, so files with cgi_extensions and
+// www_archive_extract extensions are extracted to a directory in temp,
+// which also becomes the document root. Files already extracted by a
+// previous run are kept when their size and time did not change.
+// Precompressed files packed as "file.ext.gz" without "file.ext" are
+// served with Content-Encoding gzip by the web server's usual lookup.
+//
+// Create an archive with "phpdesktop-chrome.exe --pack-www=www.dat",
+// which packs www_directory and exits.
+
+bool PackWwwArchive(const std::string& directory,
+                    const std::string& archive_file, std::string* error);
+
+// Returns the directory to use as document root, empty on failure.
+std::string OpenWwwArchive(const std::string& archive_file,
+                           const std::vector<std::string>& extract_extensions);
+
+// Returns the contents of a packed file for a path in the document
+// root, or NULL if it is not packed or was extracted to disk.
+const char* GetWwwArchiveFile(const char* path, size_t* size,
+                              time_t* modification_time);